@@ -53,11 +53,34 @@
 //     separate from the current triangle depth sorting.
 //
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include <ctype.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pick a SIMD instruction set for the transform and clip kernels. WebAssembly builds get SIMD128
+// when compiled with -msimd128, native builds use SSE, anything else falls back to scalar code.
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define OLCENGINE3D_SIMD_WASM
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define OLCENGINE3D_SIMD_SSE
+#endif
 
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
@@ -71,6 +94,23 @@ struct vec3d
   float w = 1.0f;
 };
 
+struct vec2d
+{
+  // Texture coordinates. After projection u and v are divided by the depth and w holds the
+  // reciprocal of the depth, such that all three can be interpolated linearly in screen space.
+  float u = 0.0f;
+  float v = 0.0f;
+  float w = 1.0f;
+};
+
+struct qvec3d
+{
+  // Position quantized to 16 bits per component, relative to the bounding box of its mesh.
+  uint16_t x = 0;
+  uint16_t y = 0;
+  uint16_t z = 0;
+};
+
 struct mat4x4
 {
   float m[4][4] = { 0.0f };
@@ -87,22 +127,42 @@ struct coordsys
 struct triangle
 {
   vec3d p[3];
+  vec2d t[3];
   olc::Pixel fillColor;
   olc::Pixel wireColor;
+  int nMeshTriangle = -1;  // The mesh triangle it is (a clipped part of), if any.
 };
 
 struct mesh
 {
   std::vector<triangle> tris;
 
+  // Indexed form of the same triangles, i.e. the vertex buffer and three indices into it per
+  // triangle. The triangle list above is rebuilt from these whenever they are reordered.
+  std::vector<vec3d> verts;
+  std::vector<int> indices;
+
+  // Texture coordinates, with three indices into uvs per triangle. Empty for untextured meshes.
+  std::vector<vec2d> uvs;
+  std::vector<int> uvIndices;
+
+  // Optional quantized vertex buffer, used instead of verts when not empty. A position is
+  // dequantized as qOrigin + q * qScale, per component.
+  std::vector<qvec3d> qverts;
+  vec3d qOrigin, qScale;
+
   bool LoadFromObjectFile(std::string sFilename)
   {
     std::ifstream f(sFilename);
     if (!f.is_open())
       return false;
 
-    // Local cache of verts
-    std::vector<vec3d> verts;
+    tris.clear();
+    verts.clear();
+    indices.clear();
+    uvs.clear();
+    uvIndices.clear();
+    bool bAnyUV = false;
 
     while (!f.eof())
     {
@@ -114,7 +174,13 @@ struct mesh
 
       char junk;
 
-      if (line[0] == 'v')
+      if (line[0] == 'v' && line[1] == 't')
+      {
+        vec2d t;
+        s >> junk >> junk >> t.u >> t.v;
+        uvs.push_back(t);
+      }
+      else if (line[0] == 'v' && line[1] == ' ')
       {
         vec3d v;
         s >> junk >> v.x >> v.y >> v.z;
@@ -123,13 +189,53 @@ struct mesh
 
       if (line[0] == 'f')
       {
-        int f[3];
-        s >> junk >> f[0] >> f[1] >> f[2];
-        tris.push_back({ verts[f[0]-1], verts[f[1]-1], verts[f[2]-1] });
+        // A face corner is either "v", "v/vt", "v/vt/vn" or "v//vn". Normals are ignored.
+        std::string corner[3];
+        s >> junk >> corner[0] >> corner[1] >> corner[2];
+        for (int k = 0; k < 3; k++)
+        {
+          indices.push_back(atoi(corner[k].c_str()) - 1);
+          size_t slash = corner[k].find('/');
+          if (slash != std::string::npos && slash + 1 < corner[k].size() && corner[k][slash + 1] != '/')
+          {
+            uvIndices.push_back(atoi(corner[k].c_str() + slash + 1) - 1);
+            bAnyUV = true;
+          }
+          else
+            uvIndices.push_back(-1);
+        }
       }
     }
+
+    // Corners without texture coordinates in an otherwise textured mesh get (0, 0).
+    if (!bAnyUV)
+      uvIndices.clear();
+    else if (std::find(uvIndices.begin(), uvIndices.end(), -1) != uvIndices.end())
+    {
+      uvs.push_back({ 0.0f, 0.0f });
+      std::replace(uvIndices.begin(), uvIndices.end(), -1, (int)uvs.size() - 1);
+    }
+
+    RebuildTrianglesFromIndices();
     return true;
   }
+
+  void RebuildTrianglesFromIndices()
+  {
+    tris.clear();
+    tris.reserve(indices.size() / 3);
+    for (size_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+      triangle tri;
+      for (int k = 0; k < 3; k++)
+      {
+        tri.p[k] = verts[indices[i + k]];
+        if (!uvIndices.empty())
+          tri.t[k] = uvs[uvIndices[i + k]];
+      }
+      tris.push_back(tri);
+    }
+  }
 };
 
 
@@ -198,13 +304,91 @@ vec3d Vec3d_ApplyTransform(vec3d &vi, mat4x4 &m)
   return vo;
 }
 
-vec3d Vec3d_WhereLineIntersectsPlane(vec3d &plane_p, vec3d &plane_n, vec3d &lineStart, vec3d &lineEnd)
+void Vec3d_ApplyTransformBatchQuantized(const qvec3d *vi, vec3d *vo, int nCount, mat4x4 &m)
+{
+  // Same as Vec3d_ApplyTransformBatch, but for quantized positions. The matrix should include the
+  // dequantization (see Mesh_MakeDequantizeTransform), so decoding is just the conversion of the
+  // integers to floats, and the implicit w of 1 means the last column is simply added.
+#if defined(OLCENGINE3D_SIMD_WASM)
+  v128_t c0 = wasm_f32x4_make(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0]);
+  v128_t c1 = wasm_f32x4_make(m.m[0][1], m.m[1][1], m.m[2][1], m.m[3][1]);
+  v128_t c2 = wasm_f32x4_make(m.m[0][2], m.m[1][2], m.m[2][2], m.m[3][2]);
+  v128_t c3 = wasm_f32x4_make(m.m[0][3], m.m[1][3], m.m[2][3], m.m[3][3]);
+  for (int i = 0; i < nCount; i++)
+  {
+    v128_t r = wasm_f32x4_add(c3, wasm_f32x4_mul(c0, wasm_f32x4_splat((float)vi[i].x)));
+    r = wasm_f32x4_add(r, wasm_f32x4_mul(c1, wasm_f32x4_splat((float)vi[i].y)));
+    r = wasm_f32x4_add(r, wasm_f32x4_mul(c2, wasm_f32x4_splat((float)vi[i].z)));
+    wasm_v128_store(&vo[i], r);
+  }
+#elif defined(OLCENGINE3D_SIMD_SSE)
+  __m128 c0 = _mm_setr_ps(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0]);
+  __m128 c1 = _mm_setr_ps(m.m[0][1], m.m[1][1], m.m[2][1], m.m[3][1]);
+  __m128 c2 = _mm_setr_ps(m.m[0][2], m.m[1][2], m.m[2][2], m.m[3][2]);
+  __m128 c3 = _mm_setr_ps(m.m[0][3], m.m[1][3], m.m[2][3], m.m[3][3]);
+  for (int i = 0; i < nCount; i++)
+  {
+    __m128 r = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_set1_ps((float)vi[i].x)));
+    r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps((float)vi[i].y)));
+    r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps((float)vi[i].z)));
+    _mm_storeu_ps(&vo[i].x, r);
+  }
+#else
+  for (int i = 0; i < nCount; i++)
+  {
+    vec3d v = { (float)vi[i].x, (float)vi[i].y, (float)vi[i].z };
+    vo[i] = Vec3d_ApplyTransform(v, m);
+  }
+#endif
+}
+
+void Vec3d_ApplyTransformBatch(const vec3d *vi, vec3d *vo, int nCount, mat4x4 &m)
+{
+  // Same as Vec3d_ApplyTransform, but for a whole array of vectors at once. A vec3d is exactly
+  // four floats, so each vector fits one SIMD register and the result is the sum of the matrix's
+  // columns scaled by the vector's components.
+#if defined(OLCENGINE3D_SIMD_WASM)
+  v128_t c0 = wasm_f32x4_make(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0]);
+  v128_t c1 = wasm_f32x4_make(m.m[0][1], m.m[1][1], m.m[2][1], m.m[3][1]);
+  v128_t c2 = wasm_f32x4_make(m.m[0][2], m.m[1][2], m.m[2][2], m.m[3][2]);
+  v128_t c3 = wasm_f32x4_make(m.m[0][3], m.m[1][3], m.m[2][3], m.m[3][3]);
+  for (int i = 0; i < nCount; i++)
+  {
+    v128_t r = wasm_f32x4_mul(c0, wasm_f32x4_splat(vi[i].x));
+    r = wasm_f32x4_add(r, wasm_f32x4_mul(c1, wasm_f32x4_splat(vi[i].y)));
+    r = wasm_f32x4_add(r, wasm_f32x4_mul(c2, wasm_f32x4_splat(vi[i].z)));
+    r = wasm_f32x4_add(r, wasm_f32x4_mul(c3, wasm_f32x4_splat(vi[i].w)));
+    wasm_v128_store(&vo[i], r);
+  }
+#elif defined(OLCENGINE3D_SIMD_SSE)
+  __m128 c0 = _mm_setr_ps(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0]);
+  __m128 c1 = _mm_setr_ps(m.m[0][1], m.m[1][1], m.m[2][1], m.m[3][1]);
+  __m128 c2 = _mm_setr_ps(m.m[0][2], m.m[1][2], m.m[2][2], m.m[3][2]);
+  __m128 c3 = _mm_setr_ps(m.m[0][3], m.m[1][3], m.m[2][3], m.m[3][3]);
+  for (int i = 0; i < nCount; i++)
+  {
+    __m128 r = _mm_mul_ps(c0, _mm_set1_ps(vi[i].x));
+    r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(vi[i].y)));
+    r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(vi[i].z)));
+    r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(vi[i].w)));
+    _mm_storeu_ps(&vo[i].x, r);
+  }
+#else
+  for (int i = 0; i < nCount; i++)
+  {
+    vec3d v = vi[i];
+    vo[i] = Vec3d_ApplyTransform(v, m);
+  }
+#endif
+}
+
+vec3d Vec3d_WhereLineIntersectsPlane(vec3d &plane_p, vec3d &plane_n, vec3d &lineStart, vec3d &lineEnd, float &t)
 {
   plane_n = Vec3d_Normalize(plane_n);
   float plane_d = -Vec3d_DotProduct(plane_n, plane_p);
   float ad = Vec3d_DotProduct(lineStart, plane_n);
   float bd = Vec3d_DotProduct(lineEnd, plane_n);
-  float t = (-plane_d - ad) / (bd - ad);
+  t = (-plane_d - ad) / (bd - ad);
   vec3d lineStartToEnd = Vec3d_Sub(lineEnd, lineStart);
   vec3d lineStartToIntersect = Vec3d_Mul(lineStartToEnd, t);
   return Vec3d_Add(lineStart, lineStartToIntersect);
@@ -401,6 +585,13 @@ void CoordSys_RotateW(coordsys &cs, float fAngle)
   cs.v = Vec3d_ApplyTransform(cs.v, matRotation);
 }
 
+bool CoordSys_IsEqual(coordsys &cs1, coordsys &cs2)
+{
+  // Exact comparison, to detect whether a coordinate system has changed at all.
+  auto equal = [](vec3d &v1, vec3d &v2) { return v1.x == v2.x && v1.y == v2.y && v1.z == v2.z; };
+  return equal(cs1.o, cs2.o) && equal(cs1.u, cs2.u) && equal(cs1.v, cs2.v) && equal(cs1.w, cs2.w);
+}
+
 
 // Triangle operations
 vec3d Triangle_Centroid(triangle &tri)
@@ -412,6 +603,78 @@ vec3d Triangle_Centroid(triangle &tri)
   return centroid;
 }
 
+bool Triangle_IsInsideBox(triangle &tri, vec3d &boxMin, vec3d &boxMax)
+{
+  // Returns whether all three points lie within the axis-aligned box (bounds inclusive), in which
+  // case clipping against the box's planes would return the triangle unchanged. The w-components
+  // of the box should be set to -INFINITY and INFINITY respectively, so they never reject.
+#if defined(OLCENGINE3D_SIMD_WASM)
+  v128_t lo = wasm_v128_load(&boxMin);
+  v128_t hi = wasm_v128_load(&boxMax);
+  v128_t inside = wasm_v128_and(wasm_f32x4_ge(wasm_v128_load(&tri.p[0]), lo), wasm_f32x4_le(wasm_v128_load(&tri.p[0]), hi));
+  inside = wasm_v128_and(inside, wasm_v128_and(wasm_f32x4_ge(wasm_v128_load(&tri.p[1]), lo), wasm_f32x4_le(wasm_v128_load(&tri.p[1]), hi)));
+  inside = wasm_v128_and(inside, wasm_v128_and(wasm_f32x4_ge(wasm_v128_load(&tri.p[2]), lo), wasm_f32x4_le(wasm_v128_load(&tri.p[2]), hi)));
+  return wasm_i32x4_all_true(inside);
+#elif defined(OLCENGINE3D_SIMD_SSE)
+  __m128 lo = _mm_loadu_ps(&boxMin.x);
+  __m128 hi = _mm_loadu_ps(&boxMax.x);
+  __m128 inside = _mm_and_ps(_mm_cmpge_ps(_mm_loadu_ps(&tri.p[0].x), lo), _mm_cmple_ps(_mm_loadu_ps(&tri.p[0].x), hi));
+  inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(_mm_loadu_ps(&tri.p[1].x), lo), _mm_cmple_ps(_mm_loadu_ps(&tri.p[1].x), hi)));
+  inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(_mm_loadu_ps(&tri.p[2].x), lo), _mm_cmple_ps(_mm_loadu_ps(&tri.p[2].x), hi)));
+  return _mm_movemask_ps(inside) == 0xF;
+#else
+  for (int i = 0; i < 3; i++)
+    if (tri.p[i].x < boxMin.x || tri.p[i].x > boxMax.x ||
+        tri.p[i].y < boxMin.y || tri.p[i].y > boxMax.y ||
+        tri.p[i].z < boxMin.z || tri.p[i].z > boxMax.z)
+      return false;
+  return true;
+#endif
+}
+
+vec3d Triangle_ClosestPoint(vec3d &p, vec3d &a, vec3d &b, vec3d &c)
+{
+  // Closest point to p on the triangle abc, see "Real-Time Collision Detection" by C. Ericson.
+  vec3d ab = Vec3d_Sub(b, a), ac = Vec3d_Sub(c, a), ap = Vec3d_Sub(p, a);
+  float d1 = Vec3d_DotProduct(ab, ap), d2 = Vec3d_DotProduct(ac, ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+  vec3d bp = Vec3d_Sub(p, b);
+  float d3 = Vec3d_DotProduct(ab, bp), d4 = Vec3d_DotProduct(ac, bp);
+  if (d3 >= 0.0f && d4 <= d3) return b;
+
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+  {
+    vec3d r = Vec3d_Mul(ab, d1 / (d1 - d3));
+    return Vec3d_Add(a, r);
+  }
+
+  vec3d cp = Vec3d_Sub(p, c);
+  float d5 = Vec3d_DotProduct(ab, cp), d6 = Vec3d_DotProduct(ac, cp);
+  if (d6 >= 0.0f && d5 <= d6) return c;
+
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+  {
+    vec3d r = Vec3d_Mul(ac, d2 / (d2 - d6));
+    return Vec3d_Add(a, r);
+  }
+
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+  {
+    vec3d bc = Vec3d_Sub(c, b);
+    vec3d r = Vec3d_Mul(bc, (d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    return Vec3d_Add(b, r);
+  }
+
+  float denom = 1.0f / (va + vb + vc);
+  vec3d r1 = Vec3d_Mul(ab, vb * denom), r2 = Vec3d_Mul(ac, vc * denom);
+  vec3d r = Vec3d_Add(r1, r2);
+  return Vec3d_Add(a, r);
+}
+
 int Triangle_ClipAgainstPlane(vec3d plane_p, vec3d plane_n, triangle &in_tri, triangle &out_tri1, triangle &out_tri2)
 {
   // Returns how many triangles resulted from the clipping (can be 0, 1 or 2).
@@ -431,18 +694,31 @@ int Triangle_ClipAgainstPlane(vec3d plane_p, vec3d plane_n, triangle &in_tri, tr
   // If the distance from the point to the plane is positive, it is considered to be "inside".
   vec3d* inside_points[3]; int nInsidePointCount = 0;
   vec3d* outside_points[3]; int nOutsidePointCount = 0;
+  vec2d* inside_tex[3]; int nInsideTexCount = 0;
+  vec2d* outside_tex[3]; int nOutsideTexCount = 0;
 
   // Get the signed distance of each point in the triangle to the plane.
   float d0 = dist(in_tri.p[0]);
   float d1 = dist(in_tri.p[1]);
   float d2 = dist(in_tri.p[2]);
 
-  if (d0 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[0]; }
-  else { outside_points[nOutsidePointCount++] = &in_tri.p[0]; }
-  if (d1 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[1]; }
-  else { outside_points[nOutsidePointCount++] = &in_tri.p[1]; }
-  if (d2 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[2]; }
-  else { outside_points[nOutsidePointCount++] = &in_tri.p[2]; }
+  if (d0 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[0]; inside_tex[nInsideTexCount++] = &in_tri.t[0]; }
+  else { outside_points[nOutsidePointCount++] = &in_tri.p[0]; outside_tex[nOutsideTexCount++] = &in_tri.t[0]; }
+  if (d1 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[1]; inside_tex[nInsideTexCount++] = &in_tri.t[1]; }
+  else { outside_points[nOutsidePointCount++] = &in_tri.p[1]; outside_tex[nOutsideTexCount++] = &in_tri.t[1]; }
+  if (d2 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[2]; inside_tex[nInsideTexCount++] = &in_tri.t[2]; }
+  else { outside_points[nOutsidePointCount++] = &in_tri.p[2]; outside_tex[nOutsideTexCount++] = &in_tri.t[2]; }
+
+  // Texture coordinates at the same fraction t along an edge as the intersected point.
+  auto lerpTex = [](vec2d &a, vec2d &b, float t)
+  {
+    vec2d r;
+    r.u = a.u + t * (b.u - a.u);
+    r.v = a.v + t * (b.v - a.v);
+    r.w = a.w + t * (b.w - a.w);
+    return r;
+  };
+  float t;
 
   // Now classify the triangle points, and break the input triangle into
   // smaller output triangles if required. There are four possible outcomes.
@@ -472,14 +748,18 @@ int Triangle_ClipAgainstPlane(vec3d plane_p, vec3d plane_n, triangle &in_tri, tr
     // Copy triangle appearance info to the new triangle.
     out_tri1.fillColor = in_tri.fillColor;
     out_tri1.wireColor = in_tri.wireColor;
+    out_tri1.nMeshTriangle = in_tri.nMeshTriangle;
 
     // The inside point is valid, so keep that.
     out_tri1.p[0] = *inside_points[0];
+    out_tri1.t[0] = *inside_tex[0];
 
     // The two new points are at the location where the original sides of
     // the triangle intersect with the plane.
-    out_tri1.p[1] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
-    out_tri1.p[2] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[0], *outside_points[1]);
+    out_tri1.p[1] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[0], *outside_points[0], t);
+    out_tri1.t[1] = lerpTex(*inside_tex[0], *outside_tex[0], t);
+    out_tri1.p[2] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[0], *outside_points[1], t);
+    out_tri1.t[2] = lerpTex(*inside_tex[0], *outside_tex[1], t);
 
     // Here we could make sure that the new triangle's normal is the same as
     // the original triangle's normal and flip points around if needed, but
@@ -498,23 +778,31 @@ int Triangle_ClipAgainstPlane(vec3d plane_p, vec3d plane_n, triangle &in_tri, tr
     // Copy triangle appearance info to the new triangles.
     out_tri1.fillColor = in_tri.fillColor;
     out_tri1.wireColor = in_tri.wireColor;
+    out_tri1.nMeshTriangle = in_tri.nMeshTriangle;
 
     out_tri2.fillColor = in_tri.fillColor;
     out_tri2.wireColor = in_tri.wireColor;
+    out_tri2.nMeshTriangle = in_tri.nMeshTriangle;
 
     // The first triangle consists of the two inside points and a new point
     // determined by the location where one side of the triangle intersects
     // with the plane.
     out_tri1.p[0] = *inside_points[0];
+    out_tri1.t[0] = *inside_tex[0];
     out_tri1.p[1] = *inside_points[1];
-    out_tri1.p[2] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
+    out_tri1.t[1] = *inside_tex[1];
+    out_tri1.p[2] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[0], *outside_points[0], t);
+    out_tri1.t[2] = lerpTex(*inside_tex[0], *outside_tex[0], t);
 
     // The second triangle is composed of one of the inside points, a new
     // point determined by the intersection of the other side of the triangle,
     // and the newly created point above.
     out_tri2.p[0] = *inside_points[1];
+    out_tri2.t[0] = *inside_tex[1];
     out_tri2.p[1] = out_tri1.p[2];
-    out_tri2.p[2] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[1], *outside_points[0]);
+    out_tri2.t[1] = out_tri1.t[2];
+    out_tri2.p[2] = Vec3d_WhereLineIntersectsPlane(plane_p, plane_n, *inside_points[1], *outside_points[0], t);
+    out_tri2.t[2] = lerpTex(*inside_tex[1], *outside_tex[0], t);
 
     return 2;  // Return two newly formed triangles which together form a quad.
   }
@@ -524,191 +812,2537 @@ int Triangle_ClipAgainstPlane(vec3d plane_p, vec3d plane_n, triangle &in_tri, tr
 }
 
 
-// The 3D graphics engine class.
-class olcEngine3D : public olc::PixelGameEngine
+// Mesh operations
+void Mesh_GeneratePlanarUVs(mesh &m, float fScale)
 {
-public:
-  olcEngine3D()
+  // Projects the texture onto the mesh from above, repeating it every fScale units along the X-
+  // and Y-axes. Meant for terrain without texture coordinates of its own.
+  m.uvs.clear();
+  for (auto &v : m.verts)
+    m.uvs.push_back({ v.x / fScale, v.y / fScale });
+  m.uvIndices = m.indices;
+  m.RebuildTrianglesFromIndices();
+}
+
+float Mesh_QuantizeVertices(mesh &m)
+{
+  // Stores the vertex buffer as 16-bit integers per component relative to the mesh's bounding
+  // box, i.e. 6 instead of 16 bytes per position, and releases the float vertices and the
+  // triangle list. Returns the largest error this introduces in any coordinate.
+  if (m.verts.empty())
+    return 0.0f;
+
+  vec3d vMin = m.verts[0], vMax = m.verts[0];
+  for (auto &v : m.verts)
   {
-    sAppName = "3D Demo";
+    vMin.x = std::min(vMin.x, v.x); vMax.x = std::max(vMax.x, v.x);
+    vMin.y = std::min(vMin.y, v.y); vMax.y = std::max(vMax.y, v.y);
+    vMin.z = std::min(vMin.z, v.z); vMax.z = std::max(vMax.z, v.z);
   }
+  m.qOrigin = vMin;
+  m.qScale.x = (vMax.x > vMin.x) ? (vMax.x - vMin.x) / 65535.0f : 1.0f;
+  m.qScale.y = (vMax.y > vMin.y) ? (vMax.y - vMin.y) / 65535.0f : 1.0f;
+  m.qScale.z = (vMax.z > vMin.z) ? (vMax.z - vMin.z) / 65535.0f : 1.0f;
 
-private:
-  mesh meshLocal;  // The drawn object in local space.
-  float meshDeltaTheta;  // Setting for how fast the mesh should rotate.
-  float meshCurrentTheta; // Used to keep track of the mesh's current rotation angle, updated at every frame.
-  vec3d meshTranslation;  // Used to keep track of the mesh's current translation.
+  auto quantize = [](float f, float fOrigin, float fScale)
+  {
+    return (uint16_t)std::clamp((int)lroundf((f - fOrigin) / fScale), 0, 65535);
+  };
 
-  coordsys csCamera;  // Used to keep track of the current position and orientation of the camera.
-  float fFovDeg, fNear, fFar, fAspectRatio;  // Camera settings.
+  float fMaxError = 0.0f;
+  m.qverts.resize(m.verts.size());
+  for (size_t i = 0; i < m.verts.size(); i++)
+  {
+    vec3d &v = m.verts[i];
+    qvec3d &q = m.qverts[i];
+    q.x = quantize(v.x, m.qOrigin.x, m.qScale.x);
+    q.y = quantize(v.y, m.qOrigin.y, m.qScale.y);
+    q.z = quantize(v.z, m.qOrigin.z, m.qScale.z);
+    fMaxError = std::max(fMaxError, fabsf(m.qOrigin.x + q.x * m.qScale.x - v.x));
+    fMaxError = std::max(fMaxError, fabsf(m.qOrigin.y + q.y * m.qScale.y - v.y));
+    fMaxError = std::max(fMaxError, fabsf(m.qOrigin.z + q.z * m.qScale.z - v.z));
+  }
 
-  mat4x4 matCameraToProjected;  // Matrix to transform from camera space to normalized projection space.
-  mat4x4 matProjectedToScreen;  // Matrix to transform from normalized projection space to screen space.
+  std::vector<vec3d>().swap(m.verts);
+  std::vector<triangle>().swap(m.tris);
+  return fMaxError;
+}
 
-  olc::Pixel colorDay, colorNight, colorSky, colorGrass, colorMountain, colorSnow;
-  vec3d lightDirection;  // Direction of the light, we assume the source is infinitely far away.
+mat4x4 Mesh_MakeDequantizeTransform(mesh &m)
+{
+  // Transformation from quantized integer coordinates back to the mesh's local space.
+  mat4x4 matrix;
+  matrix.m[0][0] = m.qScale.x; matrix.m[0][3] = m.qOrigin.x;
+  matrix.m[1][1] = m.qScale.y; matrix.m[1][3] = m.qOrigin.y;
+  matrix.m[2][2] = m.qScale.z; matrix.m[2][3] = m.qOrigin.z;
+  matrix.m[3][3] = 1.0f;
+  return matrix;
+}
 
-public:
-  bool OnUserCreate() override
+float Mesh_ComputeACMR(std::vector<int> &indices, int nCacheSize)
+{
+  // Average cache miss ratio, i.e. the average number of vertices that have to be transformed
+  // per triangle when the post-transform results are kept in a FIFO cache of the given size.
+  // It lies between ~0.5 (perfect reuse on a regular grid) and 3.0 (no reuse at all).
+  if (indices.size() < 3)
+    return 0.0f;
+
+  std::deque<int> cache;
+  int nMisses = 0;
+  for (int i : indices)
   {
-    // Initialize a mesh in local space.
-    // meshLocal.tris = {  // Unit cube centered on the origin.
-    //   // SOUTH
-    //   { -0.5f,  0.5f, -0.5f, 1.0f,    -0.5f, -0.5f, -0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f },
-    //   { -0.5f,  0.5f, -0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f,    -0.5f,  0.5f,  0.5f, 1.0f },
-    //   // EAST
-    //   { -0.5f, -0.5f, -0.5f, 1.0f,     0.5f, -0.5f, -0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f },
-    //   { -0.5f, -0.5f, -0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f },
-    //   // NORTH
-    //   {  0.5f, -0.5f, -0.5f, 1.0f,     0.5f,  0.5f, -0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f },
-    //   {  0.5f, -0.5f, -0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f },
-    //   // WEST
-    //   {  0.5f,  0.5f, -0.5f, 1.0f,    -0.5f,  0.5f, -0.5f, 1.0f,    -0.5f,  0.5f,  0.5f, 1.0f },
-    //   {  0.5f,  0.5f, -0.5f, 1.0f,    -0.5f,  0.5f,  0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f },
-    //   // TOP
-    //   { -0.5f,  0.5f,  0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f },
-    //   { -0.5f,  0.5f,  0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f },
-    //   // BOTTOM
-    //   { -0.5f, -0.5f, -0.5f, 1.0f,    -0.5f,  0.5f, -0.5f, 1.0f,     0.5f,  0.5f, -0.5f, 1.0f },
-    //   { -0.5f, -0.5f, -0.5f, 1.0f,     0.5f,  0.5f, -0.5f, 1.0f,     0.5f, -0.5f, -0.5f, 1.0f },
-    // }; meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.4f;
-    // meshLocal.LoadFromObjectFile("axes.obj"); meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.0f;
-    // meshLocal.LoadFromObjectFile("teapot.obj"); meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.0f;
-    meshLocal.LoadFromObjectFile("mountains.obj"); meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.0f;
-    meshCurrentTheta = 0.0f;
-    std::cout << "Loaded " << meshLocal.tris.size() << " triangles." << std::endl;
+    if (std::find(cache.begin(), cache.end(), i) != cache.end())
+      continue;
+    nMisses++;
+    cache.push_back(i);
+    if ((int)cache.size() > nCacheSize)
+      cache.pop_front();
+  }
+  return (float)nMisses / (float)(indices.size() / 3);
+}
 
-    // Initial camera coordinate system. Updated with user input.
-    vec3d vCameraPosition = { 0.0f, -17.5f, -15.0f };
-    vec3d vCameraTarget = { 1.0f, -17.5f, -15.0f };
-    vec3d vCameraUp = { 0.0f, 0.0f, 1.0f };
-    csCamera = CoordSys_LookAt(vCameraPosition, vCameraTarget, vCameraUp);
+void Mesh_OptimizeVertexCache(mesh &m)
+{
+  // Reorder the triangles for post-transform vertex cache reuse using Tom Forsyth's "Linear-Speed
+  // Vertex Cache Optimisation". Every vertex gets a score based on its position in a simulated LRU
+  // cache and on the number of triangles still using it, and we greedily emit the triangle with
+  // the highest summed score. Afterwards the vertex buffer is reordered in order of first use,
+  // such that fetching the vertices also walks through memory (mostly) linearly.
+  const int nCacheSize = 32;
+  const float fCacheDecayPower = 1.5f;
+  const float fLastTriScore = 0.75f;
+  const float fValenceBoostScale = 2.0f;
+  const float fValenceBoostPower = 0.5f;
 
-    // Camera settings.
-    fFovDeg = 90.0f; fNear = 0.1f; fFar = 1000.0f;
-    fAspectRatio = (float)ScreenWidth() / (float)ScreenHeight();
+  int nVerts = m.verts.size();
+  int nTris = m.indices.size() / 3;
+  if (nTris == 0)
+    return;
 
-    // Camera projection matrix. Needs to be calculated only once.
-    matCameraToProjected = Mat4x4_MakeCameraProjection(fFovDeg, fAspectRatio, fNear, fFar);
+  // Build the vertex-to-triangle adjacency in a compact offsets/list form.
+  std::vector<int> vertTriCount(nVerts, 0);
+  for (int i = 0; i < nTris * 3; i++)
+    vertTriCount[m.indices[i]]++;
+  std::vector<int> vertTriOffset(nVerts + 1, 0);
+  for (int v = 0; v < nVerts; v++)
+    vertTriOffset[v + 1] = vertTriOffset[v] + vertTriCount[v];
+  std::vector<int> vertTris(nTris * 3);
+  std::vector<int> vertTriFill(vertTriOffset.begin(), vertTriOffset.end() - 1);
+  for (int t = 0; t < nTris; t++)
+    for (int k = 0; k < 3; k++)
+      vertTris[vertTriFill[m.indices[t * 3 + k]]++] = t;
 
-    // Projection matrix from normalized projection space to screen space. Needs to be calculated only once.
-    matProjectedToScreen = Mat4x4_MakeScreenTransform((float)ScreenWidth(), (float)ScreenHeight());
+  // Remaining (not yet emitted) triangles per vertex. Emitted triangles are swapped to the back
+  // of each vertex's adjacency range, so the first vertTriCount entries are always the live ones.
+  std::vector<int> vertCachePos(nVerts, -1);
+  std::vector<float> vertScore(nVerts, 0.0f);
+  std::vector<float> triScore(nTris, 0.0f);
+  std::vector<bool> triEmitted(nTris, false);
 
-    // Initial direction of the light.
-    lightDirection = { 0.0f, 0.0f, -1.0f };
-    lightDirection = Vec3d_Normalize(lightDirection);
+  auto scoreVertex = [&](int v)
+  {
+    if (vertTriCount[v] == 0)
+      return -1.0f;
+    float score = 0.0f;
+    int pos = vertCachePos[v];
+    if (pos >= 0)
+    {
+      if (pos < 3)
+        score = fLastTriScore;  // The most recent triangle's vertices get a fixed score.
+      else
+        score = powf(1.0f - (float)(pos - 3) / (float)(nCacheSize - 3), fCacheDecayPower);
+    }
+    score += fValenceBoostScale * powf((float)vertTriCount[v], -fValenceBoostPower);
+    return score;
+  };
 
-    // Set colors.
-    colorDay.r = 135; colorDay.g = 206; colorDay.b = 235;
-    colorNight.r = 0; colorNight.g = 0; colorNight.b = 49;
-    colorSky.r = 0; colorSky.g = 0; colorSky.b = 0;
-    colorGrass.r = 126; colorGrass.g = 200; colorGrass.b = 80;
-    colorMountain.r = 127; colorMountain.g = 131; colorMountain.b = 134;
-    colorSnow.r = 255; colorSnow.g = 255; colorSnow.b = 255;
+  for (int v = 0; v < nVerts; v++)
+    vertScore[v] = scoreVertex(v);
+  for (int t = 0; t < nTris; t++)
+    triScore[t] = vertScore[m.indices[t * 3]] + vertScore[m.indices[t * 3 + 1]] + vertScore[m.indices[t * 3 + 2]];
 
-    return true;
-  }
+  std::vector<int> cache, newCache;
+  cache.reserve(nCacheSize + 3);
+  newCache.reserve(nCacheSize + 3);
+  std::vector<int> newIndices, newUvIndices;
+  newIndices.reserve(nTris * 3);
+  newUvIndices.reserve(m.uvIndices.size());
 
-  bool OnUserUpdate(float fElapsedTime) override
+  int nBestTri = -1;
+  int nScanCursor = 0;  // Fallback scan position, only moves forward so the fallback stays linear.
+  for (int nEmitted = 0; nEmitted < nTris; nEmitted++)
   {
-    // Process user input.
-    // Translational degrees of freedom
-    if (GetKey(olc::Key::W).bHeld)  // Forward
+    if (nBestTri < 0)
     {
-      CoordSys_TranslateUVW(csCamera, 8.0f * fElapsedTime, 0.0f, 0.0f);
+      // Nothing in the cache has live triangles left, so start a new "island".
+      while (triEmitted[nScanCursor])
+        nScanCursor++;
+      nBestTri = nScanCursor;
     }
-    if (GetKey(olc::Key::S).bHeld)  // Backward
+
+    // Emit the best triangle and remove it from its vertices' adjacency lists.
+    triEmitted[nBestTri] = true;
+    for (int k = 0; k < 3; k++)
     {
-      CoordSys_TranslateUVW(csCamera, -8.0f * fElapsedTime, 0.0f, 0.0f);
+      int v = m.indices[nBestTri * 3 + k];
+      newIndices.push_back(v);
+      if (!m.uvIndices.empty())
+        newUvIndices.push_back(m.uvIndices[nBestTri * 3 + k]);
+      int *begin = &vertTris[vertTriOffset[v]];
+      int *end = begin + vertTriCount[v];
+      std::iter_swap(std::find(begin, end, nBestTri), end - 1);
+      vertTriCount[v]--;
     }
-    if (GetKey(olc::Key::Q).bHeld)  // Left
+
+    // Move its vertices to the front of the LRU cache, the remaining entries shift back.
+    newCache.clear();
+    for (int k = 0; k < 3; k++)
+      newCache.push_back(m.indices[nBestTri * 3 + k]);
+    for (int v : cache)
+      if (v != newCache[0] && v != newCache[1] && v != newCache[2])
+        newCache.push_back(v);
+    for (size_t i = nCacheSize; i < newCache.size(); i++)
+      vertCachePos[newCache[i]] = -1;  // Evicted.
+    if ((int)newCache.size() > nCacheSize)
+      newCache.resize(nCacheSize);
+    std::swap(cache, newCache);
+
+    // Rescore the cached vertices, and with them every live triangle that touches the cache.
+    for (size_t i = 0; i < cache.size(); i++)
+      vertCachePos[cache[i]] = i;
+    for (int v : cache)
+      vertScore[v] = scoreVertex(v);
+    for (int v : newCache)
+      if (vertCachePos[v] < 0)
+        vertScore[v] = scoreVertex(v);
+
+    nBestTri = -1;
+    float fBestScore = -1.0f;
+    for (int v : cache)
+      for (int i = 0; i < vertTriCount[v]; i++)
+      {
+        int t = vertTris[vertTriOffset[v] + i];
+        triScore[t] = vertScore[m.indices[t * 3]] + vertScore[m.indices[t * 3 + 1]] + vertScore[m.indices[t * 3 + 2]];
+        if (triScore[t] > fBestScore)
+        {
+          fBestScore = triScore[t];
+          nBestTri = t;
+        }
+      }
+  }
+
+  // Reorder the vertex buffer in order of first use and remap the indices accordingly. Vertices
+  // that no triangle refers to are kept at the end.
+  std::vector<int> remap(nVerts, -1);
+  std::vector<vec3d> newVerts;
+  newVerts.reserve(nVerts);
+  for (int &i : newIndices)
+  {
+    if (remap[i] < 0)
     {
-      CoordSys_TranslateUVW(csCamera, 0.0f, 8.0f * fElapsedTime, 0.0f);
+      remap[i] = newVerts.size();
+      newVerts.push_back(m.verts[i]);
     }
-    if (GetKey(olc::Key::E).bHeld)  // Right
+    i = remap[i];
+  }
+  for (int v = 0; v < nVerts; v++)
+    if (remap[v] < 0)
+      newVerts.push_back(m.verts[v]);
+
+  m.verts = std::move(newVerts);
+  m.indices = std::move(newIndices);
+  m.uvIndices = std::move(newUvIndices);
+  m.RebuildTrianglesFromIndices();
+}
+
+
+// Mesh files
+struct blockreader
+{
+  // Reads a file front to back through a fixed-size buffer, so files of any size are read with
+  // large sequential reads, and without ever holding more than a block of them in memory.
+  std::ifstream f;
+  std::vector<char> buffer;
+  size_t nPos = 0, nEnd = 0;
+};
+
+bool BlockReader_Open(blockreader &r, std::string sFilename, size_t nBlockSize = 1 << 16)
+{
+  r.f.open(sFilename, std::ios::binary);
+  r.buffer.resize(nBlockSize);
+  r.nPos = r.nEnd = 0;
+  return r.f.is_open();
+}
+
+const char *BlockReader_Fetch(blockreader &r, size_t nBytes)
+{
+  // Returns the next nBytes (at most a block) of the file, or nullptr at its end. The bytes stay
+  // valid until the next fetch.
+  if (r.nEnd - r.nPos < nBytes)
+  {
+    if (nBytes > r.buffer.size())
+      return nullptr;
+    size_t nLeft = r.nEnd - r.nPos;
+    memmove(r.buffer.data(), r.buffer.data() + r.nPos, nLeft);
+    r.f.read(r.buffer.data() + nLeft, r.buffer.size() - nLeft);
+    r.nPos = 0;
+    r.nEnd = nLeft + r.f.gcount();
+    if (r.nEnd < nBytes)
+      return nullptr;
+  }
+  const char *p = r.buffer.data() + r.nPos;
+  r.nPos += nBytes;
+  return p;
+}
+
+bool BlockReader_ReadLine(blockreader &r, std::string &sLine)
+{
+  sLine.clear();
+  while (const char *p = BlockReader_Fetch(r, 1))
+  {
+    if (*p == '\n')
+      return true;
+    if (*p != '\r')
+      sLine += *p;
+  }
+  return !sLine.empty();
+}
+
+bool Mesh_LoadFromStlFile(mesh &m, std::string sFilename)
+{
+  // Loads a binary STL file: an 80 byte header, the number of triangles, and per triangle a
+  // normal, three corners and two attribute bytes. STL repeats every corner of every triangle,
+  // so identical corners are welded into shared vertices with an open addressing hash table,
+  // whose slots are indices into the vertex buffer, so it costs 4 bytes per slot.
+  blockreader r;
+  if (!BlockReader_Open(r, sFilename))
+    return false;
+  r.f.seekg(0, std::ios::end);
+  uint64_t nFileSize = r.f.tellg();
+  r.f.seekg(0);
+  const char *pHeader = BlockReader_Fetch(r, 84);
+  if (!pHeader)
+    return false;
+  uint32_t nTris;
+  memcpy(&nTris, pHeader + 80, 4);
+
+  // ASCII STL files start with "solid" and don't match the size binary ones have.
+  if (nFileSize != 84 + 50 * (uint64_t)nTris)
+    return false;
+
+  m = mesh();
+  m.indices.reserve(3 * (size_t)nTris);
+  m.verts.reserve(nTris / 2 + 3);  // A closed mesh has about half as many vertices as triangles.
+
+  std::vector<int> slots(64, -1);
+  auto hash = [](vec3d &v)
+  {
+    uint32_t h[3];
+    memcpy(&h[0], &v.x, 4); memcpy(&h[1], &v.y, 4); memcpy(&h[2], &v.z, 4);
+    return (h[0] * 73856093u) ^ (h[1] * 19349663u) ^ (h[2] * 83492791u);
+  };
+  auto insert = [&](int nVert)
+  {
+    size_t nMask = slots.size() - 1;
+    for (size_t s = hash(m.verts[nVert]) & nMask; ; s = (s + 1) & nMask)
+      if (slots[s] < 0)
+      {
+        slots[s] = nVert;
+        return;
+      }
+  };
+
+  for (uint32_t t = 0; t < nTris; t++)
+  {
+    const char *pRecord = BlockReader_Fetch(r, 50);
+    if (!pRecord)
+      return false;
+    for (int k = 0; k < 3; k++)
     {
-      CoordSys_TranslateUVW(csCamera, 0.0f, -8.0f * fElapsedTime, 0.0f);
+      vec3d v;
+      memcpy(&v.x, pRecord + 12 + 12 * k, 4);
+      memcpy(&v.y, pRecord + 16 + 12 * k, 4);
+      memcpy(&v.z, pRecord + 20 + 12 * k, 4);
+      v.x += 0.0f; v.y += 0.0f; v.z += 0.0f;  // Turns -0 into 0, so both weld.
+
+      size_t nMask = slots.size() - 1;
+      size_t s = hash(v) & nMask;
+      while (slots[s] >= 0 && (m.verts[slots[s]].x != v.x || m.verts[slots[s]].y != v.y || m.verts[slots[s]].z != v.z))
+        s = (s + 1) & nMask;
+      int nVert = slots[s];
+      if (nVert < 0)
+      {
+        m.verts.push_back(v);
+        nVert = slots[s] = m.verts.size() - 1;
+
+        // Keep the table at most half full, so probe sequences stay short.
+        if (2 * m.verts.size() > slots.size())
+        {
+          slots.assign(2 * slots.size(), -1);
+          for (size_t i = 0; i < m.verts.size(); i++)
+            insert(i);
+        }
+      }
+      m.indices.push_back(nVert);
     }
-    if (GetKey(olc::Key::SPACE).bHeld)  // Up
+  }
+
+  m.RebuildTrianglesFromIndices();
+  return true;
+}
+
+bool Mesh_LoadFromPlyFile(mesh &m, std::string sFilename)
+{
+  // Loads a binary (little or big endian) PLY file. The vertex element's x, y and z properties,
+  // and s and t or u and v if present, are read in any type, faces are fanned into triangles,
+  // and other elements and properties are skipped.
+  blockreader r;
+  if (!BlockReader_Open(r, sFilename))
+    return false;
+  r.f.seekg(0, std::ios::end);
+  uint64_t nFileSize = r.f.tellg();
+  r.f.seekg(0);
+
+  struct plyproperty
+  {
+    std::string name;
+    int nType = 0;  // Index into the type table below.
+    int nCountType = -1;  // For list properties, the type of the list's length.
+  };
+  struct plyelement
+  {
+    std::string name;
+    uint64_t nCount = 0;
+    std::vector<plyproperty> properties;
+  };
+  static const char *typeNames[][2] = { { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+                                        { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" } };
+  static const int typeSizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+  auto typeIndex = [](std::string &s)
+  {
+    for (int i = 0; i < 8; i++)
+      if (s == typeNames[i][0] || s == typeNames[i][1])
+        return i;
+    return -1;
+  };
+
+  // The header is text, one line at a time.
+  std::string sLine, sWord;
+  if (!BlockReader_ReadLine(r, sLine) || sLine != "ply")
+    return false;
+  bool bBigEndian = false;
+  std::vector<plyelement> elements;
+  while (true)
+  {
+    if (!BlockReader_ReadLine(r, sLine))
+      return false;
+    std::stringstream s(sLine);
+    s >> sWord;
+    if (sWord == "end_header")
+      break;
+    if (sWord == "format")
     {
-      CoordSys_TranslateUVW(csCamera, 0.0f, 0.0f, 8.0f * fElapsedTime);
+      s >> sWord;
+      if (sWord == "binary_big_endian")
+        bBigEndian = true;
+      else if (sWord != "binary_little_endian")
+        return false;
     }
-    if (GetKey(olc::Key::SHIFT).bHeld)  // Down
+    else if (sWord == "element")
     {
-      CoordSys_TranslateUVW(csCamera, 0.0f, 0.0f, -8.0f * fElapsedTime);
+      elements.emplace_back();
+      s >> elements.back().name >> elements.back().nCount;
     }
-    // Rotational degrees of freedom
-    if (GetKey(olc::Key::RIGHT).bHeld)  // Roll right
+    else if (sWord == "property" && !elements.empty())
     {
-      CoordSys_RotateU(csCamera, 1.0f * fElapsedTime);
+      plyproperty property;
+      s >> sWord;
+      if (sWord == "list")
+      {
+        s >> sWord;
+        property.nCountType = typeIndex(sWord);
+        s >> sWord;
+        if (property.nCountType < 0)
+          return false;
+      }
+      property.nType = typeIndex(sWord);
+      s >> property.name;
+      if (property.nType < 0)
+        return false;
+      elements.back().properties.push_back(property);
     }
-    if (GetKey(olc::Key::LEFT).bHeld)  // Roll left
+  }
+
+  auto readValue = [&](int nType, double &fValue)
+  {
+    const char *p = BlockReader_Fetch(r, typeSizes[nType]);
+    if (!p)
+      return false;
+    char bytes[8];
+    memcpy(bytes, p, typeSizes[nType]);
+    if (bBigEndian)
+      std::reverse(bytes, bytes + typeSizes[nType]);
+    switch (nType)
     {
-      CoordSys_RotateU(csCamera, -1.0f * fElapsedTime);
+      case 0: { int8_t v; memcpy(&v, bytes, 1); fValue = v; break; }
+      case 1: { uint8_t v; memcpy(&v, bytes, 1); fValue = v; break; }
+      case 2: { int16_t v; memcpy(&v, bytes, 2); fValue = v; break; }
+      case 3: { uint16_t v; memcpy(&v, bytes, 2); fValue = v; break; }
+      case 4: { int32_t v; memcpy(&v, bytes, 4); fValue = v; break; }
+      case 5: { uint32_t v; memcpy(&v, bytes, 4); fValue = v; break; }
+      case 6: { float v; memcpy(&v, bytes, 4); fValue = v; break; }
+      default: { double v; memcpy(&v, bytes, 8); fValue = v; break; }
     }
-    if (GetKey(olc::Key::UP).bHeld)  // Pitch down
-    {
-      CoordSys_RotateV(csCamera, 1.0f * fElapsedTime);
+    return true;
+  };
+
+  m = mesh();
+  bool bHasUVs = false;
+  std::vector<int> vecFace;
+  for (auto &element : elements)
+  {
+    bool bVertex = (element.name == "vertex"), bFace = (element.name == "face");
+
+    // The count comes from the header, so space is only reserved for as many elements as the
+    // file can hold.
+    uint64_t nMinBytes = 0;
+    for (auto &property : element.properties)
+      nMinBytes += typeSizes[property.nCountType >= 0 ? property.nCountType : property.nType];
+    size_t nReserve = nMinBytes ? (size_t)std::min(element.nCount, nFileSize / nMinBytes) : 0;
+    if (bVertex)
+    {
+      m.verts.reserve(nReserve);
+      for (auto &property : element.properties)
+        bHasUVs |= (property.name == "s" || property.name == "u" || property.name == "texture_u");
+      if (bHasUVs)
+        m.uvs.reserve(nReserve);
+    }
+    if (bFace)
+      m.indices.reserve(3 * nReserve);
+
+    for (uint64_t e = 0; e < element.nCount; e++)
+    {
+      vec3d v;
+      vec2d uv;
+      for (auto &property : element.properties)
+      {
+        double fValue;
+        if (property.nCountType >= 0)
+        {
+          if (!readValue(property.nCountType, fValue))
+            return false;
+          int nCount = (int)fValue;
+          vecFace.clear();
+          for (int i = 0; i < nCount; i++)
+          {
+            if (!readValue(property.nType, fValue))
+              return false;
+            vecFace.push_back((int)fValue);
+          }
+          if (bFace && (property.name == "vertex_indices" || property.name == "vertex_index"))
+            for (int i = 1; i + 1 < nCount; i++)
+            {
+              m.indices.push_back(vecFace[0]);
+              m.indices.push_back(vecFace[i]);
+              m.indices.push_back(vecFace[i + 1]);
+            }
+          continue;
+        }
+
+        if (!readValue(property.nType, fValue))
+          return false;
+        if (bVertex)
+        {
+          const std::string &n = property.name;
+          if (n == "x") v.x = fValue;
+          else if (n == "y") v.y = fValue;
+          else if (n == "z") v.z = fValue;
+          else if (n == "s" || n == "u" || n == "texture_u") uv.u = fValue;
+          else if (n == "t" || n == "v" || n == "texture_v") uv.v = fValue;
+        }
+      }
+      if (bVertex)
+      {
+        m.verts.push_back(v);
+        if (bHasUVs)
+          m.uvs.push_back(uv);
+      }
+    }
+  }
+
+  for (int nIndex : m.indices)
+    if (nIndex < 0 || nIndex >= (int)m.verts.size())
+      return false;
+
+  // Texture coordinates are per vertex, so they share the position indices.
+  if (bHasUVs)
+    m.uvIndices = m.indices;
+  m.RebuildTrianglesFromIndices();
+  return true;
+}
+
+bool Mesh_LoadFromFile(mesh &m, std::string sFilename)
+{
+  // Picks the loader by the file's extension.
+  std::string sExtension = sFilename.substr(sFilename.find_last_of('.') + 1);
+  std::transform(sExtension.begin(), sExtension.end(), sExtension.begin(), ::tolower);
+  if (sExtension == "stl")
+    return Mesh_LoadFromStlFile(m, sFilename);
+  if (sExtension == "ply")
+    return Mesh_LoadFromPlyFile(m, sFilename);
+  return m.LoadFromObjectFile(sFilename);
+}
+
+
+// Worker pool
+// Threads that are started once and then run the tasks of jobs, so parallel work doesn't pay for
+// creating threads. Browser builds get their threads from a fixed pool of web workers (see
+// PTHREAD_POOL_SIZE in the README), so there the number of workers is capped.
+#ifdef __EMSCRIPTEN__
+constexpr int nMaxPoolWorkers = 3;
+#else
+constexpr int nMaxPoolWorkers = 64;
+#endif
+
+struct workerjob
+{
+  // A number of tasks, each taken by index by whichever thread is free.
+  std::function<void(int)> fnTask;
+  int nTasks = 0;
+  int nNextTask = 0;
+  int nTasksDone = 0;
+};
+
+struct workerpool
+{
+  std::vector<std::thread> workers;
+  std::mutex mux;
+  std::condition_variable cvWork, cvDone;
+  std::deque<workerjob *> jobs;  // Started jobs with tasks left to take, oldest first.
+  bool bQuit = false;
+};
+
+void WorkerPool_RunTask(workerpool &pool, workerjob &job, std::unique_lock<std::mutex> &lock)
+{
+  // Takes the job's next task and runs it with the pool unlocked. Called with the pool locked.
+  int i = job.nNextTask++;
+  if (job.nNextTask == job.nTasks)
+    pool.jobs.erase(std::find(pool.jobs.begin(), pool.jobs.end(), &job));
+  lock.unlock();
+  job.fnTask(i);
+  lock.lock();
+  if (++job.nTasksDone == job.nTasks)
+    pool.cvDone.notify_all();
+}
+
+void WorkerPool_Start(workerpool &pool, int nWorkers)
+{
+  pool.bQuit = false;
+  for (int i = 0; i < nWorkers; i++)
+    pool.workers.emplace_back([&pool]
+    {
+      std::unique_lock<std::mutex> lock(pool.mux);
+      while (true)
+      {
+        pool.cvWork.wait(lock, [&] { return pool.bQuit || !pool.jobs.empty(); });
+        if (pool.bQuit)
+          return;
+        WorkerPool_RunTask(pool, *pool.jobs.front(), lock);
+      }
+    });
+}
+
+void WorkerPool_Stop(workerpool &pool)
+{
+  {
+    std::lock_guard<std::mutex> lock(pool.mux);
+    pool.bQuit = true;
+  }
+  pool.cvWork.notify_all();
+  for (auto &worker : pool.workers)
+    worker.join();
+  pool.workers.clear();
+}
+
+void WorkerPool_Begin(workerpool &pool, workerjob &job)
+{
+  // Hands the job's tasks to the workers. The job has to stay alive until WorkerPool_Finish.
+  job.nNextTask = job.nTasksDone = 0;
+  if (job.nTasks == 0)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(pool.mux);
+    pool.jobs.push_back(&job);
+  }
+  pool.cvWork.notify_all();
+}
+
+void WorkerPool_Finish(workerpool &pool, workerjob &job)
+{
+  // The calling thread takes the job's remaining tasks itself and then waits for the ones the
+  // workers took, so a job always finishes, even without workers or while they're busy.
+  std::unique_lock<std::mutex> lock(pool.mux);
+  while (job.nNextTask < job.nTasks)
+    WorkerPool_RunTask(pool, job, lock);
+  pool.cvDone.wait(lock, [&] { return job.nTasksDone == job.nTasks; });
+}
+
+void WorkerPool_ParallelFor(workerpool &pool, int nCount, std::function<void(int)> fnTask)
+{
+  workerjob job;
+  job.fnTask = std::move(fnTask);
+  job.nTasks = nCount;
+  WorkerPool_Begin(pool, job);
+  WorkerPool_Finish(pool, job);
+}
+
+
+// Terrain queries
+struct terraingrid
+{
+  // Uniform grid over the XY footprint of a static mesh (e.g. the mountains), in which every cell
+  // lists the triangles whose XY bounding box overlaps it. Ground height, ray and sphere queries
+  // then only have to look at the handful of triangles in the cells they touch.
+  std::vector<vec3d> verts;  // World space.
+  std::vector<int> indices;
+  float fMinX = 0.0f, fMinY = 0.0f, fCellSize = 1.0f;
+  int nCellsX = 0, nCellsY = 0;
+  std::vector<int> cellOffsets;  // Triangles of cell c are cellTris[cellOffsets[c]] up to cellTris[cellOffsets[c + 1]].
+  std::vector<int> cellTris;
+
+  // A triangle can be listed in several cells. Every query stamps the triangles it has tested,
+  // so it tests each of them only once.
+  std::vector<int> triStamps;
+  int nStamp = 0;
+};
+
+void TerrainGrid_Build(terraingrid &grid, mesh &m, mat4x4 &matWorld)
+{
+  grid.verts.resize(m.verts.size());
+  Vec3d_ApplyTransformBatch(m.verts.data(), grid.verts.data(), m.verts.size(), matWorld);
+  grid.indices = m.indices;
+  int nTris = grid.indices.size() / 3;
+  grid.triStamps.assign(nTris, 0);
+  grid.nStamp = 0;
+  if (nTris == 0)
+  {
+    grid.nCellsX = grid.nCellsY = 0;
+    return;
+  }
+
+  // Size the cells such that there are about as many cells as triangles.
+  float fMinX = INFINITY, fMinY = INFINITY, fMaxX = -INFINITY, fMaxY = -INFINITY;
+  for (auto &v : grid.verts)
+  {
+    fMinX = std::min(fMinX, v.x); fMaxX = std::max(fMaxX, v.x);
+    fMinY = std::min(fMinY, v.y); fMaxY = std::max(fMaxY, v.y);
+  }
+  float fWidth = std::max(fMaxX - fMinX, 1e-3f), fHeight = std::max(fMaxY - fMinY, 1e-3f);
+  grid.fCellSize = sqrtf(fWidth * fHeight / nTris);
+  grid.nCellsX = std::min((int)(fWidth / grid.fCellSize) + 1, 4096);
+  grid.nCellsY = std::min((int)(fHeight / grid.fCellSize) + 1, 4096);
+  grid.fCellSize = std::max(fWidth / grid.nCellsX, fHeight / grid.nCellsY) * 1.0001f;
+  grid.fMinX = fMinX;
+  grid.fMinY = fMinY;
+
+  // Two passes over the triangles' cell ranges, first counting and then filling the lists.
+  auto cellRange = [&](int t, int &x0, int &y0, int &x1, int &y1)
+  {
+    vec3d &a = grid.verts[grid.indices[t * 3]], &b = grid.verts[grid.indices[t * 3 + 1]], &c = grid.verts[grid.indices[t * 3 + 2]];
+    x0 = (int)((std::min({ a.x, b.x, c.x }) - grid.fMinX) / grid.fCellSize);
+    y0 = (int)((std::min({ a.y, b.y, c.y }) - grid.fMinY) / grid.fCellSize);
+    x1 = std::min((int)((std::max({ a.x, b.x, c.x }) - grid.fMinX) / grid.fCellSize), grid.nCellsX - 1);
+    y1 = std::min((int)((std::max({ a.y, b.y, c.y }) - grid.fMinY) / grid.fCellSize), grid.nCellsY - 1);
+  };
+  grid.cellOffsets.assign(grid.nCellsX * grid.nCellsY + 1, 0);
+  for (int t = 0; t < nTris; t++)
+  {
+    int x0, y0, x1, y1;
+    cellRange(t, x0, y0, x1, y1);
+    for (int y = y0; y <= y1; y++)
+      for (int x = x0; x <= x1; x++)
+        grid.cellOffsets[y * grid.nCellsX + x + 1]++;
+  }
+  for (size_t c = 1; c < grid.cellOffsets.size(); c++)
+    grid.cellOffsets[c] += grid.cellOffsets[c - 1];
+  grid.cellTris.resize(grid.cellOffsets.back());
+  std::vector<int> fill(grid.cellOffsets.begin(), grid.cellOffsets.end() - 1);
+  for (int t = 0; t < nTris; t++)
+  {
+    int x0, y0, x1, y1;
+    cellRange(t, x0, y0, x1, y1);
+    for (int y = y0; y <= y1; y++)
+      for (int x = x0; x <= x1; x++)
+        grid.cellTris[fill[y * grid.nCellsX + x]++] = t;
+  }
+}
+
+int TerrainGrid_NextStamp(terraingrid &grid)
+{
+  if (++grid.nStamp == INT32_MAX)
+  {
+    std::fill(grid.triStamps.begin(), grid.triStamps.end(), 0);
+    grid.nStamp = 1;
+  }
+  return grid.nStamp;
+}
+
+bool TerrainGrid_GroundHeight(terraingrid &grid, float x, float y, float &z)
+{
+  // Returns the height of the highest terrain surface straight above or below (x, y), or false if
+  // the point lies outside of the terrain.
+  int cx = (int)floorf((x - grid.fMinX) / grid.fCellSize);
+  int cy = (int)floorf((y - grid.fMinY) / grid.fCellSize);
+  if (cx < 0 || cy < 0 || cx >= grid.nCellsX || cy >= grid.nCellsY)
+    return false;
+
+  bool bFound = false;
+  int c = cy * grid.nCellsX + cx;
+  for (int i = grid.cellOffsets[c]; i < grid.cellOffsets[c + 1]; i++)
+  {
+    int t = grid.cellTris[i];
+    vec3d &a = grid.verts[grid.indices[t * 3]], &b = grid.verts[grid.indices[t * 3 + 1]], &p = grid.verts[grid.indices[t * 3 + 2]];
+
+    // Barycentric coordinates of (x, y) in the triangle's XY projection.
+    float fDet = (b.y - p.y) * (a.x - p.x) + (p.x - b.x) * (a.y - p.y);
+    if (fabsf(fDet) < 1e-12f)
+      continue;  // Vertical triangle, it has no height at a single point.
+    float l0 = ((b.y - p.y) * (x - p.x) + (p.x - b.x) * (y - p.y)) / fDet;
+    float l1 = ((p.y - a.y) * (x - p.x) + (a.x - p.x) * (y - p.y)) / fDet;
+    float l2 = 1.0f - l0 - l1;
+    if (l0 < -1e-5f || l1 < -1e-5f || l2 < -1e-5f)
+      continue;
+
+    float h = l0 * a.z + l1 * b.z + l2 * p.z;
+    if (!bFound || h > z)
+      z = h;
+    bFound = true;
+  }
+  return bFound;
+}
+
+bool TerrainGrid_Raycast(terraingrid &grid, vec3d &origin, vec3d &direction, float fMaxDistance, float &t)
+{
+  // Returns the distance along the (normalized) direction to the first terrain triangle the ray
+  // hits within the maximum distance. Walks the cells under the ray with a 2D DDA and stops at
+  // the first cell that contains a hit, so the cost depends on the distance to the hit.
+  if (grid.nCellsX == 0)
+    return false;
+  int nStamp = TerrainGrid_NextStamp(grid);
+
+  // Clip the ray's XY projection to the grid's footprint.
+  float fMaxX = grid.fMinX + grid.nCellsX * grid.fCellSize;
+  float fMaxY = grid.fMinY + grid.nCellsY * grid.fCellSize;
+  float tEnter = 0.0f, tExit = fMaxDistance;
+  float o[2] = { origin.x, origin.y }, d[2] = { direction.x, direction.y };
+  float lo[2] = { grid.fMinX, grid.fMinY }, hi[2] = { fMaxX, fMaxY };
+  for (int k = 0; k < 2; k++)
+  {
+    if (fabsf(d[k]) < 1e-12f)
+    {
+      if (o[k] < lo[k] || o[k] > hi[k])
+        return false;
+      continue;
+    }
+    float t0 = (lo[k] - o[k]) / d[k], t1 = (hi[k] - o[k]) / d[k];
+    if (t0 > t1) std::swap(t0, t1);
+    tEnter = std::max(tEnter, t0);
+    tExit = std::min(tExit, t1);
+  }
+  if (tEnter > tExit)
+    return false;
+
+  // Set up the DDA in the cell in which the ray enters the footprint.
+  float px = origin.x + direction.x * tEnter, py = origin.y + direction.y * tEnter;
+  int cx = std::clamp((int)((px - grid.fMinX) / grid.fCellSize), 0, grid.nCellsX - 1);
+  int cy = std::clamp((int)((py - grid.fMinY) / grid.fCellSize), 0, grid.nCellsY - 1);
+  int stepX = direction.x > 0.0f ? 1 : -1, stepY = direction.y > 0.0f ? 1 : -1;
+  float tDeltaX = fabsf(direction.x) > 1e-12f ? grid.fCellSize / fabsf(direction.x) : INFINITY;
+  float tDeltaY = fabsf(direction.y) > 1e-12f ? grid.fCellSize / fabsf(direction.y) : INFINITY;
+  float tNextX = fabsf(direction.x) > 1e-12f ? (grid.fMinX + (cx + (stepX > 0 ? 1 : 0)) * grid.fCellSize - origin.x) / direction.x : INFINITY;
+  float tNextY = fabsf(direction.y) > 1e-12f ? (grid.fMinY + (cy + (stepY > 0 ? 1 : 0)) * grid.fCellSize - origin.y) / direction.y : INFINITY;
+
+  float tBest = INFINITY;
+  while (true)
+  {
+    int c = cy * grid.nCellsX + cx;
+    for (int i = grid.cellOffsets[c]; i < grid.cellOffsets[c + 1]; i++)
+    {
+      int tri = grid.cellTris[i];
+      if (grid.triStamps[tri] == nStamp)
+        continue;
+      grid.triStamps[tri] = nStamp;
+
+      // Moller-Trumbore ray versus triangle intersection, from either side.
+      vec3d &a = grid.verts[grid.indices[tri * 3]], &b = grid.verts[grid.indices[tri * 3 + 1]], &p = grid.verts[grid.indices[tri * 3 + 2]];
+      vec3d e1 = Vec3d_Sub(b, a), e2 = Vec3d_Sub(p, a);
+      vec3d pv = Vec3d_CrossProduct(direction, e2);
+      float fDet = Vec3d_DotProduct(e1, pv);
+      if (fabsf(fDet) < 1e-12f)
+        continue;
+      vec3d tv = Vec3d_Sub(origin, a);
+      float u = Vec3d_DotProduct(tv, pv) / fDet;
+      if (u < 0.0f || u > 1.0f)
+        continue;
+      vec3d qv = Vec3d_CrossProduct(tv, e1);
+      float v = Vec3d_DotProduct(direction, qv) / fDet;
+      if (v < 0.0f || u + v > 1.0f)
+        continue;
+      float tHit = Vec3d_DotProduct(e2, qv) / fDet;
+      if (tHit >= 0.0f && tHit <= fMaxDistance && tHit < tBest)
+        tBest = tHit;
+    }
+
+    // A hit closer than where the ray leaves this cell can't be beaten by a later cell.
+    float tCellExit = std::min(tNextX, tNextY);
+    if (tBest <= tCellExit || tCellExit > tExit)
+      break;
+    if (tNextX < tNextY)
+    {
+      cx += stepX; tNextX += tDeltaX;
+      if (cx < 0 || cx >= grid.nCellsX) break;
+    }
+    else
+    {
+      cy += stepY; tNextY += tDeltaY;
+      if (cy < 0 || cy >= grid.nCellsY) break;
+    }
+  }
+
+  if (tBest == INFINITY)
+    return false;
+  t = tBest;
+  return true;
+}
+
+bool TerrainGrid_SphereIntersects(terraingrid &grid, vec3d &center, float fRadius, vec3d *pClosest = nullptr)
+{
+  // Returns whether the sphere touches the terrain, and optionally the terrain point closest to
+  // its center (e.g. to push an object out along the direction from that point to the center).
+  if (grid.nCellsX == 0)
+    return false;
+  int nStamp = TerrainGrid_NextStamp(grid);
+
+  int x0 = std::max((int)floorf((center.x - fRadius - grid.fMinX) / grid.fCellSize), 0);
+  int y0 = std::max((int)floorf((center.y - fRadius - grid.fMinY) / grid.fCellSize), 0);
+  int x1 = std::min((int)floorf((center.x + fRadius - grid.fMinX) / grid.fCellSize), grid.nCellsX - 1);
+  int y1 = std::min((int)floorf((center.y + fRadius - grid.fMinY) / grid.fCellSize), grid.nCellsY - 1);
+
+  float fBestDistSq = fRadius * fRadius;
+  bool bHit = false;
+  for (int cy = y0; cy <= y1; cy++)
+    for (int cx = x0; cx <= x1; cx++)
+    {
+      int c = cy * grid.nCellsX + cx;
+      for (int i = grid.cellOffsets[c]; i < grid.cellOffsets[c + 1]; i++)
+      {
+        int tri = grid.cellTris[i];
+        if (grid.triStamps[tri] == nStamp)
+          continue;
+        grid.triStamps[tri] = nStamp;
+
+        vec3d q = Triangle_ClosestPoint(center, grid.verts[grid.indices[tri * 3]], grid.verts[grid.indices[tri * 3 + 1]], grid.verts[grid.indices[tri * 3 + 2]]);
+        vec3d d = Vec3d_Sub(q, center);
+        float fDistSq = Vec3d_DotProduct(d, d);
+        if (fDistSq <= fBestDistSq)
+        {
+          fBestDistSq = fDistSq;
+          bHit = true;
+          if (pClosest)
+            *pClosest = q;
+        }
+      }
+    }
+  return bHit;
+}
+
+// Horizon maps
+struct horizonmap
+{
+  // Per triangle of a stationary mesh, the elevation of the horizon as seen from its centroid, in
+  // nAzimuths directions evenly spread around it. A triangle is in the sun's shadow when the sun
+  // is lower than the horizon in the sun's direction, which is a table lookup per frame.
+  int nAzimuths = 0;
+  std::vector<uint8_t> elevations;  // nAzimuths per triangle, from 0 up to 90 degrees in 255 steps.
+};
+
+struct horizonsun
+{
+  // Where a frame's sun is in terms of a horizon map: between azimuths a0 and a1, weighted by w.
+  int a0 = 0, a1 = 0;
+  float w = 0.0f;
+  float fElevation = 0.0f;  // In the horizon map's units.
+};
+
+void HorizonMap_Build(horizonmap &hm, terraingrid &grid, int nAzimuths, workerpool &pool)
+{
+  // First sample the terrain's heights on a grid twice as fine as the terrain grid, then march
+  // from every triangle's centroid over the heights in each direction, keeping the steepest
+  // elevation angle. Both passes are split over the worker pool.
+  hm.nAzimuths = nAzimuths;
+  int nTris = grid.indices.size() / 3;
+  hm.elevations.assign(nTris * nAzimuths, 0);
+  if (nTris == 0 || grid.nCellsX == 0)
+    return;
+
+  float fStep = 0.5f * grid.fCellSize;
+  int nWidth = 2 * grid.nCellsX + 1, nHeight = 2 * grid.nCellsY + 1;
+  float fMinZ = INFINITY;
+  for (auto &v : grid.verts)
+    fMinZ = std::min(fMinZ, v.z);
+  std::vector<float> heights(nWidth * nHeight);
+  WorkerPool_ParallelFor(pool, nHeight, [&](int y)
+  {
+    for (int x = 0; x < nWidth; x++)
+    {
+      float z;
+      if (!TerrainGrid_GroundHeight(grid, grid.fMinX + x * fStep, grid.fMinY + y * fStep, z))
+        z = fMinZ;  // Outside the terrain, which can't cast shadows.
+      heights[y * nWidth + x] = z;
+    }
+  });
+
+  // The march starts a step away from the centroid, so the triangle doesn't shadow itself, and
+  // its steps grow with the distance, since far terrain only matters when it's high.
+  float fQuantization = 255.0f / (0.5f * 3.141592f);
+  constexpr int nTrisPerTask = 64;
+  WorkerPool_ParallelFor(pool, (nTris + nTrisPerTask - 1) / nTrisPerTask, [&](int i)
+  {
+    for (int t = i * nTrisPerTask; t < std::min((i + 1) * nTrisPerTask, nTris); t++)
+    {
+      vec3d &a = grid.verts[grid.indices[t * 3]], &b = grid.verts[grid.indices[t * 3 + 1]], &c = grid.verts[grid.indices[t * 3 + 2]];
+      float x0 = ((a.x + b.x + c.x) / 3.0f - grid.fMinX) / fStep;
+      float y0 = ((a.y + b.y + c.y) / 3.0f - grid.fMinY) / fStep;
+      float z0 = (a.z + b.z + c.z) / 3.0f;
+      for (int k = 0; k < nAzimuths; k++)
+      {
+        float fAzimuth = 2.0f * 3.141592f * k / nAzimuths;
+        float dx = cosf(fAzimuth), dy = sinf(fAzimuth);
+        float fMaxSlope = 0.0f;
+        for (float d = 1.0f; ; d += std::max(1.0f, 0.05f * d))
+        {
+          float x = x0 + d * dx, y = y0 + d * dy;
+          if (x < 0.0f || y < 0.0f || x >= nWidth - 1 || y >= nHeight - 1)
+            break;
+          int ix = (int)x, iy = (int)y;
+          float fx = x - ix, fy = y - iy;
+          float *h = &heights[iy * nWidth + ix];
+          float z = (h[0] * (1.0f - fx) + h[1] * fx) * (1.0f - fy) + (h[nWidth] * (1.0f - fx) + h[nWidth + 1] * fx) * fy;
+          fMaxSlope = std::max(fMaxSlope, (z - z0) / (d * fStep));
+        }
+        hm.elevations[t * nAzimuths + k] = (uint8_t)std::min(atanf(fMaxSlope) * fQuantization + 0.5f, 255.0f);
+      }
+    }
+  });
+}
+
+horizonsun HorizonMap_Sun(horizonmap &hm, vec3d &lightDirection)
+{
+  // The sun lies opposite of the light's direction.
+  horizonsun sun;
+  if (hm.nAzimuths == 0)
+    return sun;
+  float fAzimuth = atan2f(-lightDirection.y, -lightDirection.x);
+  float f = fAzimuth / (2.0f * 3.141592f) * hm.nAzimuths;
+  if (f < 0.0f)
+    f += hm.nAzimuths;
+  sun.a0 = std::min((int)f, hm.nAzimuths - 1);
+  sun.a1 = (sun.a0 + 1) % hm.nAzimuths;
+  sun.w = f - sun.a0;
+  sun.fElevation = asinf(std::min(std::max(-lightDirection.z, -1.0f), 1.0f)) * 255.0f / (0.5f * 3.141592f);
+  return sun;
+}
+
+inline float HorizonMap_SunVisibility(horizonmap &hm, horizonsun &sun, int t)
+{
+  // How much of triangle t the sun reaches, fading from 0 to 1 while the sun rises from 2 degrees
+  // below the horizon to 2 degrees above it, which softens the edges of the shadows.
+  const uint8_t *pElevations = &hm.elevations[t * hm.nAzimuths];
+  float fHorizon = pElevations[sun.a0] + sun.w * (pElevations[sun.a1] - pElevations[sun.a0]);
+  float f = (sun.fElevation - fHorizon) * (1.0f / 11.3f) + 0.5f;  // 4 degrees are 11.3 steps.
+  return std::min(std::max(f, 0.0f), 1.0f);
+}
+
+// Textures
+struct texturelevel
+{
+  // One mip level. Texels are stored in tiles of 8x8, each tile contiguous in memory, such that
+  // sampling a small 2D neighborhood (as rasterizing a span does) touches few cache lines no
+  // matter in which direction the texture is walked.
+  int width = 0, height = 0;
+  int tilesX = 0;
+  std::vector<olc::Pixel> texels;
+};
+
+struct texture
+{
+  std::vector<texturelevel> levels;  // Level 0 is the full resolution, every next level halves it.
+};
+
+inline int Texture_TiledIndex(texturelevel &level, int x, int y)
+{
+  return (((y >> 3) * level.tilesX + (x >> 3)) << 6) + ((y & 7) << 3) + (x & 7);
+}
+
+void Texture_Create(texture &tex, olc::Sprite *sprite)
+{
+  // Builds the mip chain of a sprite. The texture is resampled to power-of-two dimensions, so
+  // wrapping texture coordinates is a simple bit mask.
+  tex.levels.clear();
+  if (!sprite || sprite->width <= 0 || sprite->height <= 0)
+    return;
+
+  int w = 1, h = 1;
+  while (w < sprite->width) w <<= 1;
+  while (h < sprite->height) h <<= 1;
+
+  std::vector<olc::Pixel> linear(w * h);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      linear[y * w + x] = sprite->GetPixel(x * sprite->width / w, y * sprite->height / h);
+
+  while (true)
+  {
+    texturelevel level;
+    level.width = w;
+    level.height = h;
+    level.tilesX = (w + 7) / 8;
+    level.texels.resize(level.tilesX * ((h + 7) / 8) * 64);
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++)
+        level.texels[Texture_TiledIndex(level, x, y)] = linear[y * w + x];
+    tex.levels.push_back(std::move(level));
+
+    if (w == 1 && h == 1)
+      break;
+
+    // Box filter down to the next level.
+    int nw = std::max(w / 2, 1), nh = std::max(h / 2, 1);
+    std::vector<olc::Pixel> next(nw * nh);
+    for (int y = 0; y < nh; y++)
+      for (int x = 0; x < nw; x++)
+      {
+        int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+        int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+        olc::Pixel &a = linear[y0 * w + x0], &b = linear[y0 * w + x1], &c = linear[y1 * w + x0], &d = linear[y1 * w + x1];
+        next[y * nw + x] = olc::Pixel((a.r + b.r + c.r + d.r + 2) / 4, (a.g + b.g + c.g + d.g + 2) / 4,
+                                      (a.b + b.b + c.b + d.b + 2) / 4, (a.a + b.a + c.a + d.a + 2) / 4);
+      }
+    linear = std::move(next);
+    w = nw;
+    h = nh;
+  }
+}
+
+void Texture_CreateDetailNoise(texture &tex, int nSize)
+{
+  // A procedural grayscale detail texture (a few octaves of value noise), used to modulate the
+  // height colors of a mesh when no texture image is available.
+  auto hash = [](int x, int y)
+  {
+    uint32_t n = (uint32_t)x * 374761393u + (uint32_t)y * 668265263u;
+    n = (n ^ (n >> 13)) * 1274126177u;
+    return (float)((n ^ (n >> 16)) & 0xFFFF) / 65535.0f;
+  };
+
+  olc::Sprite sprite(nSize, nSize);
+  for (int y = 0; y < nSize; y++)
+    for (int x = 0; x < nSize; x++)
+    {
+      float fValue = 0.0f, fAmplitude = 0.5f;
+      for (int nPeriod = nSize / 4; nPeriod >= 2; nPeriod /= 2, fAmplitude *= 0.5f)
+      {
+        // Bilinear interpolation between lattice values, wrapped so the texture tiles seamlessly.
+        int nCells = nSize / nPeriod;
+        int cx = x / nPeriod, cy = y / nPeriod;
+        float fx = (float)(x % nPeriod) / nPeriod, fy = (float)(y % nPeriod) / nPeriod;
+        float a = hash(cx % nCells, cy % nCells), b = hash((cx + 1) % nCells, cy % nCells);
+        float c = hash(cx % nCells, (cy + 1) % nCells), d = hash((cx + 1) % nCells, (cy + 1) % nCells);
+        fValue += fAmplitude * ((a * (1 - fx) + b * fx) * (1 - fy) + (c * (1 - fx) + d * fx) * fy);
+      }
+      uint8_t g = (uint8_t)(160.0f + 95.0f * std::min(fValue / 0.95f, 1.0f));
+      sprite.SetPixel(x, y, olc::Pixel(g, g, g));
+    }
+  Texture_Create(tex, &sprite);
+}
+
+// Coverage
+struct coveragespan
+{
+  int x0, x1;  // Covers pixels x0 up to, but not including, x1.
+};
+
+struct spanbuffer
+{
+  // Per scanline, the pixels that have been written so far, as sorted and disjoint spans. When
+  // triangles are drawn from front to back, a pixel that is already covered is hidden, so each
+  // pixel only has to be written once.
+  int width = 0, height = 0;
+  std::vector<std::vector<coveragespan>> rows;
+  int nFullRows = 0;
+  long long nPixelsWritten = 0;
+  long long nPixelsSkipped = 0;  // Overdraw that back to front drawing would have had.
+  int nTrianglesSkipped = 0;  // Triangles not drawn at all, since the buffer was already full.
+};
+
+void SpanBuffer_Clear(spanbuffer &sb, int nWidth, int nHeight)
+{
+  sb.width = nWidth;
+  sb.height = nHeight;
+  sb.rows.resize(nHeight);
+  for (auto &row : sb.rows)
+    row.clear();  // Keeps the capacity, so there are few allocations after the first frame.
+  sb.nFullRows = 0;
+  sb.nPixelsWritten = 0;
+  sb.nPixelsSkipped = 0;
+  sb.nTrianglesSkipped = 0;
+}
+
+inline bool SpanBuffer_IsFull(spanbuffer &sb)
+{
+  return sb.nFullRows == sb.height;
+}
+
+template <typename F>
+void SpanBuffer_Insert(spanbuffer &sb, int y, int xStart, int xEnd, F fnDrawSpan)
+{
+  // Calls fnDrawSpan(x0, x1) for every part of [xStart, xEnd) on scanline y that isn't covered
+  // yet, then marks all of it as covered.
+  std::vector<coveragespan> &row = sb.rows[y];
+  auto isFull = [&sb, &row]() { return row.size() == 1 && row[0].x0 <= 0 && row[0].x1 >= sb.width; };
+  if (isFull())
+  {
+    sb.nPixelsSkipped += xEnd - xStart;
+    return;
+  }
+
+  auto first = std::lower_bound(row.begin(), row.end(), xStart, [](const coveragespan &s, int x) { return s.x1 < x; });
+  int x = xStart;
+  auto it = first;
+  for (; it != row.end() && it->x0 <= xEnd; ++it)
+  {
+    if (it->x0 > x)
+    {
+      fnDrawSpan(x, it->x0);
+      sb.nPixelsWritten += it->x0 - x;
+    }
+    int nCovered = std::min(it->x1, xEnd) - std::max(it->x0, x);
+    if (nCovered > 0)
+      sb.nPixelsSkipped += nCovered;
+    x = std::max(x, it->x1);
+  }
+  if (x < xEnd)
+  {
+    fnDrawSpan(x, xEnd);
+    sb.nPixelsWritten += xEnd - x;
+  }
+
+  // Merge the new span with the spans it overlaps or touches, which are [first, it).
+  coveragespan merged = { xStart, xEnd };
+  if (first != it)
+  {
+    merged.x0 = std::min(merged.x0, first->x0);
+    merged.x1 = std::max(merged.x1, (it - 1)->x1);
+    *first = merged;
+    row.erase(first + 1, it);
+  }
+  else
+    row.insert(first, merged);
+  if (isFull())
+    sb.nFullRows++;
+}
+
+// Render queue
+// Every triangle a view draws gets a draw item, whose 64-bit key orders the whole view in one
+// sort: the layer in the top 4 bits, then 32 bits of depth, then 28 bits of material.
+const int nLayerWorld = 0;
+const int nLayerOverlay = 1;  // Drawn over the world regardless of depth, e.g. the axes gizmo.
+const int nMaterialFlat = 0;
+const int nMaterialTerrainTexture = 1;
+
+struct drawitem
+{
+  uint64_t nKey;
+  int nTriangle;  // Index into the view's triangles.
+};
+
+uint64_t DrawItem_MakeKey(int nLayer, float fDepth, bool bBackToFront, int nMaterial)
+{
+  // Flipping the sign bit of a positive float, or all bits of a negative one, makes its bits
+  // order like the float itself.
+  uint32_t nDepth;
+  memcpy(&nDepth, &fDepth, sizeof(nDepth));
+  nDepth = (nDepth & 0x80000000u) ? ~nDepth : (nDepth | 0x80000000u);
+  if (bBackToFront)
+    nDepth = ~nDepth;
+  return ((uint64_t)nLayer << 60) | ((uint64_t)nDepth << 28) | (uint64_t)nMaterial;
+}
+
+inline int DrawItem_Layer(drawitem &item)
+{
+  return (int)(item.nKey >> 60);
+}
+
+void RenderQueue_Sort(std::vector<drawitem> &vecItems, std::vector<drawitem> &vecScratch)
+{
+  // Least significant digit radix sort, a byte at a time. The histograms of all bytes are counted
+  // in one pass, and bytes that are the same in every key are skipped. So while there is only one
+  // layer and one material, and when a depth buffer leaves the depth at zero, those cost nothing.
+  size_t n = vecItems.size();
+  if (n < 2)
+    return;
+  vecScratch.resize(n);
+  uint32_t counts[8][256] = {};
+  for (auto &item : vecItems)
+    for (int b = 0; b < 8; b++)
+      counts[b][(item.nKey >> (8 * b)) & 0xff]++;
+
+  drawitem *pSrc = vecItems.data(), *pDst = vecScratch.data();
+  for (int b = 0; b < 8; b++)
+  {
+    uint32_t *pCounts = counts[b];
+    if (pCounts[(pSrc[0].nKey >> (8 * b)) & 0xff] == n)
+      continue;
+    uint32_t nOffset = 0;
+    for (int d = 0; d < 256; d++)
+    {
+      uint32_t nCount = pCounts[d];
+      pCounts[d] = nOffset;
+      nOffset += nCount;
+    }
+    for (size_t i = 0; i < n; i++)
+      pDst[pCounts[(pSrc[i].nKey >> (8 * b)) & 0xff]++] = pSrc[i];
+    std::swap(pSrc, pDst);
+  }
+  if (pSrc != vecItems.data())
+    vecItems.swap(vecScratch);
+}
+
+// Rasterization
+template <bool bDepthTest, bool bCoverage = false, typename T>
+void Triangle_FillBuffer(triangle &tri, T value, T *pData, int nTargetWidth, int nTargetHeight, float *pDepth = nullptr, spanbuffer *pCoverage = nullptr,
+                         int *pIds = nullptr, int nId = 0)
+{
+  // Fills a screen space triangle with a value in a buffer of nTargetWidth by nTargetHeight
+  // values, such as the pixels of a sprite.
+  // With the depth test, pDepth holds one reciprocal depth per target pixel (see vec2d's w), and
+  // pixels are only written where the triangle is closer, i.e. where its 1/depth is larger.
+  // With coverage, triangles are expected from front to back, and only the pixels that pCoverage
+  // doesn't cover yet are written.
+  // When pIds is given, it gets nId in every pixel that is written, e.g. for a G-buffer.
+  static_assert(!(bDepthTest && bCoverage), "Visibility is resolved either by depth or by coverage");
+  vec3d *p[3] = { &tri.p[0], &tri.p[1], &tri.p[2] };
+  vec2d *t[3] = { &tri.t[0], &tri.t[1], &tri.t[2] };
+  if (p[1]->y < p[0]->y) { std::swap(p[0], p[1]); std::swap(t[0], t[1]); }
+  if (p[2]->y < p[0]->y) { std::swap(p[0], p[2]); std::swap(t[0], t[2]); }
+  if (p[2]->y < p[1]->y) { std::swap(p[1], p[2]); std::swap(t[1], t[2]); }
+  if (p[2]->y - p[0]->y < 1e-6f)
+    return;
+
+  // Position and reciprocal depth along an edge at pixel row center yc.
+  auto edgeAt = [](vec3d *pa, vec2d *ta, vec3d *pb, vec2d *tb, float yc, float &x, float &w)
+  {
+    float f = (pb->y != pa->y) ? (yc - pa->y) / (pb->y - pa->y) : 0.0f;
+    x = pa->x + f * (pb->x - pa->x);
+    w = ta->w + f * (tb->w - ta->w);
+  };
+
+  int yStart = std::max((int)ceilf(p[0]->y - 0.5f), 0);
+  int yEnd = std::min((int)ceilf(p[2]->y - 0.5f), nTargetHeight);
+  for (int y = yStart; y < yEnd; y++)
+  {
+    float yc = y + 0.5f;
+    float xa, wa, xb, wb;
+    edgeAt(p[0], t[0], p[2], t[2], yc, xa, wa);
+    if (yc < p[1]->y)
+      edgeAt(p[0], t[0], p[1], t[1], yc, xb, wb);
+    else
+      edgeAt(p[1], t[1], p[2], t[2], yc, xb, wb);
+    if (xb < xa)
+    {
+      std::swap(xa, xb); std::swap(wa, wb);
+    }
+    int xStart = std::max((int)ceilf(xa - 0.5f), 0);
+    int xEnd = std::min((int)ceilf(xb - 0.5f), nTargetWidth);
+    if (xStart >= xEnd)
+      continue;
+
+    T *pRow = pData + y * nTargetWidth;
+    int *pIdsRow = pIds ? pIds + y * nTargetWidth : nullptr;
+    if constexpr (bDepthTest)
+    {
+      float dw = (xb - xa > 1e-6f) ? (wb - wa) / (xb - xa) : 0.0f;
+      float w = wa + (xStart + 0.5f - xa) * dw;
+      float *pDepthRow = pDepth + y * nTargetWidth;
+      for (int x = xStart; x < xEnd; x++)
+      {
+        if (w > pDepthRow[x])
+        {
+          pDepthRow[x] = w;
+          pRow[x] = value;
+          if (pIdsRow)
+            pIdsRow[x] = nId;
+        }
+        w += dw;
+      }
+    }
+    else if constexpr (bCoverage)
+      SpanBuffer_Insert(*pCoverage, y, xStart, xEnd, [pRow, pIdsRow, value, nId](int x0, int x1)
+      {
+        std::fill(pRow + x0, pRow + x1, value);
+        if (pIdsRow)
+          std::fill(pIdsRow + x0, pIdsRow + x1, nId);
+      });
+    else
+    {
+      std::fill(pRow + xStart, pRow + xEnd, value);
+      if (pIdsRow)
+        std::fill(pIdsRow + xStart, pIdsRow + xEnd, nId);
+    }
+  }
+}
+
+template <bool bDepthTest, bool bCoverage = false>
+void Triangle_RasterizeFlat(triangle &tri, olc::Sprite *pTarget, float *pDepth = nullptr, spanbuffer *pCoverage = nullptr, int *pIds = nullptr, int nId = 0)
+{
+  // Fills a screen space triangle with its fill color. Unlike the engine's FillTriangle, it draws
+  // into the given sprite directly, so several of these can run on different threads.
+  if (pTarget)
+    Triangle_FillBuffer<bDepthTest, bCoverage>(tri, tri.fillColor, pTarget->GetData(), pTarget->width, pTarget->height, pDepth, pCoverage, pIds, nId);
+}
+
+void Triangle_RasterizeOutline(triangle &tri, olc::Pixel color, olc::Sprite *pTarget)
+{
+  // Draws the edges of a screen space triangle into the given sprite, without depth test.
+  if (!pTarget)
+    return;
+
+  olc::Pixel *pData = pTarget->GetData();
+  int nTargetWidth = pTarget->width, nTargetHeight = pTarget->height;
+  for (int e = 0; e < 3; e++)
+  {
+    // Bresenham's line algorithm. The triangle has been clipped to the target, only the far
+    // edges may end up one pixel outside of it.
+    int x0 = (int)tri.p[e].x, y0 = (int)tri.p[e].y;
+    int x1 = (int)tri.p[(e + 1) % 3].x, y1 = (int)tri.p[(e + 1) % 3].y;
+    int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+    int sx = (x0 < x1) ? 1 : -1, sy = (y0 < y1) ? 1 : -1;
+    int err = dx + dy;
+    while (true)
+    {
+      if (x0 >= 0 && x0 < nTargetWidth && y0 >= 0 && y0 < nTargetHeight)
+        pData[y0 * nTargetWidth + x0] = color;
+      if (x0 == x1 && y0 == y1)
+        break;
+      int e2 = 2 * err;
+      if (e2 >= dy) { err += dy; x0 += sx; }
+      if (e2 <= dx) { err += dx; y0 += sy; }
+    }
+  }
+}
+
+template <bool bDepthTest, bool bCoverage = false>
+void Triangle_RasterizeTextured(triangle &tri, texture &tex, olc::Sprite *pTarget, float *pDepth = nullptr, spanbuffer *pCoverage = nullptr,
+                                int *pIds = nullptr, int nId = 0)
+{
+  // Rasterizes a screen space triangle whose texture coordinates have been divided by depth (see
+  // vec2d), so they can be interpolated linearly and divided by the interpolated 1/depth per
+  // pixel for perspective correct texturing. The texel is modulated by the triangle's fill color,
+  // which carries its shading. The mip level is chosen once per triangle, from the ratio of the
+  // triangle's area in texels and in pixels. The depth test, coverage and ids work as in
+  // Triangle_RasterizeFlat.
+  static_assert(!(bDepthTest && bCoverage), "Visibility is resolved either by depth or by coverage");
+  if (tex.levels.empty() || !pTarget)
+    return;
+
+  vec3d *p[3] = { &tri.p[0], &tri.p[1], &tri.p[2] };
+  vec2d *t[3] = { &tri.t[0], &tri.t[1], &tri.t[2] };
+  if (p[1]->y < p[0]->y) { std::swap(p[0], p[1]); std::swap(t[0], t[1]); }
+  if (p[2]->y < p[0]->y) { std::swap(p[0], p[2]); std::swap(t[0], t[2]); }
+  if (p[2]->y < p[1]->y) { std::swap(p[1], p[2]); std::swap(t[1], t[2]); }
+
+  float fScreenArea = fabsf((p[1]->x - p[0]->x) * (p[2]->y - p[0]->y) - (p[2]->x - p[0]->x) * (p[1]->y - p[0]->y));
+  if (fScreenArea < 1e-6f)
+    return;
+
+  // Mip level selection, with the texture coordinates at the corners undivided again.
+  float u0 = t[0]->u / t[0]->w, v0 = t[0]->v / t[0]->w;
+  float u1 = t[1]->u / t[1]->w, v1 = t[1]->v / t[1]->w;
+  float u2 = t[2]->u / t[2]->w, v2 = t[2]->v / t[2]->w;
+  float fTexelArea = fabsf((u1 - u0) * (v2 - v0) - (u2 - u0) * (v1 - v0)) * tex.levels[0].width * tex.levels[0].height;
+  int nLevel = 0;
+  if (fTexelArea > fScreenArea)
+    nLevel = std::min((int)(0.5f * log2f(fTexelArea / fScreenArea)), (int)tex.levels.size() - 1);
+  texturelevel &level = tex.levels[nLevel];
+  int nMaskX = level.width - 1, nMaskY = level.height - 1;
+  float fWidth = (float)level.width, fHeight = (float)level.height;
+
+  olc::Pixel *pData = pTarget->GetData();
+  int nTargetWidth = pTarget->width, nTargetHeight = pTarget->height;
+  olc::Pixel tint = tri.fillColor;
+
+  // Attributes along an edge at pixel row center yc.
+  auto edgeAt = [](vec3d *pa, vec2d *ta, vec3d *pb, vec2d *tb, float yc, float &x, float &u, float &v, float &w)
+  {
+    float f = (pb->y != pa->y) ? (yc - pa->y) / (pb->y - pa->y) : 0.0f;
+    x = pa->x + f * (pb->x - pa->x);
+    u = ta->u + f * (tb->u - ta->u);
+    v = ta->v + f * (tb->v - ta->v);
+    w = ta->w + f * (tb->w - ta->w);
+  };
+
+  int yStart = std::max((int)ceilf(p[0]->y - 0.5f), 0);
+  int yEnd = std::min((int)ceilf(p[2]->y - 0.5f), nTargetHeight);
+  for (int y = yStart; y < yEnd; y++)
+  {
+    float yc = y + 0.5f;
+    float xa, ua, va, wa, xb, ub, vb, wb;
+    edgeAt(p[0], t[0], p[2], t[2], yc, xa, ua, va, wa);
+    if (yc < p[1]->y)
+      edgeAt(p[0], t[0], p[1], t[1], yc, xb, ub, vb, wb);
+    else
+      edgeAt(p[1], t[1], p[2], t[2], yc, xb, ub, vb, wb);
+    if (xb < xa)
+    {
+      std::swap(xa, xb); std::swap(ua, ub); std::swap(va, vb); std::swap(wa, wb);
+    }
+    if (xb - xa < 1e-6f)
+      continue;
+
+    float fInvSpan = 1.0f / (xb - xa);
+    float du = (ub - ua) * fInvSpan, dv = (vb - va) * fInvSpan, dw = (wb - wa) * fInvSpan;
+    int xStart = std::max((int)ceilf(xa - 0.5f), 0);
+    int xEnd = std::min((int)ceilf(xb - 0.5f), nTargetWidth);
+    if (xStart >= xEnd)
+      continue;
+
+    olc::Pixel *pRow = pData + y * nTargetWidth;
+    float *pDepthRow = bDepthTest ? pDepth + y * nTargetWidth : nullptr;
+    int *pIdsRow = pIds ? pIds + y * nTargetWidth : nullptr;
+    auto shadeSpan = [&](int x0, int x1)
+    {
+      float fOffset = x0 + 0.5f - xa;
+      float u = ua + fOffset * du, v = va + fOffset * dv, w = wa + fOffset * dw;
+      for (int x = x0; x < x1; x++)
+      {
+        if constexpr (bDepthTest)
+        {
+          if (w <= pDepthRow[x])
+          {
+            u += du; v += dv; w += dw;
+            continue;
+          }
+          pDepthRow[x] = w;
+          if (pIdsRow)
+            pIdsRow[x] = nId;
+        }
+        float fDepth = 1.0f / w;
+        int tx = (int)floorf(u * fDepth * fWidth) & nMaskX;
+        int ty = (int)floorf(v * fDepth * fHeight) & nMaskY;
+        olc::Pixel texel = level.texels[Texture_TiledIndex(level, tx, ty)];
+        pRow[x] = olc::Pixel(texel.r * tint.r / 255, texel.g * tint.g / 255, texel.b * tint.b / 255);
+        u += du; v += dv; w += dw;
+      }
+      if (pIdsRow && !bDepthTest)
+        std::fill(pIdsRow + x0, pIdsRow + x1, nId);
+    };
+    if constexpr (bCoverage)
+      SpanBuffer_Insert(*pCoverage, y, xStart, xEnd, shadeSpan);
+    else
+      shadeSpan(xStart, xEnd);
+  }
+}
+
+// Debug views
+struct renderstats
+{
+  // Where the fill work of a view goes. Overdraw counts pixel writes, so it depends on how
+  // visibility is resolved: painting writes every fragment, the depth buffer writes the fragments
+  // that are closer than what's there, and span buffers write every pixel once.
+  int nTriangles = 0;
+  long long nWrites = 0;
+  int nCoveredPixels = 0;
+  int nMaxOverdraw = 0;
+  int nMaxTrianglesPerTile = 0;
+  int nOccupiedTiles = 0;
+  int nSubPixelTriangles = 0;  // Triangles covering less than a pixel's area.
+};
+
+void Triangle_CountWrites(triangle &tri, uint16_t *pCounts, int nWidth, int nHeight, float *pDepth = nullptr, spanbuffer *pCoverage = nullptr)
+{
+  // Counts the pixels a screen space triangle writes, with the same pixel centers as the software
+  // rasterizers, and the same depth test or coverage if given.
+  vec3d *p[3] = { &tri.p[0], &tri.p[1], &tri.p[2] };
+  vec2d *t[3] = { &tri.t[0], &tri.t[1], &tri.t[2] };
+  if (p[1]->y < p[0]->y) { std::swap(p[0], p[1]); std::swap(t[0], t[1]); }
+  if (p[2]->y < p[0]->y) { std::swap(p[0], p[2]); std::swap(t[0], t[2]); }
+  if (p[2]->y < p[1]->y) { std::swap(p[1], p[2]); std::swap(t[1], t[2]); }
+  if (p[2]->y - p[0]->y < 1e-6f)
+    return;
+
+  auto edgeAt = [](vec3d *pa, vec2d *ta, vec3d *pb, vec2d *tb, float yc, float &x, float &w)
+  {
+    float f = (pb->y != pa->y) ? (yc - pa->y) / (pb->y - pa->y) : 0.0f;
+    x = pa->x + f * (pb->x - pa->x);
+    w = ta->w + f * (tb->w - ta->w);
+  };
+
+  int yStart = std::max((int)ceilf(p[0]->y - 0.5f), 0);
+  int yEnd = std::min((int)ceilf(p[2]->y - 0.5f), nHeight);
+  for (int y = yStart; y < yEnd; y++)
+  {
+    float yc = y + 0.5f;
+    float xa, wa, xb, wb;
+    edgeAt(p[0], t[0], p[2], t[2], yc, xa, wa);
+    if (yc < p[1]->y)
+      edgeAt(p[0], t[0], p[1], t[1], yc, xb, wb);
+    else
+      edgeAt(p[1], t[1], p[2], t[2], yc, xb, wb);
+    if (xb < xa)
+    {
+      std::swap(xa, xb); std::swap(wa, wb);
+    }
+    int xStart = std::max((int)ceilf(xa - 0.5f), 0);
+    int xEnd = std::min((int)ceilf(xb - 0.5f), nWidth);
+    if (xStart >= xEnd)
+      continue;
+
+    uint16_t *pRow = pCounts + y * nWidth;
+    auto countSpan = [pRow](int x0, int x1)
+    {
+      for (int x = x0; x < x1; x++)
+        if (pRow[x] < 0xFFFF)
+          pRow[x]++;
+    };
+    if (pDepth)
+    {
+      float dw = (xb - xa > 1e-6f) ? (wb - wa) / (xb - xa) : 0.0f;
+      float w = wa + (xStart + 0.5f - xa) * dw;
+      float *pDepthRow = pDepth + y * nWidth;
+      for (int x = xStart; x < xEnd; x++, w += dw)
+        if (w > pDepthRow[x])
+        {
+          pDepthRow[x] = w;
+          countSpan(x, x + 1);
+        }
+    }
+    else if (pCoverage)
+      SpanBuffer_Insert(*pCoverage, y, xStart, xEnd, countSpan);
+    else
+      countSpan(xStart, xEnd);
+  }
+}
+
+olc::Pixel Heatmap_Color(float f)
+{
+  // Maps 0..1 to black, blue, green, yellow, red and white.
+  static const olc::Pixel stops[] = { { 0, 0, 0 }, { 0, 0, 255 }, { 0, 255, 0 }, { 255, 255, 0 }, { 255, 0, 0 }, { 255, 255, 255 } };
+  const int nStops = sizeof(stops) / sizeof(stops[0]);
+  f = std::min(std::max(f, 0.0f), 1.0f) * (nStops - 1);
+  int i = std::min((int)f, nStops - 2);
+  float a = f - i;
+  return olc::Pixel((uint8_t)(stops[i].r + a * (stops[i + 1].r - stops[i].r)),
+                    (uint8_t)(stops[i].g + a * (stops[i + 1].g - stops[i].g)),
+                    (uint8_t)(stops[i].b + a * (stops[i + 1].b - stops[i].b)));
+}
+
+// Impostors
+struct meshchunks
+{
+  // The triangles of a stationary mesh grouped by a grid over its XY footprint, with a bounding
+  // sphere per chunk, such that distant chunks can be drawn as impostors.
+  std::vector<vec3d> centers;
+  std::vector<float> radii;
+  std::vector<int> triChunks;  // Per triangle, the chunk that holds its centroid.
+  std::vector<int> chunkOffsets;  // Triangles of chunk c are chunkTris[chunkOffsets[c]] up to chunkTris[chunkOffsets[c + 1]].
+  std::vector<int> chunkTris;
+};
+
+void MeshChunks_Build(meshchunks &chunks, std::vector<vec3d> &worldVerts, std::vector<int> &indices, int nChunksPerSide)
+{
+  int nTris = indices.size() / 3;
+  int nChunks = nChunksPerSide * nChunksPerSide;
+  if (worldVerts.empty() || nTris == 0)
+  {
+    chunks = meshchunks();
+    return;
+  }
+
+  float fMinX = worldVerts[0].x, fMaxX = fMinX, fMinY = worldVerts[0].y, fMaxY = fMinY;
+  for (auto &v : worldVerts)
+  {
+    fMinX = std::min(fMinX, v.x); fMaxX = std::max(fMaxX, v.x);
+    fMinY = std::min(fMinY, v.y); fMaxY = std::max(fMaxY, v.y);
+  }
+  float fChunkWidth = std::max(fMaxX - fMinX, 1e-6f) / nChunksPerSide;
+  float fChunkHeight = std::max(fMaxY - fMinY, 1e-6f) / nChunksPerSide;
+
+  chunks.triChunks.resize(nTris);
+  chunks.chunkOffsets.assign(nChunks + 1, 0);
+  for (int t = 0; t < nTris; t++)
+  {
+    vec3d &a = worldVerts[indices[t * 3]], &b = worldVerts[indices[t * 3 + 1]], &c = worldVerts[indices[t * 3 + 2]];
+    int cx = std::min((int)(((a.x + b.x + c.x) / 3.0f - fMinX) / fChunkWidth), nChunksPerSide - 1);
+    int cy = std::min((int)(((a.y + b.y + c.y) / 3.0f - fMinY) / fChunkHeight), nChunksPerSide - 1);
+    chunks.triChunks[t] = cy * nChunksPerSide + cx;
+    chunks.chunkOffsets[chunks.triChunks[t] + 1]++;
+  }
+  for (int c = 0; c < nChunks; c++)
+    chunks.chunkOffsets[c + 1] += chunks.chunkOffsets[c];
+  chunks.chunkTris.resize(nTris);
+  std::vector<int> vecFill(chunks.chunkOffsets.begin(), chunks.chunkOffsets.end() - 1);
+  for (int t = 0; t < nTris; t++)
+    chunks.chunkTris[vecFill[chunks.triChunks[t]]++] = t;
+
+  // Bounding spheres around the center of each chunk's bounding box.
+  chunks.centers.assign(nChunks, { 0.0f, 0.0f, 0.0f });
+  chunks.radii.assign(nChunks, 0.0f);
+  for (int c = 0; c < nChunks; c++)
+  {
+    vec3d vMin = { INFINITY, INFINITY, INFINITY }, vMax = { -INFINITY, -INFINITY, -INFINITY };
+    for (int i = chunks.chunkOffsets[c]; i < chunks.chunkOffsets[c + 1]; i++)
+      for (int k = 0; k < 3; k++)
+      {
+        vec3d &v = worldVerts[indices[chunks.chunkTris[i] * 3 + k]];
+        vMin.x = std::min(vMin.x, v.x); vMax.x = std::max(vMax.x, v.x);
+        vMin.y = std::min(vMin.y, v.y); vMax.y = std::max(vMax.y, v.y);
+        vMin.z = std::min(vMin.z, v.z); vMax.z = std::max(vMax.z, v.z);
+      }
+    if (chunks.chunkOffsets[c] == chunks.chunkOffsets[c + 1])
+      continue;
+    vec3d &center = chunks.centers[c];
+    center = { 0.5f * (vMin.x + vMax.x), 0.5f * (vMin.y + vMax.y), 0.5f * (vMin.z + vMax.z) };
+    for (int i = chunks.chunkOffsets[c]; i < chunks.chunkOffsets[c + 1]; i++)
+      for (int k = 0; k < 3; k++)
+      {
+        vec3d vOffset = Vec3d_Sub(worldVerts[indices[chunks.chunkTris[i] * 3 + k]], center);
+        chunks.radii[c] = std::max(chunks.radii[c], Vec3d_Length(vOffset));
+      }
+  }
+}
+
+struct impostor
+{
+  // A chunk rendered into a small sprite, as seen from the camera's position at the time. Pixels
+  // where the chunk doesn't show are transparent.
+  int nChunk = -1;
+  std::unique_ptr<olc::Sprite> sprite;
+  coordsys csCamera;  // What it was rendered with. The camera looks at the chunk's center.
+  float fTanHalfFov = 0.0f;
+  vec3d vLight;
+  float fDistance = 0.0f;
+  int nFeatures = 0;
+  int nLastUsedFrame = -1;
+};
+
+// Per-frame state
+const int nMaxViews = 3;  // The main view, a rear view and a top-down minimap.
+
+// Optional pipeline features. Every combination is a separate instantiation of the pipeline, so
+// each one contains only the work it needs, and a frame's combination picks the instantiation.
+const int nFeatureLit = 1;  // Shade triangles by the light direction, otherwise only by height.
+const int nFeatureAnimated = 2;  // The mesh moves, so its world space data is rebuilt every frame.
+const int nFeatureWireframe = 4;  // Outline the filled triangles in their wire color.
+const int nFeatureDepthBuffered = 8;  // Resolve visibility per pixel instead of by sorting.
+const int nFeatureTextured = 16;
+const int nFeatureSpanBuffered = 32;  // Draw from front to back, only into pixels that aren't covered yet. Overrides the depth buffer.
+const int nFeatureCombinations = 64;
+
+struct viewport
+{
+  // Where on the screen a view is drawn, and its projection. Views other than the main view are
+  // rasterized into their own render target, which is then drawn at (x, y).
+  int x = 0, y = 0, w = 0, h = 0;
+  mat4x4 matCameraToProjected;
+  mat4x4 matProjectedToScreen;
+  olc::Sprite *target = nullptr;
+};
+
+struct framesnapshot
+{
+  // Copy of everything the geometry stage reads that user input or the simulation may change.
+  coordsys csCamera;
+  vec3d lightDirection;
+  float meshTheta = 0.0f;
+  olc::Pixel colorSky;
+  int nViews = 1;
+  int nFeatures = 0;
+  bool bImpostors = false;
+  bool bGizmo = false;
+  bool bTerrainShadows = false;
+  std::chrono::steady_clock::time_point tpTaken;
+};
+
+struct viewgeometry
+{
+  coordsys csCamera;
+  std::vector<vec3d> vecCameraVerts;  // The mesh's vertex buffer in this view's camera space.
+  std::vector<triangle> vecProjected;  // Triangles in screen space, clipped against the near plane only.
+  std::vector<triangle> vecToRasterize;  // Fully clipped, in no particular order.
+  std::vector<drawitem> vecQueue;  // The triangles above in the order they are drawn.
+  std::vector<drawitem> vecQueueScratch;
+};
+
+struct gbuffer
+{
+  // Per pixel of the main view, what lighting needs: the mesh triangle the pixel shows, for its
+  // normal, and its unlit color. It is kept between frames, so a frame in which only the light
+  // has changed needs nothing but the lighting pass.
+  std::vector<int> vecTriIds;  // -1 where the sky shows.
+  std::vector<olc::Pixel> vecBaseColors;
+  std::vector<vec3d> *pTriNormals = nullptr;
+
+  // What the buffer was rendered with. Anything that changes the unlit image has to be here.
+  coordsys csCamera;
+  float meshTheta = 0.0f;
+  int nFeatures = 0;
+  bool bGizmo = false;
+  int nWidth = 0, nHeight = 0;
+  bool bValid = false;
+};
+
+struct framedata
+{
+  framesnapshot snapshot;
+
+  // Results of the world space pass, which are shared by all views. A stationary mesh's world
+  // space data is built once, animated meshes are rebuilt into the frame's own buffers.
+  std::vector<vec3d> vecWorldVerts;  // The mesh's vertex buffer in world space.
+  std::vector<vec3d> vecTriNormals;  // Per triangle, in world space.
+  std::vector<olc::Pixel> vecTriBaseColors;  // Per triangle, by height.
+  std::vector<olc::Pixel> vecTriFillColors;  // Per triangle, with lighting applied.
+  std::vector<olc::Pixel> vecTriWireColors;
+  std::vector<vec3d> *pWorldVerts = nullptr;  // Whichever of the buffers above is in use.
+  std::vector<vec3d> *pTriNormals = nullptr;
+  std::vector<olc::Pixel> *pTriFillColors = nullptr;
+
+  // The chunks drawn as impostors in the main view, from far to near.
+  std::vector<int> vecImpostorChunks;
+  std::vector<char> vecChunkIsImpostor;
+
+  viewgeometry views[nMaxViews];
+
+  float fGeometryMs = 0.0f;  // How long building the frame's geometry took.
+
+  // When set, rasterizing the main view also stores which mesh triangle each pixel shows, the
+  // G-buffer's ids (see gbuffer).
+  int *pTriIds = nullptr;
+};
+
+
+// The 3D graphics engine class.
+class olcEngine3D : public olc::PixelGameEngine
+{
+public:
+  olcEngine3D()
+  {
+    sAppName = "3D Demo";
+  }
+
+  ~olcEngine3D()
+  {
+    StopGeometryWorker();
+    WorkerPool_Stop(poolWorkers);
+  }
+
+private:
+  mesh meshLocal;  // The drawn object in local space.
+  bool bQuantizeVertices = true;  // Whether to store the mesh's vertices as 16-bit integers.
+  float meshDeltaTheta;  // Setting for how fast the mesh should rotate.
+  float meshCurrentTheta; // Used to keep track of the mesh's current rotation angle, updated at every frame.
+  vec3d meshTranslation;  // Used to keep track of the mesh's current translation.
+
+  coordsys csCamera;  // Used to keep track of the current position and orientation of the camera.
+  float fFovDeg, fNear, fFar, fAspectRatio;  // Camera settings.
+
+  mat4x4 matCameraToProjected;  // Matrix to transform from camera space to normalized projection space.
+  mat4x4 matProjectedToScreen;  // Matrix to transform from normalized projection space to screen space.
+
+  viewport viewports[nMaxViews];  // The main view covers the screen, the others are insets.
+  std::unique_ptr<olc::Sprite> sprViewTargets[nMaxViews];
+  bool bExtraViews = false;
+  float fMinimapHeight = 60.0f;  // How far above the camera the minimap's camera is.
+
+  // The axes gizmo, drawn in the bottom left corner of the main view with the camera's orientation.
+  mesh meshGizmo;
+  std::vector<vec3d> vecGizmoNormals;  // Per triangle, in the gizmo's local space.
+  std::vector<olc::Pixel> vecGizmoColors;  // Per triangle, by the axis it belongs to.
+  bool bGizmo = true;
+  int nGizmoSize = 96;  // Pixels per side of the gizmo's square.
+
+  olc::Pixel colorDay, colorNight, colorSky, colorGrass, colorMountain, colorSnow;
+  vec3d lightDirection;  // Direction of the light, we assume the source is infinitely far away.
+  bool bLighting = true;
+  bool bWireframe = false;
+  bool bDepthBuffered = false;
+  bool bSpanBuffered = false;
+  spanbuffer spanBuffers[nMaxViews];  // Per view, which pixels are covered when drawing front to back.
+  long long nOverdrawEliminated = 0;  // Of the last frame, summed over its views.
+  int nTrianglesSkipped = 0;
+
+  // Deferred lighting keeps the main view's unlit colors and triangles, and only relights them in
+  // frames in which nothing but the light has changed.
+  bool bDeferredLighting = false;
+  gbuffer gbufMain;
+  std::vector<float> vecTriLightFactors;
+  float fLightingMs = 0.0f;
+  bool bRelitOnly = false;  // Whether the last frame only ran the lighting pass.
+
+  // Impostors: distant chunks of a stationary mesh are drawn as cached sprites of themselves,
+  // which are only re-rendered once the view or the light has changed enough.
+  bool bImpostors = false;
+  meshchunks chunksTerrain;
+  int nChunksPerSide = 16;
+  int nImpostorSize = 128;  // Pixels per side of an impostor. Chunks get one once they appear no larger.
+  size_t nImpostorBudgetBytes = 8 << 20;  // Limits how many impostors are cached, and so drawn.
+  float fImpostorMaxAngle = 2.0f * 3.141592f / 180.0f;  // How far the direction to the chunk may turn.
+  float fImpostorMaxLightAngle = 3.0f * 3.141592f / 180.0f;
+  float fImpostorMaxZoom = 1.25f;  // How much closer or farther the camera may get.
+  std::vector<std::unique_ptr<impostor>> vecImpostorCache;
+  std::vector<int> vecChunkImpostorSlots;  // Per chunk, its impostor's index in the cache, or -1.
+  std::vector<triangle> vecImpostorTriangles;
+  int nImpostorFrame = 0;
+  int nImpostorsDrawn = 0, nImpostorsRendered = 0;  // Last frame.
+
+  // Debug views, showing heatmaps of the main view's pixel writes or of its triangles per tile.
+  bool bOverdrawView = false;
+  bool bDensityView = false;
+  bool bRenderStats = false;  // Analyze frames even without a debug view, e.g. when benchmarking.
+  int nDensityTileSize = 16;
+  std::vector<uint16_t> vecOverdraw;  // Writes per pixel.
+  std::vector<int> vecTileTriangles;  // Triangles per tile, by the tile that holds their centroid.
+  renderstats stats;  // Of the last analyzed frame.
+  std::vector<float> vecDepthBuffers[nMaxViews];  // Per view, reciprocal depth per pixel.
+
+  // World space data of a stationary mesh, built once in OnUserCreate.
+  std::vector<vec3d> vecStaticWorldVerts;
+  std::vector<vec3d> vecStaticTriNormals;
+  std::vector<olc::Pixel> vecStaticTriBaseColors;
+
+  texture texTerrain;  // Texture for the mesh, modulated by its height colors and shading.
+  bool bTextured = false;
+
+  terraingrid gridTerrain;  // Spatial grid over the mesh in world space, for collision and height queries.
+  bool bTerrainCollision = false;  // Only possible when the mesh doesn't move.
+  float fCameraClearance = 0.5f;  // How close the camera may come to the terrain.
+
+  // Shadows the terrain casts on itself, looked up in a horizon map built at load time.
+  horizonmap horizonTerrain;
+  int nHorizonAzimuths = 32;
+  bool bTerrainShadows = true;
+
+  // Frame data is double-buffered, such that in pipelined mode the geometry of the next frame
+  // can be built on a worker thread while the current frame is being rasterized.
+  framedata frames[2];
+  int nFrontFrame = 0;  // The frame that is rasterized next.
+  bool bPipelined = false;
+  bool bPipelinePrimed = false;
+  bool bHeadless = false;  // Set when rendering offscreen without Start, e.g. for benchmarking.
+  float fGeometryMs = 0.0f, fRasterMs = 0.0f, fPipelineLatencyMs = 0.0f;
+
+  std::thread geometryWorker;
+  std::mutex muxGeometryWorker;
+  std::condition_variable cvGeometryWorker;
+  int nGeometryWorkerFrame = 0;
+  bool bGeometryWorkerBusy = false;
+  bool bGeometryWorkerQuit = false;
+
+  // Shared by all parallel work, e.g. building and rasterizing the extra views.
+  workerpool poolWorkers;
+
+public:
+  bool OnUserCreate() override
+  {
+    // Initialize a mesh in local space.
+    // meshLocal.tris = {  // Unit cube centered on the origin.
+    //   // SOUTH
+    //   { -0.5f,  0.5f, -0.5f, 1.0f,    -0.5f, -0.5f, -0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f },
+    //   { -0.5f,  0.5f, -0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f,    -0.5f,  0.5f,  0.5f, 1.0f },
+    //   // EAST
+    //   { -0.5f, -0.5f, -0.5f, 1.0f,     0.5f, -0.5f, -0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f },
+    //   { -0.5f, -0.5f, -0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f },
+    //   // NORTH
+    //   {  0.5f, -0.5f, -0.5f, 1.0f,     0.5f,  0.5f, -0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f },
+    //   {  0.5f, -0.5f, -0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f },
+    //   // WEST
+    //   {  0.5f,  0.5f, -0.5f, 1.0f,    -0.5f,  0.5f, -0.5f, 1.0f,    -0.5f,  0.5f,  0.5f, 1.0f },
+    //   {  0.5f,  0.5f, -0.5f, 1.0f,    -0.5f,  0.5f,  0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f },
+    //   // TOP
+    //   { -0.5f,  0.5f,  0.5f, 1.0f,    -0.5f, -0.5f,  0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f },
+    //   { -0.5f,  0.5f,  0.5f, 1.0f,     0.5f, -0.5f,  0.5f, 1.0f,     0.5f,  0.5f,  0.5f, 1.0f },
+    //   // BOTTOM
+    //   { -0.5f, -0.5f, -0.5f, 1.0f,    -0.5f,  0.5f, -0.5f, 1.0f,     0.5f,  0.5f, -0.5f, 1.0f },
+    //   { -0.5f, -0.5f, -0.5f, 1.0f,     0.5f,  0.5f, -0.5f, 1.0f,     0.5f, -0.5f, -0.5f, 1.0f },
+    // }; meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.4f;
+    // Binary .ply and .stl files can be loaded the same way, e.g. for scanned terrain.
+    // meshLocal.LoadFromObjectFile("axes.obj"); meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.0f;
+    // meshLocal.LoadFromObjectFile("teapot.obj"); meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.0f;
+    Mesh_LoadFromFile(meshLocal, "mountains.obj"); meshTranslation = { 0.0f, 0.0f, 0.0f }; meshDeltaTheta = 0.0f;
+    meshCurrentTheta = 0.0f;
+    std::cout << "Loaded " << meshLocal.tris.size() << " triangles." << std::endl;
+
+    // Load the mesh's texture, or fall back to procedural detail noise. Meshes without texture
+    // coordinates of their own get the texture projected onto them from above.
+    olc::Sprite sprTerrain;
+    if (sprTerrain.LoadFromFile("terrain.png") == olc::rcode::OK && sprTerrain.width > 0)
+      Texture_Create(texTerrain, &sprTerrain);
+    else
+      Texture_CreateDetailNoise(texTerrain, 256);
+    if (meshLocal.uvIndices.empty())
+      Mesh_GeneratePlanarUVs(meshLocal, 8.0f);
+
+    // Reorder the triangles and vertices for better vertex cache reuse. The ACMR (average cache
+    // miss ratio) is the number of vertex transforms per triangle, so lower is better.
+    float fAcmrBefore = Mesh_ComputeACMR(meshLocal.indices, 16);
+    Mesh_OptimizeVertexCache(meshLocal);
+    float fAcmrAfter = Mesh_ComputeACMR(meshLocal.indices, 16);
+    std::cout << "Vertex cache ACMR: " << fAcmrBefore << " -> " << fAcmrAfter << std::endl;
+
+    // Build the terrain grid for collision and height queries. This needs the mesh's world space
+    // positions, so it can only be done once if the mesh is stationary.
+    bTerrainCollision = (meshDeltaTheta == 0.0f);
+    if (bTerrainCollision)
+    {
+      mat4x4 matWorld = Mat4x4_MakeTranslation(meshTranslation.x, meshTranslation.y, meshTranslation.z);
+      TerrainGrid_Build(gridTerrain, meshLocal, matWorld);
+    }
+
+    // Store the vertices quantized to 16 bits per component. This has to be done last, since it
+    // releases the float vertices the steps above work on.
+    if (bQuantizeVertices)
+    {
+      size_t nFloatBytes = meshLocal.verts.size() * sizeof(vec3d);
+      float fMaxError = Mesh_QuantizeVertices(meshLocal);
+      std::cout << "Quantized vertices: " << nFloatBytes << " -> " << meshLocal.qverts.size() * sizeof(qvec3d)
+                << " bytes, max error " << fMaxError << " (half a quantization step is " << 0.5f * std::max({ meshLocal.qScale.x, meshLocal.qScale.y, meshLocal.qScale.z }) << ")" << std::endl;
+    }
+
+    // Initial camera coordinate system. Updated with user input.
+    vec3d vCameraPosition = { 0.0f, -17.5f, -15.0f };
+    vec3d vCameraTarget = { 1.0f, -17.5f, -15.0f };
+    vec3d vCameraUp = { 0.0f, 0.0f, 1.0f };
+    csCamera = CoordSys_LookAt(vCameraPosition, vCameraTarget, vCameraUp);
+
+    // Camera settings.
+    fFovDeg = 90.0f; fNear = 0.1f; fFar = 1000.0f;
+    fAspectRatio = (float)ScreenWidth() / (float)ScreenHeight();
+
+    // Camera projection matrix. Needs to be calculated only once.
+    matCameraToProjected = Mat4x4_MakeCameraProjection(fFovDeg, fAspectRatio, fNear, fFar);
+
+    // Projection matrix from normalized projection space to screen space. Needs to be calculated only once.
+    matProjectedToScreen = Mat4x4_MakeScreenTransform((float)ScreenWidth(), (float)ScreenHeight());
+
+    // The main view, and the rear view and minimap next to each other in the top right corner.
+    viewports[0] = { 0, 0, ScreenWidth(), ScreenHeight(), matCameraToProjected, matProjectedToScreen, nullptr };
+    int nInsetWidth = ScreenWidth() / 4, nInsetHeight = ScreenHeight() / 4;
+    for (int v = 1; v < nMaxViews; v++)
+    {
+      viewport &vp = viewports[v];
+      vp.w = nInsetWidth;
+      vp.h = nInsetHeight;
+      vp.x = ScreenWidth() - (nMaxViews - v) * (nInsetWidth + 4);
+      vp.y = 4;
+      vp.matCameraToProjected = Mat4x4_MakeCameraProjection(fFovDeg, (float)vp.w / (float)vp.h, fNear, fFar);
+      vp.matProjectedToScreen = Mat4x4_MakeScreenTransform((float)vp.w, (float)vp.h);
+      sprViewTargets[v] = std::make_unique<olc::Sprite>(vp.w, vp.h);
+      vp.target = sprViewTargets[v].get();
+    }
+    for (int v = 0; v < nMaxViews; v++)
+      vecDepthBuffers[v].resize(viewports[v].w * viewports[v].h);
+
+    // The axes gizmo. Each triangle is colored by the axis it is farthest along, which makes the
+    // X axis red, Y green and Z blue, and the triangles around the origin white.
+    if (Mesh_LoadFromFile(meshGizmo, "axes.obj"))
+    {
+      int nTris = meshGizmo.indices.size() / 3;
+      vecGizmoNormals.resize(nTris);
+      vecGizmoColors.resize(nTris);
+      for (int t = 0; t < nTris; t++)
+      {
+        vec3d &v0 = meshGizmo.verts[meshGizmo.indices[t * 3]];
+        vec3d &v1 = meshGizmo.verts[meshGizmo.indices[t * 3 + 1]];
+        vec3d &v2 = meshGizmo.verts[meshGizmo.indices[t * 3 + 2]];
+        vec3d vEdge1 = Vec3d_Sub(v1, v0), vEdge2 = Vec3d_Sub(v2, v0);
+        vec3d vNormal = Vec3d_CrossProduct(vEdge1, vEdge2);
+        vecGizmoNormals[t] = Vec3d_Normalize(vNormal);
+        float x = v0.x + v1.x + v2.x, y = v0.y + v1.y + v2.y, z = v0.z + v1.z + v2.z;
+        if (std::max({ x, y, z }) < 3.0f)
+          vecGizmoColors[t] = olc::WHITE;
+        else if (x >= y && x >= z)
+          vecGizmoColors[t] = olc::RED;
+        else if (y >= z)
+          vecGizmoColors[t] = olc::GREEN;
+        else
+          vecGizmoColors[t] = olc::BLUE;
+      }
+    }
+
+    // Initial direction of the light.
+    lightDirection = { 0.0f, 0.0f, -1.0f };
+    lightDirection = Vec3d_Normalize(lightDirection);
+
+    // Set colors.
+    colorDay.r = 135; colorDay.g = 206; colorDay.b = 235;
+    colorNight.r = 0; colorNight.g = 0; colorNight.b = 49;
+    colorSky.r = 0; colorSky.g = 0; colorSky.b = 0;
+    colorGrass.r = 126; colorGrass.g = 200; colorGrass.b = 80;
+    colorMountain.r = 127; colorMountain.g = 131; colorMountain.b = 134;
+    colorSnow.r = 255; colorSnow.g = 255; colorSnow.b = 255;
+
+    // Start the worker pool, with the calling thread making up for the last core.
+    int nPoolWorkers = std::min((int)std::thread::hardware_concurrency() - 1, nMaxPoolWorkers);
+    WorkerPool_Start(poolWorkers, std::max(nPoolWorkers, 0));
+
+    // A stationary mesh needs to be positioned in the world only once.
+    if (meshDeltaTheta == 0.0f)
+    {
+      TransformMeshToWorld(meshCurrentTheta, vecStaticWorldVerts);
+      ComputeTriangleNormalsAndColors(vecStaticWorldVerts, vecStaticTriNormals, vecStaticTriBaseColors);
+      MeshChunks_Build(chunksTerrain, vecStaticWorldVerts, meshLocal.indices, nChunksPerSide);
+      vecChunkImpostorSlots.assign(chunksTerrain.radii.size(), -1);
+
+      auto tpStart = std::chrono::steady_clock::now();
+      HorizonMap_Build(horizonTerrain, gridTerrain, nHorizonAzimuths, poolWorkers);
+      float fHorizonMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpStart).count();
+      std::cout << "Horizon map: " << nHorizonAzimuths << " directions per triangle in " << fHorizonMs << " ms" << std::endl;
+    }
+
+    // Start the worker that builds frame geometry in pipelined mode. It sleeps until needed.
+    geometryWorker = std::thread(&olcEngine3D::GeometryWorkerLoop, this);
+
+    return true;
+  }
+
+  bool OnUserUpdate(float fElapsedTime) override
+  {
+    vec3d vCameraPreviousPosition = csCamera.o;
+
+    // Process user input.
+    // Translational degrees of freedom
+    if (GetKey(olc::Key::W).bHeld)  // Forward
+    {
+      CoordSys_TranslateUVW(csCamera, 8.0f * fElapsedTime, 0.0f, 0.0f);
+    }
+    if (GetKey(olc::Key::S).bHeld)  // Backward
+    {
+      CoordSys_TranslateUVW(csCamera, -8.0f * fElapsedTime, 0.0f, 0.0f);
+    }
+    if (GetKey(olc::Key::Q).bHeld)  // Left
+    {
+      CoordSys_TranslateUVW(csCamera, 0.0f, 8.0f * fElapsedTime, 0.0f);
+    }
+    if (GetKey(olc::Key::E).bHeld)  // Right
+    {
+      CoordSys_TranslateUVW(csCamera, 0.0f, -8.0f * fElapsedTime, 0.0f);
+    }
+    if (GetKey(olc::Key::SPACE).bHeld)  // Up
+    {
+      CoordSys_TranslateUVW(csCamera, 0.0f, 0.0f, 8.0f * fElapsedTime);
+    }
+    if (GetKey(olc::Key::SHIFT).bHeld)  // Down
+    {
+      CoordSys_TranslateUVW(csCamera, 0.0f, 0.0f, -8.0f * fElapsedTime);
+    }
+    // Rotational degrees of freedom
+    if (GetKey(olc::Key::RIGHT).bHeld)  // Roll right
+    {
+      CoordSys_RotateU(csCamera, 1.0f * fElapsedTime);
+    }
+    if (GetKey(olc::Key::LEFT).bHeld)  // Roll left
+    {
+      CoordSys_RotateU(csCamera, -1.0f * fElapsedTime);
+    }
+    if (GetKey(olc::Key::UP).bHeld)  // Pitch down
+    {
+      CoordSys_RotateV(csCamera, 1.0f * fElapsedTime);
+    }
+    if (GetKey(olc::Key::DOWN).bHeld)  // Pitch up
+    {
+      CoordSys_RotateV(csCamera, -1.0f * fElapsedTime);
+    }
+    if (GetKey(olc::Key::A).bHeld)  // Yaw left
+    {
+      CoordSys_RotateW(csCamera, 1.0f * fElapsedTime);
+    }
+    if (GetKey(olc::Key::D).bHeld)  // Yaw right
+    {
+      CoordSys_RotateW(csCamera, -1.0f * fElapsedTime);
+    }
+    // Some useful debugging keys.
+    if (GetKey(olc::Key::P).bPressed)  // Print camera info.
+    {
+      std::cout << "===" << '\n';
+      std::cout << "Camera position: "; Vec3d_Print(csCamera.o);
+      std::cout << "Camera forward : "; Vec3d_Print(csCamera.u);
+      std::cout << "Camera up      : "; Vec3d_Print(csCamera.w);
+      float fGround, fDistance;
+      if (bTerrainCollision && TerrainGrid_GroundHeight(gridTerrain, csCamera.o.x, csCamera.o.y, fGround))
+        std::cout << "Camera height above ground: " << csCamera.o.z - fGround << '\n';
+      if (bTerrainCollision && TerrainGrid_Raycast(gridTerrain, csCamera.o, csCamera.u, fFar, fDistance))
+        std::cout << "Terrain distance ahead    : " << fDistance << '\n';
+    }
+    if (GetKey(olc::Key::F2).bPressed)  // Toggle texturing.
+    {
+      bTextured = !bTextured;
+    }
+    if (GetKey(olc::Key::F3).bPressed)  // Toggle the rear view and minimap.
+    {
+      bExtraViews = !bExtraViews;
+    }
+    if (GetKey(olc::Key::F4).bPressed)  // Toggle lighting.
+    {
+      bLighting = !bLighting;
+    }
+    if (GetKey(olc::Key::F5).bPressed)  // Toggle wireframe outlines.
+    {
+      bWireframe = !bWireframe;
+    }
+    if (GetKey(olc::Key::F6).bPressed)  // Cycle between sorting, the depth buffer and span buffers.
+    {
+      if (bDepthBuffered)
+      {
+        bDepthBuffered = false;
+        bSpanBuffered = true;
+      }
+      else if (bSpanBuffered)
+        bSpanBuffered = false;
+      else
+        bDepthBuffered = true;
+    }
+    if (GetKey(olc::Key::F7).bPressed)  // Toggle the overdraw heatmap.
+    {
+      bOverdrawView = !bOverdrawView;
+      bDensityView = false;
+    }
+    if (GetKey(olc::Key::F8).bPressed)  // Toggle the triangle density heatmap.
+    {
+      bDensityView = !bDensityView;
+      bOverdrawView = false;
+    }
+    if (GetKey(olc::Key::F9).bPressed)  // Toggle deferred lighting.
+    {
+      bDeferredLighting = !bDeferredLighting;
+    }
+    if (GetKey(olc::Key::F10).bPressed)  // Toggle impostors for distant chunks.
+    {
+      bImpostors = !bImpostors;
+    }
+    if (GetKey(olc::Key::H).bPressed)  // Toggle the terrain's shadows.
+    {
+      bTerrainShadows = !bTerrainShadows;
+    }
+    if (GetKey(olc::Key::G).bPressed)  // Toggle the axes gizmo.
+    {
+      bGizmo = !bGizmo;
+    }
+    if (GetKey(olc::Key::F1).bPressed)  // Toggle pipelined frame execution.
+    {
+      bPipelined = !bPipelined;
+      bPipelinePrimed = false;
+      std::cout << "Pipelined frames: " << (bPipelined ? "on" : "off") << std::endl;
+    }
+
+    // Stop the camera at the terrain's surface, instead of letting it fly through the mountains.
+    // Cast a ray along this frame's movement, extended by the clearance the camera should keep.
+    if (bTerrainCollision)
+    {
+      vec3d vMove = Vec3d_Sub(csCamera.o, vCameraPreviousPosition);
+      float fMove = Vec3d_Length(vMove);
+      float fHit;
+      if (fMove > 0.0f)
+      {
+        vec3d vMoveDirection = Vec3d_Div(vMove, fMove);
+        if (TerrainGrid_Raycast(gridTerrain, vCameraPreviousPosition, vMoveDirection, fMove + fCameraClearance, fHit))
+        {
+          vec3d vAllowed = Vec3d_Mul(vMoveDirection, std::max(fHit - fCameraClearance, 0.0f));
+          csCamera.o = Vec3d_Add(vCameraPreviousPosition, vAllowed);
+        }
+      }
+    }
+
+    // Update the direction of light to make it seem as if time passes.
+    mat4x4 matLightRot = Mat4x4_MakeRotationX(0.25f * fElapsedTime);
+    lightDirection = Vec3d_ApplyTransform(lightDirection, matLightRot);
+    vec3d vMidday = { 0.0f, 0.0f, -1.0f };
+
+    // Set the color of the sky based on the light direction to simulate night/day.
+    float dp = Vec3d_DotProduct(lightDirection, vMidday);  // dp is between -1 and 1.
+    float dpNormalized = 0.5f * (dp + 1.0f);  // dpNormalized is between 0 and 1.
+    colorSky.r = colorNight.r + dpNormalized * (colorDay.r - colorNight.r);
+    colorSky.g = colorNight.g + dpNormalized * (colorDay.g - colorNight.g);
+    colorSky.b = colorNight.b + dpNormalized * (colorDay.b - colorNight.b);
+
+    // Update mesh rotation angle to have it rotate.
+    meshCurrentTheta += meshDeltaTheta * fElapsedTime;
+
+    // Everything the geometry stage needs from this frame's user input and simulation is copied
+    // into a snapshot, so the geometry stage never reads state that the next frame's input is
+    // already modifying.
+    // Deferred lighting only covers the main view, and would relight wireframe outlines and debug
+    // views along with the triangles. It isn't pipelined, since it has no geometry to build when
+    // only the light changes.
+    bool bDeferred = bDeferredLighting && bLighting && !bPipelined && !bExtraViews && !bWireframe && !bOverdrawView && !bDensityView;
+    if (bDeferred)
+      RenderDeferredFrame();
+    else if (!bPipelined)
+    {
+      TakeFrameSnapshot(frames[nFrontFrame]);
+      BuildFrameGeometry(frames[nFrontFrame]);
+    }
+    else
+    {
+      if (!bPipelinePrimed)
+      {
+        // Fill the pipeline with this frame's geometry, so there is something to rasterize.
+        TakeFrameSnapshot(frames[nFrontFrame]);
+        BuildFrameGeometry(frames[nFrontFrame]);
+        bPipelinePrimed = true;
+      }
+
+      // Start building the geometry of the next frame on the worker thread, then rasterize the
+      // frame that it built during the previous call. The two frames use separate buffers.
+      TakeFrameSnapshot(frames[1 - nFrontFrame]);
+      {
+        std::lock_guard<std::mutex> lock(muxGeometryWorker);
+        nGeometryWorkerFrame = 1 - nFrontFrame;
+        bGeometryWorkerBusy = true;
+      }
+      cvGeometryWorker.notify_all();
+    }
+
+    if (!bDeferred)
+    {
+      gbufMain.bValid = false;
+      RasterizeFrame(frames[nFrontFrame]);
+    }
+    if (bOverdrawView || bDensityView || bRenderStats)
+      AnalyzeFrame(frames[nFrontFrame]);
+    if (bOverdrawView || bDensityView)
+      DrawDebugView();
+
+    if (bPipelined)
+    {
+      // Wait for the worker to finish, after which the frame it built is rasterized next.
+      std::unique_lock<std::mutex> lock(muxGeometryWorker);
+      cvGeometryWorker.wait(lock, [&] { return !bGeometryWorkerBusy; });
+      nFrontFrame = 1 - nFrontFrame;
     }
-    if (GetKey(olc::Key::DOWN).bHeld)  // Pitch up
+
+    // The geometry timing travels with the frame, since the worker thread writes it. It's only
+    // read here, once the frame that the timing belongs to is no longer being built.
+    if (!bDeferred)
+      fGeometryMs = frames[nFrontFrame].fGeometryMs;
+
+    // Report stage timings and, when pipelined, how old the rasterized snapshot was. The engine's
+    // font only exists once Start has run, so there is no text when running headless.
+    if (!bHeadless)
     {
-      CoordSys_RotateV(csCamera, -1.0f * fElapsedTime);
+      DrawString(4, 4, "Geometry: " + std::to_string(fGeometryMs) + " ms, Raster: " + std::to_string(fRasterMs) + " ms");
+      if (bPipelined)
+        DrawString(4, 14, "Pipelined, added latency: " + std::to_string(fPipelineLatencyMs) + " ms");
+      if (bDeferred)
+        DrawString(4, 14, "Deferred lighting: " + std::to_string(fLightingMs) + " ms" + (bRelitOnly ? ", relit only" : ""));
+      if (bOverdrawView || bDensityView)
+      {
+        float fAvgOverdraw = stats.nCoveredPixels ? (float)stats.nWrites / stats.nCoveredPixels : 0.0f;
+        float fSubPixelShare = stats.nTriangles ? 100.0f * stats.nSubPixelTriangles / stats.nTriangles : 0.0f;
+        DrawString(4, ScreenHeight() - 20, "Overdraw avg " + std::to_string(fAvgOverdraw) + ", max " + std::to_string(stats.nMaxOverdraw));
+        DrawString(4, ScreenHeight() - 10, "Triangles per tile max " + std::to_string(stats.nMaxTrianglesPerTile) +
+                                           ", sub-pixel " + std::to_string(fSubPixelShare) + "%");
+      }
+      if (bImpostors)
+        DrawString(4, 34, "Impostors: " + std::to_string(nImpostorsDrawn) + " drawn, " + std::to_string(nImpostorsRendered) + " re-rendered");
+      if (bSpanBuffered)
+        DrawString(4, 24, "Overdraw eliminated: " + std::to_string(nOverdrawEliminated) + " px, " + std::to_string(nTrianglesSkipped) + " triangles skipped");
     }
-    if (GetKey(olc::Key::A).bHeld)  // Yaw left
+    return true;
+  }
+
+  bool RunBenchmark(int nFrames, bool bPipelinedFrames, bool bPrintRenderStats = false)
+  {
+    // Render a fixed number of frames into an offscreen sprite, without opening a window, and
+    // print the frame timings. The camera slowly yaws around so the visible geometry changes.
+    // Optionally also print the overdraw and triangle density statistics of the debug views.
+    bHeadless = true;
+    olc::Sprite sprTarget(ScreenWidth(), ScreenHeight());
+    SetDrawTarget(&sprTarget);
+    if (!OnUserCreate())
+      return false;
+    bPipelined = bPipelinedFrames;
+    bRenderStats = bPrintRenderStats;
+
+    const float fElapsedTime = 1.0f / 60.0f;
+    std::vector<float> vecFrameMs;
+    float fGeometryTotalMs = 0.0f, fRasterTotalMs = 0.0f;
+    renderstats statsTotal;
+    for (int i = 0; i < nFrames; i++)
     {
-      CoordSys_RotateW(csCamera, 1.0f * fElapsedTime);
+      CoordSys_RotateW(csCamera, 0.5f * fElapsedTime);
+      auto tpStart = std::chrono::steady_clock::now();
+      OnUserUpdate(fElapsedTime);
+      vecFrameMs.push_back(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpStart).count());
+      fGeometryTotalMs += fGeometryMs;
+      fRasterTotalMs += fRasterMs;
+      statsTotal.nTriangles += stats.nTriangles;
+      statsTotal.nWrites += stats.nWrites;
+      statsTotal.nCoveredPixels += stats.nCoveredPixels;
+      statsTotal.nMaxOverdraw = std::max(statsTotal.nMaxOverdraw, stats.nMaxOverdraw);
+      statsTotal.nMaxTrianglesPerTile = std::max(statsTotal.nMaxTrianglesPerTile, stats.nMaxTrianglesPerTile);
+      statsTotal.nOccupiedTiles += stats.nOccupiedTiles;
+      statsTotal.nSubPixelTriangles += stats.nSubPixelTriangles;
     }
-    if (GetKey(olc::Key::D).bHeld)  // Yaw right
+    OnUserDestroy();
+    SetDrawTarget(nullptr);
+    if (nFrames <= 0)
+      return true;
+
+    float fTotalMs = 0.0f;
+    for (float ms : vecFrameMs)
+      fTotalMs += ms;
+    std::sort(vecFrameMs.begin(), vecFrameMs.end());
+    std::cout << "Frames    : " << nFrames << (bPipelined ? " (pipelined)" : "") << '\n'
+              << "Frame avg : " << fTotalMs / nFrames << " ms" << '\n'
+              << "Frame min : " << vecFrameMs.front() << " ms" << '\n'
+              << "Frame p95 : " << vecFrameMs[(nFrames - 1) * 95 / 100] << " ms" << '\n'
+              << "Frame max : " << vecFrameMs.back() << " ms" << '\n'
+              << "Geometry  : " << fGeometryTotalMs / nFrames << " ms avg" << '\n'
+              << "Raster    : " << fRasterTotalMs / nFrames << " ms avg" << std::endl;
+    if (bRenderStats)
+      std::cout << "Overdraw  : " << (statsTotal.nCoveredPixels ? (float)statsTotal.nWrites / statsTotal.nCoveredPixels : 0.0f)
+                << " avg, " << statsTotal.nMaxOverdraw << " max" << '\n'
+                << "Tiles     : " << (statsTotal.nOccupiedTiles ? (float)statsTotal.nTriangles / statsTotal.nOccupiedTiles : 0.0f)
+                << " triangles avg, " << statsTotal.nMaxTrianglesPerTile << " max (" << nDensityTileSize << "x" << nDensityTileSize << " pixels)" << '\n'
+                << "Sub-pixel : " << (statsTotal.nTriangles ? 100.0f * statsTotal.nSubPixelTriangles / statsTotal.nTriangles : 0.0f)
+                << "% of triangles" << std::endl;
+    return true;
+  }
+
+  bool OnUserDestroy() override
+  {
+    StopGeometryWorker();
+    WorkerPool_Stop(poolWorkers);
+    return true;
+  }
+
+private:
+  void TakeFrameSnapshot(framedata &frame)
+  {
+    frame.snapshot.csCamera = csCamera;
+    frame.snapshot.lightDirection = lightDirection;
+    frame.snapshot.meshTheta = meshCurrentTheta;
+    frame.snapshot.colorSky = colorSky;
+    frame.snapshot.nViews = bExtraViews ? nMaxViews : 1;
+    frame.snapshot.bImpostors = bImpostors && meshDeltaTheta == 0.0f && !chunksTerrain.radii.empty();
+    frame.snapshot.bGizmo = bGizmo && !meshGizmo.indices.empty();
+    frame.snapshot.bTerrainShadows = bTerrainShadows && meshDeltaTheta == 0.0f && !horizonTerrain.elevations.empty();
+    bool bDrawTextured = bTextured && !meshLocal.uvIndices.empty() && !texTerrain.levels.empty();
+    frame.snapshot.nFeatures = (bLighting ? nFeatureLit : 0) | (meshDeltaTheta != 0.0f ? nFeatureAnimated : 0) |
+                               (bWireframe ? nFeatureWireframe : 0) | (bDepthBuffered ? nFeatureDepthBuffered : 0) |
+                               (bDrawTextured ? nFeatureTextured : 0) | (bSpanBuffered ? nFeatureSpanBuffered : 0);
+    frame.snapshot.tpTaken = std::chrono::steady_clock::now();
+  }
+
+  void StopGeometryWorker()
+  {
     {
-      CoordSys_RotateW(csCamera, -1.0f * fElapsedTime);
+      std::lock_guard<std::mutex> lock(muxGeometryWorker);
+      bGeometryWorkerQuit = true;
     }
-    // Some useful debugging keys.
-    if (GetKey(olc::Key::P).bPressed)  // Print camera info.
+    cvGeometryWorker.notify_all();
+    if (geometryWorker.joinable())
+      geometryWorker.join();
+  }
+
+  void GeometryWorkerLoop()
+  {
+    std::unique_lock<std::mutex> lock(muxGeometryWorker);
+    while (true)
     {
-      std::cout << "===" << '\n';
-      std::cout << "Camera position: "; Vec3d_Print(csCamera.o);
-      std::cout << "Camera forward : "; Vec3d_Print(csCamera.u);
-      std::cout << "Camera up      : "; Vec3d_Print(csCamera.w);
+      cvGeometryWorker.wait(lock, [&] { return bGeometryWorkerBusy || bGeometryWorkerQuit; });
+      if (bGeometryWorkerQuit)
+        return;
+
+      lock.unlock();
+      BuildFrameGeometry(frames[nGeometryWorkerFrame]);
+      lock.lock();
+
+      bGeometryWorkerBusy = false;
+      cvGeometryWorker.notify_all();
     }
+  }
 
-    // The world-to-camera transformation matrix is re-calculated every frame because
-    // the coordinate system from which it is derived might have changed due to user input.
-    mat4x4 matWorldToCamera = Mat4x4_MakeToCsTransform(csCamera);
+  void BuildFrameGeometry(framedata &frame)
+  {
+    // Run the instantiation of the geometry stage for the frame's features.
+    static const auto table = MakeBuildFrameGeometryTable(std::make_integer_sequence<int, nFeatureCombinations>());
+    (this->*table[frame.snapshot.nFeatures])(frame);
+  }
 
-    // Update the direction of light to make it seem as if time passes.
-    mat4x4 matLightRot = Mat4x4_MakeRotationX(0.25f * fElapsedTime);
-    lightDirection = Vec3d_ApplyTransform(lightDirection, matLightRot);
-    vec3d vMidday = { 0.0f, 0.0f, -1.0f };
+  void RasterizeFrame(framedata &frame)
+  {
+    // Run the instantiation of the raster stage for the frame's features.
+    static const auto table = MakeRasterizeFrameTable(std::make_integer_sequence<int, nFeatureCombinations>());
+    (this->*table[frame.snapshot.nFeatures])(frame);
+  }
 
-    // Set the color of the sky based on the light direction to simulate night/day.
-    float dp = Vec3d_DotProduct(lightDirection, vMidday);  // dp is between -1 and 1.
-    float dpNormalized = 0.5f * (dp + 1.0f);  // dpNormalized is between 0 and 1.
-    colorSky.r = colorNight.r + dpNormalized * (colorDay.r - colorNight.r);
-    colorSky.g = colorNight.g + dpNormalized * (colorDay.g - colorNight.g);
-    colorSky.b = colorNight.b + dpNormalized * (colorDay.b - colorNight.b);
+  // Tables of every instantiation of a frame stage, indexed by the features it was built for.
+  typedef void (olcEngine3D::*framestage)(framedata &frame);
 
-    // Update mesh rotation angle to have it rotate, and calculate its world transformation matrix.
-    meshCurrentTheta += meshDeltaTheta * fElapsedTime;
-    mat4x4 matRotX = Mat4x4_MakeRotationX(meshCurrentTheta);
-    mat4x4 matRotY = Mat4x4_MakeRotationY(3.141592f*meshCurrentTheta);
-    mat4x4 matRotZ = Mat4x4_MakeRotationZ(1.414214f*meshCurrentTheta);
+  template <int... nFeatures>
+  static std::array<framestage, sizeof...(nFeatures)> MakeBuildFrameGeometryTable(std::integer_sequence<int, nFeatures...>)
+  {
+    return { &olcEngine3D::BuildFrameGeometry<nFeatures>... };
+  }
+
+  template <int... nFeatures>
+  static std::array<framestage, sizeof...(nFeatures)> MakeRasterizeFrameTable(std::integer_sequence<int, nFeatures...>)
+  {
+    return { &olcEngine3D::RasterizeFrame<nFeatures>... };
+  }
+
+  void TransformMeshToWorld(float fTheta, std::vector<vec3d> &vecWorldVerts)
+  {
+    // Calculate the mesh's world transformation matrix.
+    mat4x4 matRotX = Mat4x4_MakeRotationX(fTheta);
+    mat4x4 matRotY = Mat4x4_MakeRotationY(3.141592f*fTheta);
+    mat4x4 matRotZ = Mat4x4_MakeRotationZ(1.414214f*fTheta);
     mat4x4 matTrl = Mat4x4_MakeTranslation(meshTranslation.x, meshTranslation.y, meshTranslation.z);
     mat4x4 matRotXY = Mat4x4_ConcatenateTransformations(matRotX, matRotY);
     mat4x4 matRotXYZ = Mat4x4_ConcatenateTransformations(matRotXY, matRotZ);
     mat4x4 matWorld = Mat4x4_ConcatenateTransformations(matRotXYZ, matTrl);
 
-    // Decide which triangles to rasterize.
-    std::vector<triangle> vecTrianglesToRasterize;
-    for (auto triLocal : meshLocal.tris)
+    // Transform the mesh's shared vertices from local space to world space. Working on the vertex buffer instead of on the triangles means every vertex
+    // is transformed only once, no matter how many triangles share it.
+    // When the vertices are quantized, the dequantization is folded into the world transform.
+    if (!meshLocal.qverts.empty())
+    {
+      int nVerts = meshLocal.qverts.size();
+      vecWorldVerts.resize(nVerts);
+      mat4x4 matDequantize = Mesh_MakeDequantizeTransform(meshLocal);
+      mat4x4 matQuantizedToWorld = Mat4x4_ConcatenateTransformations(matDequantize, matWorld);
+      Vec3d_ApplyTransformBatchQuantized(meshLocal.qverts.data(), vecWorldVerts.data(), nVerts, matQuantizedToWorld);
+    }
+    else
+    {
+      int nVerts = meshLocal.verts.size();
+      vecWorldVerts.resize(nVerts);
+      Vec3d_ApplyTransformBatch(meshLocal.verts.data(), vecWorldVerts.data(), nVerts, matWorld);
+    }
+  }
+
+  void ComputeTriangleNormalsAndColors(const std::vector<vec3d> &vecWorldVerts, std::vector<vec3d> &vecTriNormals, std::vector<olc::Pixel> &vecTriBaseColors)
+  {
+    // Calculate the normals and height colors of all triangles in world space.
+    int nTris = meshLocal.indices.size() / 3;
+    vecTriNormals.resize(nTris);
+    vecTriBaseColors.resize(nTris);
+    for (int t = 0; t < nTris; t++)
     {
-      // Transform the triangle from local space to world space.
-      // This is done here instead of in OnUserCreate because we want the mesh to move instead of
-      // the camera. Once the camera can move, the mesh can be stationary and needs to be positioned
-      // somewhere in the world only once in OnUserCreate.
       triangle triWorld;
-      triWorld.p[0] = Vec3d_ApplyTransform(triLocal.p[0], matWorld);
-      triWorld.p[1] = Vec3d_ApplyTransform(triLocal.p[1], matWorld);
-      triWorld.p[2] = Vec3d_ApplyTransform(triLocal.p[2], matWorld);
+      triWorld.p[0] = vecWorldVerts[meshLocal.indices[t * 3]];
+      triWorld.p[1] = vecWorldVerts[meshLocal.indices[t * 3 + 1]];
+      triWorld.p[2] = vecWorldVerts[meshLocal.indices[t * 3 + 2]];
 
       // Use cross product to get the triangle's normal.
       vec3d v1, v2, normal;
@@ -716,37 +3350,175 @@ public:
       v2 = Vec3d_Sub(triWorld.p[2], triWorld.p[0]);
       normal = Vec3d_CrossProduct(v1, v2);
       normal = Vec3d_Normalize(normal);
+      vecTriNormals[t] = normal;
 
-      // Ray from the triangle to the camera.
-      vec3d vCameraRay = Vec3d_Sub(csCamera.o, triWorld.p[0]);
+      // Set initial triangle color.
+      olc::Pixel color = { colorGrass.r, colorGrass.g, colorGrass.b };
+      if (Triangle_Centroid(triWorld).z > -10.0f)
+        color = { colorMountain.r, colorMountain.g, colorMountain.b };
+      if (Triangle_Centroid(triWorld).z > 5.0f)
+        color = { colorSnow.r, colorSnow.g, colorSnow.b };
+      vecTriBaseColors[t] = color;
+    }
+  }
 
-      // Only continue if the triangle is visible.
-      if (Vec3d_DotProduct(normal, vCameraRay) > 0.0f)
-      {
-        // Set initial triangle color.
-        triWorld.fillColor = { colorGrass.r, colorGrass.g, colorGrass.b };
-        if (Triangle_Centroid(triWorld).z > -10.0f)
-          triWorld.fillColor = { colorMountain.r, colorMountain.g, colorMountain.b };
-        if (Triangle_Centroid(triWorld).z > 5.0f)
-          triWorld.fillColor = { colorSnow.r, colorSnow.g, colorSnow.b };
+  template <int nFeatures>
+  void BuildFrameGeometry(framedata &frame)
+  {
+    // Transform and light the mesh in world space once, then cull, clip and sort it for every view
+    // as seen from the frame's snapshot. Only reads the snapshot and state that doesn't change
+    // after OnUserCreate, so it may run on the worker.
+    constexpr bool bLit = nFeatures & nFeatureLit;
+    constexpr bool bAnimated = nFeatures & nFeatureAnimated;
+    constexpr bool bWireframe = nFeatures & nFeatureWireframe;
+    auto tpStart = std::chrono::steady_clock::now();
+    framesnapshot &snapshot = frame.snapshot;
+
+    // An animated mesh has to be moved into world space every frame, a stationary one was
+    // positioned in the world once in OnUserCreate.
+    std::vector<olc::Pixel> *pTriBaseColors;
+    if constexpr (bAnimated)
+    {
+      TransformMeshToWorld(snapshot.meshTheta, frame.vecWorldVerts);
+      ComputeTriangleNormalsAndColors(frame.vecWorldVerts, frame.vecTriNormals, frame.vecTriBaseColors);
+      frame.pWorldVerts = &frame.vecWorldVerts;
+      frame.pTriNormals = &frame.vecTriNormals;
+      pTriBaseColors = &frame.vecTriBaseColors;
+    }
+    else
+    {
+      frame.pWorldVerts = &vecStaticWorldVerts;
+      frame.pTriNormals = &vecStaticTriNormals;
+      pTriBaseColors = &vecStaticTriBaseColors;
+    }
 
+    // Light the triangles. These colors only depend on world space, so they are shared by all
+    // views. Unlit, the height colors are used as they are.
+    if constexpr (bLit)
+    {
+      int nTris = pTriBaseColors->size();
+      frame.vecTriFillColors.resize(nTris);
+      if constexpr (bWireframe)
+        frame.vecTriWireColors.resize(nTris);
+      horizonsun sun = HorizonMap_Sun(horizonTerrain, snapshot.lightDirection);
+      for (int t = 0; t < nTris; t++)
+      {
         // Apply illumination
         // The less similarity between the triangle normal and the light direction, the more
-        // that triangle faces the light source and is illuminated.
-        float dp = Vec3d_DotProduct(lightDirection, normal);  // dp is between -1 and 1.
+        // that triangle faces the light source and is illuminated. In the terrain's shadow, a
+        // triangle facing the light is lit as if the light grazed it.
+        olc::Pixel color = (*pTriBaseColors)[t];
+        float dp = Vec3d_DotProduct(snapshot.lightDirection, (*frame.pTriNormals)[t]);  // dp is between -1 and 1.
+        if (snapshot.bTerrainShadows && dp < 0.0f)
+          dp *= HorizonMap_SunVisibility(horizonTerrain, sun, t);
         float dpNormalized = 0.5f * (1.0f - dp);  // dpNormalized is between 0 and 1.
-        triWorld.fillColor.r *= dpNormalized;
-        triWorld.fillColor.g *= dpNormalized;
-        triWorld.fillColor.b *= dpNormalized;
-        triWorld.wireColor = (dpNormalized >= 0.5f) ? olc::BLACK : olc::WHITE;
+        color.r *= dpNormalized;
+        color.g *= dpNormalized;
+        color.b *= dpNormalized;
+        frame.vecTriFillColors[t] = color;
+        if constexpr (bWireframe)
+          frame.vecTriWireColors[t] = (dpNormalized >= 0.5f) ? olc::BLACK : olc::WHITE;
+      }
+      frame.pTriFillColors = &frame.vecTriFillColors;
+    }
+    else
+      frame.pTriFillColors = pTriBaseColors;
+
+    // Derive the cameras of the extra views from the main camera. The rear view looks backwards,
+    // the minimap looks straight down from above the camera, with the camera's heading up.
+    frame.views[0].csCamera = snapshot.csCamera;
+    if (snapshot.nViews > 1)
+    {
+      coordsys &csRear = frame.views[1].csCamera;
+      csRear = snapshot.csCamera;
+      csRear.u = Vec3d_Mul(snapshot.csCamera.u, -1.0f);
+      csRear.v = Vec3d_Mul(snapshot.csCamera.v, -1.0f);
+      csRear.u.w = csRear.v.w = 0.0f;
+
+      coordsys &csMap = frame.views[2].csCamera;
+      vec3d vHeading = { snapshot.csCamera.u.x, snapshot.csCamera.u.y, 0.0f, 0.0f };
+      if (Vec3d_Length(vHeading) < 1e-3f)
+        vHeading = { snapshot.csCamera.w.x, snapshot.csCamera.w.y, 0.0f, 0.0f };
+      if (Vec3d_Length(vHeading) < 1e-3f)
+        vHeading = { 1.0f, 0.0f, 0.0f, 0.0f };
+      csMap.o = { snapshot.csCamera.o.x, snapshot.csCamera.o.y, snapshot.csCamera.o.z + fMinimapHeight };
+      csMap.u = { 0.0f, 0.0f, -1.0f, 0.0f };
+      csMap.w = Vec3d_Normalize(vHeading);
+      csMap.v = Vec3d_CrossProduct(csMap.w, csMap.u);
+      csMap.w.w = csMap.v.w = 0.0f;
+    }
+
+    SelectImpostors(frame);
+
+    // Build each view's geometry. The extra views are built in parallel with the main view.
+    workerjob jobViews;
+    jobViews.fnTask = [this, &frame](int i) { BuildViewGeometry<nFeatures>(frame, i + 1); };
+    jobViews.nTasks = snapshot.nViews - 1;
+    WorkerPool_Begin(poolWorkers, jobViews);
+    BuildViewGeometry<nFeatures>(frame, 0);
+    WorkerPool_Finish(poolWorkers, jobViews);
+
+    frame.fGeometryMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpStart).count();
+  }
 
-        // Transform the triangle from world space to camera space.
+  template <int nFeatures>
+  void BuildViewGeometry(framedata &frame, int nView)
+  {
+    // Cull, clip, project and sort the triangles for one view, using the world space pass's
+    // results. Only writes to the view's own buffers, so views can be built in parallel.
+    constexpr bool bLit = nFeatures & nFeatureLit;
+    constexpr bool bWireframe = nFeatures & nFeatureWireframe;
+    constexpr bool bSpanBuffered = nFeatures & nFeatureSpanBuffered;
+    constexpr bool bDepthBuffered = (nFeatures & nFeatureDepthBuffered) && !bSpanBuffered;
+    constexpr bool bTextured = nFeatures & nFeatureTextured;
+    std::vector<vec3d> &vecWorldVerts = *frame.pWorldVerts;
+    std::vector<vec3d> &vecTriNormals = *frame.pTriNormals;
+    std::vector<olc::Pixel> &vecTriFillColors = *frame.pTriFillColors;
+    viewgeometry &view = frame.views[nView];
+    viewport &vp = viewports[nView];
+    mat4x4 &matCameraToProjected = vp.matCameraToProjected;
+    mat4x4 &matProjectedToScreen = vp.matProjectedToScreen;
+
+    // The world-to-camera transformation matrix is re-calculated every frame because
+    // the coordinate system from which it is derived might have changed due to user input.
+    mat4x4 matWorldToCamera = Mat4x4_MakeToCsTransform(view.csCamera);
+
+    int nVerts = vecWorldVerts.size();
+    view.vecCameraVerts.resize(nVerts);
+    Vec3d_ApplyTransformBatch(vecWorldVerts.data(), view.vecCameraVerts.data(), nVerts, matWorldToCamera);
+
+    // Decide which triangles to rasterize.
+    std::vector<triangle> &vecTrianglesToRasterize = view.vecProjected;
+    vecTrianglesToRasterize.clear();
+    for (size_t i = 0; i + 2 < meshLocal.indices.size(); i += 3)
+    {
+      // Chunks drawn as impostors are left out of the main view.
+      if (nView == 0 && !frame.vecImpostorChunks.empty() && frame.vecChunkIsImpostor[chunksTerrain.triChunks[i / 3]])
+        continue;
+
+      int i0 = meshLocal.indices[i], i1 = meshLocal.indices[i + 1], i2 = meshLocal.indices[i + 2];
+
+      // Ray from the triangle to the camera.
+      vec3d vCameraRay = Vec3d_Sub(view.csCamera.o, vecWorldVerts[i0]);
+
+      // Only continue if the triangle is visible.
+      if (Vec3d_DotProduct(vecTriNormals[i / 3], vCameraRay) > 0.0f)
+      {
+        // Fetch the triangle in camera space.
         triangle triCamera;
-        triCamera.p[0] = Vec3d_ApplyTransform(triWorld.p[0], matWorldToCamera);
-        triCamera.p[1] = Vec3d_ApplyTransform(triWorld.p[1], matWorldToCamera);
-        triCamera.p[2] = Vec3d_ApplyTransform(triWorld.p[2], matWorldToCamera);
-        triCamera.fillColor = triWorld.fillColor;
-        triCamera.wireColor = triWorld.wireColor;
+        triCamera.p[0] = view.vecCameraVerts[i0];
+        triCamera.p[1] = view.vecCameraVerts[i1];
+        triCamera.p[2] = view.vecCameraVerts[i2];
+        triCamera.fillColor = vecTriFillColors[i / 3];
+        triCamera.nMeshTriangle = i / 3;
+        if constexpr (bWireframe)
+          triCamera.wireColor = bLit ? frame.vecTriWireColors[i / 3] : olc::BLACK;
+        if constexpr (bTextured)
+        {
+          triCamera.t[0] = meshLocal.uvs[meshLocal.uvIndices[i]];
+          triCamera.t[1] = meshLocal.uvs[meshLocal.uvIndices[i + 1]];
+          triCamera.t[2] = meshLocal.uvs[meshLocal.uvIndices[i + 2]];
+        }
 
         // Only continue if at least one of the triangle's points is ahead, but not too far ahead.
         if ((triCamera.p[0].x < fFar || triCamera.p[1].x < fFar || triCamera.p[2].x < fFar) &&
@@ -774,15 +3546,34 @@ public:
             triProjected.p[1] = Vec3d_Div(triProjectedTimesX.p[1], triProjectedTimesX.p[1].w);
             triProjected.p[2] = Vec3d_Div(triProjectedTimesX.p[2], triProjectedTimesX.p[2].w);
             triProjected.fillColor = clipped[n].fillColor;
+            triProjected.nMeshTriangle = clipped[n].nMeshTriangle;
             triProjected.wireColor = clipped[n].wireColor;
 
+            // Divide the texture coordinates by the depth as well, which is what makes them
+            // linear in screen space. The reciprocal depth is kept to undo this per pixel, and
+            // is what the depth buffer compares.
+            for (int k = 0; k < 3; k++)
+            {
+              if constexpr (bTextured)
+              {
+                triProjected.t[k].u = clipped[n].t[k].u / triProjectedTimesX.p[k].w;
+                triProjected.t[k].v = clipped[n].t[k].v / triProjectedTimesX.p[k].w;
+              }
+              if constexpr (bTextured || bDepthBuffered)
+                triProjected.t[k].w = 1.0f / triProjectedTimesX.p[k].w;
+            }
+
             // Transform the clipped triangle from normalized projection space to screen space.
             triangle triScreen;
             triScreen.p[0] = Vec3d_ApplyTransform(triProjected.p[0], matProjectedToScreen);
             triScreen.p[1] = Vec3d_ApplyTransform(triProjected.p[1], matProjectedToScreen);
             triScreen.p[2] = Vec3d_ApplyTransform(triProjected.p[2], matProjectedToScreen);
             triScreen.fillColor = triProjected.fillColor;
+            triScreen.nMeshTriangle = triProjected.nMeshTriangle;
             triScreen.wireColor = triProjected.wireColor;
+            triScreen.t[0] = triProjected.t[0];
+            triScreen.t[1] = triProjected.t[1];
+            triScreen.t[2] = triProjected.t[2];
 
             // Store triangle for sorting.
             vecTrianglesToRasterize.push_back(triScreen);
@@ -792,9 +3583,19 @@ public:
     }
 
     // Perform further clipping of triangles that need to be rasterized.
-    std::vector<triangle> vecClippedTrianglesToRasterize;
+    std::vector<triangle> &vecClippedTrianglesToRasterize = view.vecToRasterize;
+    vecClippedTrianglesToRasterize.clear();
+    vec3d vScreenMin = { 0.0f, 0.0f, -INFINITY, -INFINITY };
+    vec3d vScreenMax = { (float)vp.w, (float)vp.h, 1.0f, INFINITY };
     for (auto &triToClip : vecTrianglesToRasterize)
     {
+      // Most triangles lie entirely on screen, those can skip the clipping below.
+      if (Triangle_IsInsideBox(triToClip, vScreenMin, vScreenMax))
+      {
+        vecClippedTrianglesToRasterize.push_back(triToClip);
+        continue;
+      }
+
       // Clip triangles against the remaining planes.
       // Currently these are only the screen edges, but in the future we may wany to also
       // clip against the far plane to improve performance. Probably not though, it wouldn't
@@ -803,7 +3604,7 @@ public:
       vec3d plane_ps[5];
       vec3d plane_ns[5];
       plane_ps[0] = { 0.0f, 0.0f, 0.0f }; plane_ns[0] = { 1.0f, 0.0f, 0.0f };  // Left
-      plane_ps[1] = { (float)ScreenWidth(), (float)ScreenHeight(), 1.0f }; plane_ns[1] = { -1.0f, 0.0f, 0.0f };  // Right
+      plane_ps[1] = { (float)vp.w, (float)vp.h, 1.0f }; plane_ns[1] = { -1.0f, 0.0f, 0.0f };  // Right
       plane_ps[2] = plane_ps[0]; plane_ns[2] = { 0.0f, 1.0f, 0.0f };  // Top
       plane_ps[3] = plane_ps[1]; plane_ns[3] = { 0.0f, -1.0f, 0.0f };  // Bottom
       plane_ps[4] = plane_ps[1]; plane_ns[4] = { 0.0f, 0.0f, -1.0f };  // Back
@@ -834,32 +3635,588 @@ public:
 
     }
 
+    // The overlays are added last. They lie within the screen, so they need no clipping.
+    int nWorldTriangles = vecClippedTrianglesToRasterize.size();
+    if (nView == 0 && frame.snapshot.bGizmo)
+      AppendGizmoTriangles(frame.snapshot, vecClippedTrianglesToRasterize);
+
     // Sort the triangles from back to front.
     // We compare the z-value of the triangle's centroid.
     // The z-value here is the normalized projected depth.
-    sort(vecClippedTrianglesToRasterize.begin(), vecClippedTrianglesToRasterize.end(), [](triangle &t1, triangle &t2)
+    // With span buffers the world is sorted from front to back instead, with a depth buffer its
+    // order doesn't matter. Overlays are always drawn last, from back to front.
+    std::vector<drawitem> &vecQueue = view.vecQueue;
+    vecQueue.resize(vecClippedTrianglesToRasterize.size());
+    for (size_t i = 0; i < vecClippedTrianglesToRasterize.size(); i++)
+    {
+      triangle &tri = vecClippedTrianglesToRasterize[i];
+      float z = tri.p[0].z + tri.p[1].z + tri.p[2].z;
+      if ((int)i < nWorldTriangles)
+        vecQueue[i] = { DrawItem_MakeKey(nLayerWorld, bDepthBuffered ? 0.0f : z, !bSpanBuffered, bTextured ? nMaterialTerrainTexture : nMaterialFlat), (int)i };
+      else
+        vecQueue[i] = { DrawItem_MakeKey(nLayerOverlay, z, true, nMaterialFlat), (int)i };
+    }
+    RenderQueue_Sort(vecQueue, view.vecQueueScratch);
+  }
+
+  void AppendGizmoTriangles(framesnapshot &snapshot, std::vector<triangle> &vecTriangles)
+  {
+    // The gizmo shows the world axes as the camera sees them. It is placed in front of a camera
+    // of its own, with the camera's orientation but not its position, so it turns but never
+    // moves. Scaled to fit in a sphere of radius 1 at distance 2.8, which appears 42 degrees
+    // wide, it stays within the 45 degree field of view.
+    coordsys &cs = snapshot.csCamera;
+    float fScale = 1.0f / 12.0f, fDistance = 2.8f;
+    mat4x4 matGizmoToProjected = Mat4x4_MakeCameraProjection(45.0f, 1.0f, fNear, fFar);
+    mat4x4 matProjectedToGizmo = Mat4x4_MakeScreenTransform((float)nGizmoSize, (float)nGizmoSize);
+    float xOffset = 8.0f, yOffset = viewports[0].h - 8.0f - nGizmoSize;
+    int nTris = meshGizmo.indices.size() / 3;
+    for (int t = 0; t < nTris; t++)
+    {
+      triangle tri;
+      for (int k = 0; k < 3; k++)
+      {
+        vec3d &v = meshGizmo.verts[meshGizmo.indices[t * 3 + k]];
+        vec3d vCamera = { fDistance + fScale * Vec3d_DotProduct(v, cs.u), fScale * Vec3d_DotProduct(v, cs.v), fScale * Vec3d_DotProduct(v, cs.w) };
+        vec3d vProjected = Vec3d_ApplyTransform(vCamera, matGizmoToProjected);
+        vProjected = Vec3d_Div(vProjected, vProjected.w);
+        tri.p[k] = Vec3d_ApplyTransform(vProjected, matProjectedToGizmo);
+        tri.p[k].x += xOffset;
+        tri.p[k].y += yOffset;
+      }
+
+      // The gizmo isn't lit, it is only shaded by how much its triangles face the camera. Its
+      // winding isn't reliable, so both sides are drawn.
+      float f = 0.4f + 0.6f * fabsf(Vec3d_DotProduct(vecGizmoNormals[t], cs.u));
+      olc::Pixel &color = vecGizmoColors[t];
+      tri.fillColor = olc::Pixel((uint8_t)(color.r * f), (uint8_t)(color.g * f), (uint8_t)(color.b * f));
+      tri.wireColor = olc::BLACK;
+      tri.nMeshTriangle = -1;
+      vecTriangles.push_back(tri);
+    }
+  }
+
+  template <int nFeatures>
+  void RasterizeFrame(framedata &frame)
+  {
+    constexpr bool bWireframe = nFeatures & nFeatureWireframe;
+    constexpr bool bSpanBuffered = nFeatures & nFeatureSpanBuffered;
+    constexpr bool bDepthBuffered = (nFeatures & nFeatureDepthBuffered) && !bSpanBuffered;
+    constexpr bool bTextured = nFeatures & nFeatureTextured;
+    auto tpStart = std::chrono::steady_clock::now();
+
+    // How much older the rasterized snapshot is than the latest user input. This is zero when not
+    // pipelined, and roughly one frame time when pipelined.
+    fPipelineLatencyMs = std::chrono::duration<float, std::milli>(tpStart - frame.snapshot.tpTaken).count();
+
+    // Draws one view's triangles into its target. Without the depth buffer, span buffer and
+    // texturing, the main view uses the engine's own FillTriangle, unless it has to write the
+    // triangle ids along with the colors.
+    auto rasterizeView = [this, &frame](int v, olc::Sprite *pTarget, auto bMainView)
+    {
+      int *pIds = decltype(bMainView)::value ? frame.pTriIds : nullptr;
+      float *pDepth = nullptr;
+      spanbuffer *pCoverage = nullptr;
+      if constexpr (bDepthBuffered)
+      {
+        std::fill(vecDepthBuffers[v].begin(), vecDepthBuffers[v].end(), 0.0f);
+        pDepth = vecDepthBuffers[v].data();
+      }
+      if constexpr (bSpanBuffered)
+      {
+        SpanBuffer_Clear(spanBuffers[v], pTarget->width, pTarget->height);
+        pCoverage = &spanBuffers[v];
+      }
+      std::vector<triangle> &vecTriangles = frame.views[v].vecToRasterize;
+      std::vector<drawitem> &vecQueue = frame.views[v].vecQueue;
+      for (size_t i = 0; i < vecQueue.size(); i++)
+      {
+        triangle &tri = vecTriangles[vecQueue[i].nTriangle];
+        bool bOverlay = DrawItem_Layer(vecQueue[i]) != nLayerWorld;
+
+        // Once every pixel is covered, the rest of the world is hidden. The overlays come after it.
+        if constexpr (bSpanBuffered)
+          if (!bOverlay && SpanBuffer_IsFull(*pCoverage))
+          {
+            size_t nWorldEnd = i;
+            while (nWorldEnd < vecQueue.size() && DrawItem_Layer(vecQueue[nWorldEnd]) == nLayerWorld)
+              nWorldEnd++;
+            pCoverage->nTrianglesSkipped = nWorldEnd - i;
+            i = nWorldEnd - 1;
+            continue;
+          }
+
+        // Overlays are drawn over whatever is there, the depth and span buffers only apply to
+        // the world.
+        // Overlays get the id -2, which keeps their pixels as they are when relighting.
+        if (bOverlay)
+        {
+          if constexpr (!(bDepthBuffered || bSpanBuffered) && decltype(bMainView)::value)
+          {
+            if (pIds)
+              Triangle_RasterizeFlat<false>(tri, pTarget, nullptr, nullptr, pIds, -2);
+            else
+              FillTriangle(tri.p[0].x, tri.p[0].y,
+                           tri.p[1].x, tri.p[1].y,
+                           tri.p[2].x, tri.p[2].y,
+                           tri.fillColor);
+          }
+          else
+            Triangle_RasterizeFlat<false>(tri, pTarget, nullptr, nullptr, pIds, -2);
+        }
+        else if constexpr (bTextured)
+          Triangle_RasterizeTextured<bDepthBuffered, bSpanBuffered>(tri, texTerrain, pTarget, pDepth, pCoverage, pIds, tri.nMeshTriangle);
+        else if constexpr (bDepthBuffered || bSpanBuffered)
+          Triangle_RasterizeFlat<bDepthBuffered, bSpanBuffered>(tri, pTarget, pDepth, pCoverage, pIds, tri.nMeshTriangle);
+        else if constexpr (!decltype(bMainView)::value)
+          Triangle_RasterizeFlat<false>(tri, pTarget);
+        else if (pIds)
+          Triangle_RasterizeFlat<false>(tri, pTarget, nullptr, nullptr, pIds, tri.nMeshTriangle);
+        else
+          FillTriangle(tri.p[0].x, tri.p[0].y,
+                       tri.p[1].x, tri.p[1].y,
+                       tri.p[2].x, tri.p[2].y,
+                       tri.fillColor);
+
+        // With the depth or span buffers, outlines of hidden triangles drawn after the triangles
+        // in front of them stay visible, which is the usual look of a wireframe anyway.
+        if constexpr (bWireframe)
+          Triangle_RasterizeOutline(tri, tri.wireColor, pTarget);
+      }
+    };
+
+    // The extra views are rasterized into their own render targets in parallel with the main
+    // view, with the engine-independent rasterizers since the engine draws to one target at a time.
+    workerjob jobViews;
+    jobViews.fnTask = [this, &frame, &rasterizeView](int i)
+    {
+      olc::Sprite *pTarget = viewports[i + 1].target;
+      std::fill(pTarget->pColData.begin(), pTarget->pColData.end(), frame.snapshot.colorSky);
+      rasterizeView(i + 1, pTarget, std::false_type());
+    };
+    jobViews.nTasks = frame.snapshot.nViews - 1;
+    WorkerPool_Begin(poolWorkers, jobViews);
+
+    // Clear the screen and rasterize the main view. Impostors are the farthest, so they go first.
+    Clear(frame.snapshot.colorSky);
+    if (!frame.vecImpostorChunks.empty())
+      DrawImpostors(frame);
+    rasterizeView(0, GetDrawTarget(), std::true_type());
+
+    // Draw the extra views on top of the main view.
+    WorkerPool_Finish(poolWorkers, jobViews);
+    for (int v = 1; v < frame.snapshot.nViews; v++)
+    {
+      DrawSprite(viewports[v].x, viewports[v].y, viewports[v].target);
+      DrawRect(viewports[v].x - 1, viewports[v].y - 1, viewports[v].w + 1, viewports[v].h + 1, olc::BLACK);
+    }
+
+    if constexpr (bSpanBuffered)
+    {
+      nOverdrawEliminated = 0;
+      nTrianglesSkipped = 0;
+      for (int v = 0; v < frame.snapshot.nViews; v++)
+      {
+        nOverdrawEliminated += spanBuffers[v].nPixelsSkipped;
+        nTrianglesSkipped += spanBuffers[v].nTrianglesSkipped;
+      }
+    }
+
+    fRasterMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpStart).count();
+  }
+
+  float ImpostorFocalLength()
+  {
+    // The main view's focal length in pixels, which the projection shares between both axes.
+    return 0.5f * viewports[0].w / tanf(0.5f * fFovDeg * 3.141592f / 180.0f);
+  }
+
+  void SelectImpostors(framedata &frame)
+  {
+    // A chunk can be drawn as an impostor once it appears no larger than an impostor sprite, so
+    // the sprite is never magnified. The farthest of those get one, as many as the budget allows.
+    frame.vecImpostorChunks.clear();
+    if (!frame.snapshot.bImpostors)
+      return;
+
+    int nChunks = chunksTerrain.radii.size();
+    size_t nMaxImpostors = nImpostorBudgetBytes / (nImpostorSize * nImpostorSize * sizeof(olc::Pixel));
+    float fFocal = ImpostorFocalLength();
+    std::vector<std::pair<float, int>> vecCandidates;
+    for (int c = 0; c < nChunks; c++)
+    {
+      float r = chunksTerrain.radii[c];
+      vec3d vOffset = Vec3d_Sub(chunksTerrain.centers[c], frame.snapshot.csCamera.o);
+      float d = Vec3d_Length(vOffset);
+      if (r <= 0.0f || d <= 2.0f * r || Vec3d_DotProduct(vOffset, frame.snapshot.csCamera.u) - r <= fNear)
+        continue;  // Chunks behind the camera are culled anyway, and don't take up the budget.
+      float fDiameter = 2.0f * fFocal * r / sqrtf(d * d - r * r);  // Of the sphere's silhouette.
+      if (fDiameter <= nImpostorSize)
+        vecCandidates.push_back({ d, c });
+    }
+    std::sort(vecCandidates.begin(), vecCandidates.end(), [](auto &a, auto &b) { return a.first > b.first; });
+    if (vecCandidates.size() > nMaxImpostors)
+      vecCandidates.resize(nMaxImpostors);
+
+    frame.vecChunkIsImpostor.assign(nChunks, 0);
+    for (auto &candidate : vecCandidates)
+    {
+      frame.vecImpostorChunks.push_back(candidate.second);
+      frame.vecChunkIsImpostor[candidate.second] = 1;
+    }
+  }
+
+  void DrawImpostors(framedata &frame)
+  {
+    // Draw the frame's impostors in the main view, from far to near. Each one is looked up in the
+    // cache, and re-rendered first if it is missing or stale.
+    framesnapshot &snapshot = frame.snapshot;
+    viewport &vp = viewports[0];
+    mat4x4 matWorldToCamera = Mat4x4_MakeToCsTransform(snapshot.csCamera);
+    float fCosMaxAngle = cosf(fImpostorMaxAngle), fCosMaxLightAngle = cosf(fImpostorMaxLightAngle);
+    size_t nMaxImpostors = nImpostorBudgetBytes / (nImpostorSize * nImpostorSize * sizeof(olc::Pixel));
+    olc::Sprite *pTarget = GetDrawTarget();
+    olc::Pixel *pData = pTarget->GetData();
+    nImpostorFrame++;
+    nImpostorsDrawn = nImpostorsRendered = 0;
+
+    // The world direction of the ray through the center of screen pixel (x, y) is
+    // vRay00 + x * vRayDx + y * vRayDy, where the camera space x component is 1.
+    coordsys &cs = snapshot.csCamera;
+    float fDy = 2.0f / (vp.w * vp.matCameraToProjected.m[0][1]);
+    float fDz = 2.0f / (vp.h * vp.matCameraToProjected.m[1][2]);
+    vec3d vRayDx = Vec3d_Mul(cs.v, fDy);
+    vec3d vRayDy = Vec3d_Mul(cs.w, fDz);
+    vec3d vRay00V = Vec3d_Mul(cs.v, 0.5f * fDy - 1.0f / vp.matCameraToProjected.m[0][1]);
+    vec3d vRay00W = Vec3d_Mul(cs.w, 0.5f * fDz - 1.0f / vp.matCameraToProjected.m[1][2]);
+    vec3d vRay00 = Vec3d_Add(vRay00V, vRay00W);
+    vRay00 = Vec3d_Add(vRay00, cs.u);
+
+    for (int c : frame.vecImpostorChunks)
+    {
+      vec3d &vCenter = chunksTerrain.centers[c];
+      float r = chunksTerrain.radii[c];
+      vec3d vCenterCamera = Vec3d_ApplyTransform(vCenter, matWorldToCamera);
+      if (vCenterCamera.x - r <= fNear)
+        continue;
+
+      // Find the chunk's impostor, or take the least recently used cache slot for it.
+      int &nSlot = vecChunkImpostorSlots[c];
+      if (nSlot < 0)
+      {
+        if (vecImpostorCache.size() < nMaxImpostors)
+        {
+          vecImpostorCache.push_back(std::make_unique<impostor>());
+          vecImpostorCache.back()->sprite = std::make_unique<olc::Sprite>(nImpostorSize, nImpostorSize);
+          nSlot = vecImpostorCache.size() - 1;
+        }
+        else
+        {
+          nSlot = 0;
+          for (size_t s = 1; s < vecImpostorCache.size(); s++)
+            if (vecImpostorCache[s]->nLastUsedFrame < vecImpostorCache[nSlot]->nLastUsedFrame)
+              nSlot = s;
+          if (vecImpostorCache[nSlot]->nChunk >= 0)
+            vecChunkImpostorSlots[vecImpostorCache[nSlot]->nChunk] = -1;
+          vecImpostorCache[nSlot]->nChunk = -1;
+        }
+      }
+      impostor &imp = *vecImpostorCache[nSlot];
+      imp.nLastUsedFrame = nImpostorFrame;
+
+      // Turning the camera is exactly undone by the reprojection below. Moving it shows as
+      // parallax within the chunk and as texture detail drifting away from the screen's.
+      vec3d vOffset = Vec3d_Sub(vCenter, cs.o);
+      float d = Vec3d_Length(vOffset);
+      vec3d vDirection = Vec3d_Div(vOffset, d);
+      bool bStale = imp.nChunk != c || imp.nFeatures != (snapshot.nFeatures & (nFeatureLit | nFeatureTextured)) ||
+                    Vec3d_DotProduct(imp.csCamera.u, vDirection) < fCosMaxAngle ||
+                    ((snapshot.nFeatures & nFeatureLit) && Vec3d_DotProduct(imp.vLight, snapshot.lightDirection) < fCosMaxLightAngle) ||
+                    d > imp.fDistance * fImpostorMaxZoom || d * fImpostorMaxZoom < imp.fDistance;
+      if (bStale)
+      {
+        RenderImpostor(imp, c, frame);
+        nImpostorsRendered++;
+      }
+
+      // The screen area to cover is bounded by where the corner rays of the impostor's view
+      // frustum land. Both cameras are at the same position, so each screen pixel samples the
+      // impostor along its own ray, which needs one division per pixel.
+      coordsys &csImp = imp.csCamera;
+      float xMin = 1e30f, xMax = -1e30f, yMin = 1e30f, yMax = -1e30f;
+      bool bBehind = false;
+      for (int k = 0; k < 4; k++)
+      {
+        vec3d vCornerV = Vec3d_Mul(csImp.v, (k & 1 ? 1.0f : -1.0f) * imp.fTanHalfFov);
+        vec3d vCornerW = Vec3d_Mul(csImp.w, (k & 2 ? 1.0f : -1.0f) * imp.fTanHalfFov);
+        vec3d vCorner = Vec3d_Add(vCornerV, vCornerW);
+        vCorner = Vec3d_Add(vCorner, csImp.u);
+        vec3d vCornerCamera = { Vec3d_DotProduct(vCorner, cs.u), Vec3d_DotProduct(vCorner, cs.v), Vec3d_DotProduct(vCorner, cs.w) };
+        if (vCornerCamera.x <= 0.0f)
+        {
+          bBehind = true;
+          break;
+        }
+        vec3d vProjected = Vec3d_ApplyTransform(vCornerCamera, vp.matCameraToProjected);
+        vProjected = Vec3d_Div(vProjected, vProjected.w);
+        vec3d vScreen = Vec3d_ApplyTransform(vProjected, vp.matProjectedToScreen);
+        xMin = std::min(xMin, vScreen.x); xMax = std::max(xMax, vScreen.x);
+        yMin = std::min(yMin, vScreen.y); yMax = std::max(yMax, vScreen.y);
+      }
+      if (bBehind)
+        continue;
+      int xStart = std::max((int)floorf(xMin), 0), xEnd = std::min((int)ceilf(xMax), vp.w);
+      int yStart = std::max((int)floorf(yMin), 0), yEnd = std::min((int)ceilf(yMax), vp.h);
+      if (xStart >= xEnd || yStart >= yEnd)
+        continue;
+
+      // The ray in the impostor's camera space, and its texel (0.5 * size) * (1 - y / (x * tan), 1 - z / (x * tan)).
+      float fHalfSize = 0.5f * nImpostorSize;
+      float fScale = -fHalfSize / imp.fTanHalfFov;
+      vec3d vA = { Vec3d_DotProduct(vRay00, csImp.u), Vec3d_DotProduct(vRay00, csImp.v) * fScale, Vec3d_DotProduct(vRay00, csImp.w) * fScale };
+      vec3d vAx = { Vec3d_DotProduct(vRayDx, csImp.u), Vec3d_DotProduct(vRayDx, csImp.v) * fScale, Vec3d_DotProduct(vRayDx, csImp.w) * fScale };
+      vec3d vAy = { Vec3d_DotProduct(vRayDy, csImp.u), Vec3d_DotProduct(vRayDy, csImp.v) * fScale, Vec3d_DotProduct(vRayDy, csImp.w) * fScale };
+      olc::Pixel *pSprite = imp.sprite->GetData();
+      for (int y = yStart; y < yEnd; y++)
+      {
+        olc::Pixel *pRow = pData + y * pTarget->width;
+        for (int x = xStart; x < xEnd; x++)
+        {
+          float rx = vA.x + x * vAx.x + y * vAy.x;
+          float ry = vA.y + x * vAx.y + y * vAy.y;
+          float rz = vA.z + x * vAx.z + y * vAy.z;
+          float fInvX = 1.0f / rx;
+          int tx = (int)(fHalfSize + ry * fInvX), ty = (int)(fHalfSize + rz * fInvX);
+          if (tx < 0 || ty < 0 || tx >= nImpostorSize || ty >= nImpostorSize)
+            continue;
+          olc::Pixel texel = pSprite[ty * nImpostorSize + tx];
+          if (texel.a != 0)
+            pRow[x] = texel;
+        }
+      }
+      nImpostorsDrawn++;
+    }
+  }
+
+  void RenderImpostor(impostor &imp, int nChunk, framedata &frame)
+  {
+    // Render a chunk into its impostor's sprite with a camera at the main camera's position,
+    // looking at the chunk and with the main camera's up vector, and a field of view that just
+    // fits the chunk's bounding sphere. The sphere lies in front of the near plane and inside
+    // the field of view, so no clipping is needed.
+    framesnapshot &snapshot = frame.snapshot;
+    vec3d &vCenter = chunksTerrain.centers[nChunk];
+    float r = chunksTerrain.radii[nChunk];
+    vec3d vOffset = Vec3d_Sub(vCenter, snapshot.csCamera.o);
+    float d = Vec3d_Length(vOffset);
+    coordsys csImpostor = CoordSys_LookAt(snapshot.csCamera.o, vCenter, snapshot.csCamera.w);
+    float fImpostorFovDeg = 2.0f * asinf(r / d) * 180.0f / 3.141592f;
+    mat4x4 matWorldToCamera = Mat4x4_MakeToCsTransform(csImpostor);
+    mat4x4 matCameraToProjected = Mat4x4_MakeCameraProjection(fImpostorFovDeg, 1.0f, fNear, fFar);
+    mat4x4 matProjectedToScreen = Mat4x4_MakeScreenTransform((float)nImpostorSize, (float)nImpostorSize);
+    bool bTextured = snapshot.nFeatures & nFeatureTextured;
+
+    std::vector<vec3d> &vecWorldVerts = *frame.pWorldVerts;
+    std::vector<triangle> &vecTriangles = vecImpostorTriangles;
+    vecTriangles.clear();
+    for (int i = chunksTerrain.chunkOffsets[nChunk]; i < chunksTerrain.chunkOffsets[nChunk + 1]; i++)
+    {
+      int t = chunksTerrain.chunkTris[i];
+      vec3d vCameraRay = Vec3d_Sub(snapshot.csCamera.o, vecWorldVerts[meshLocal.indices[t * 3]]);
+      if (Vec3d_DotProduct((*frame.pTriNormals)[t], vCameraRay) <= 0.0f)
+        continue;
+
+      triangle triScreen;
+      triScreen.fillColor = (*frame.pTriFillColors)[t];
+      for (int k = 0; k < 3; k++)
+      {
+        vec3d vCamera = Vec3d_ApplyTransform(vecWorldVerts[meshLocal.indices[t * 3 + k]], matWorldToCamera);
+        vec3d vProjected = Vec3d_ApplyTransform(vCamera, matCameraToProjected);
+        float w = vProjected.w;
+        vProjected = Vec3d_Div(vProjected, w);
+        triScreen.p[k] = Vec3d_ApplyTransform(vProjected, matProjectedToScreen);
+        if (bTextured)
+        {
+          vec2d &uv = meshLocal.uvs[meshLocal.uvIndices[t * 3 + k]];
+          triScreen.t[k] = { uv.u / w, uv.v / w, 1.0f / w };
+        }
+      }
+      vecTriangles.push_back(triScreen);
+    }
+    std::sort(vecTriangles.begin(), vecTriangles.end(), [](triangle &t1, triangle &t2)
     {
-      float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
-      float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
-      return z1 > z2;
+      return t1.p[0].z + t1.p[1].z + t1.p[2].z > t2.p[0].z + t2.p[1].z + t2.p[2].z;
     });
 
-    // Clear the screen.
-    Clear(colorSky);
+    olc::Sprite *pSprite = imp.sprite.get();
+    std::fill(pSprite->pColData.begin(), pSprite->pColData.end(), olc::BLANK);
+    for (auto &tri : vecTriangles)
+    {
+      if (bTextured)
+        Triangle_RasterizeTextured<false>(tri, texTerrain, pSprite);
+      else
+        Triangle_RasterizeFlat<false>(tri, pSprite);
+    }
+
+    imp.nChunk = nChunk;
+    imp.csCamera = csImpostor;
+    imp.fTanHalfFov = tanf(asinf(r / d));
+    imp.vLight = snapshot.lightDirection;
+    imp.fDistance = d;
+    imp.nFeatures = snapshot.nFeatures & (nFeatureLit | nFeatureTextured);
+  }
+
+  void RenderDeferredFrame()
+  {
+    // Rasterize the main view unlit and store it in the G-buffer, unless nothing that affects the
+    // unlit image has changed since the G-buffer was filled. Then light it.
+    framedata &frame = frames[nFrontFrame];
+    TakeFrameSnapshot(frame);
+    frame.snapshot.nFeatures &= ~nFeatureLit;
+    frame.snapshot.bImpostors = false;  // The G-buffer only knows about triangles.
+    int nWidth = viewports[0].w, nHeight = viewports[0].h;
+    bRelitOnly = gbufMain.bValid && frame.snapshot.meshTheta == gbufMain.meshTheta &&
+                 frame.snapshot.nFeatures == gbufMain.nFeatures && frame.snapshot.bGizmo == gbufMain.bGizmo &&
+                 nWidth == gbufMain.nWidth && nHeight == gbufMain.nHeight &&
+                 CoordSys_IsEqual(frame.snapshot.csCamera, gbufMain.csCamera);
+    if (bRelitOnly)
+      fGeometryMs = fRasterMs = 0.0f;
+    else
+    {
+      // The triangle ids are written while rasterizing the colors, with the same visibility.
+      gbufMain.vecTriIds.assign(nWidth * nHeight, -1);
+      frame.pTriIds = gbufMain.vecTriIds.data();
+      BuildFrameGeometry(frame);
+      RasterizeFrame(frame);
+      frame.pTriIds = nullptr;
+      fGeometryMs = frame.fGeometryMs;
+
+      gbufMain.vecBaseColors = GetDrawTarget()->pColData;
+      gbufMain.pTriNormals = frame.pTriNormals;
+      gbufMain.csCamera = frame.snapshot.csCamera;
+      gbufMain.meshTheta = frame.snapshot.meshTheta;
+      gbufMain.nFeatures = frame.snapshot.nFeatures;
+      gbufMain.bGizmo = frame.snapshot.bGizmo;
+      gbufMain.nWidth = nWidth;
+      gbufMain.nHeight = nHeight;
+      gbufMain.bValid = true;
+    }
+    LightGBuffer(frame.snapshot);
+  }
 
-    // Rasterize the sorted triangles.
-    for (auto &triToRasterize : vecClippedTrianglesToRasterize)
+  void LightGBuffer(framesnapshot &snapshot)
+  {
+    // The lighting pass. Shading is per triangle, like in the forward pipeline, so the light is
+    // evaluated once per triangle and then applied to every pixel.
+    auto tpStart = std::chrono::steady_clock::now();
+    std::vector<vec3d> &vecTriNormals = *gbufMain.pTriNormals;
+    int nTris = vecTriNormals.size();
+    vecTriLightFactors.resize(nTris);
+    horizonsun sun = HorizonMap_Sun(horizonTerrain, snapshot.lightDirection);
+    for (int t = 0; t < nTris; t++)
     {
-        FillTriangle(triToRasterize.p[0].x, triToRasterize.p[0].y,
-                     triToRasterize.p[1].x, triToRasterize.p[1].y,
-                     triToRasterize.p[2].x, triToRasterize.p[2].y,
-                     triToRasterize.fillColor);
-        // DrawTriangle(triToRasterize.p[0].x, triToRasterize.p[0].y,
-        //              triToRasterize.p[1].x, triToRasterize.p[1].y,
-        //              triToRasterize.p[2].x, triToRasterize.p[2].y,
-        //              triToRasterize.wireColor);
+      float dp = Vec3d_DotProduct(snapshot.lightDirection, vecTriNormals[t]);  // dp is between -1 and 1.
+      if (snapshot.bTerrainShadows && dp < 0.0f)
+        dp *= HorizonMap_SunVisibility(horizonTerrain, sun, t);
+      vecTriLightFactors[t] = 0.5f * (1.0f - dp);  // Between 0 and 1.
+    }
+
+    olc::Pixel *pData = GetDrawTarget()->GetData();
+    int nPixels = gbufMain.vecTriIds.size();
+    for (int i = 0; i < nPixels; i++)
+    {
+      int nId = gbufMain.vecTriIds[i];
+      if (nId == -1)
+        pData[i] = snapshot.colorSky;
+      else if (nId < 0)
+        pData[i] = gbufMain.vecBaseColors[i];
+      else
+      {
+        olc::Pixel base = gbufMain.vecBaseColors[i];
+        float f = vecTriLightFactors[nId];
+        pData[i] = olc::Pixel((uint8_t)(base.r * f), (uint8_t)(base.g * f), (uint8_t)(base.b * f));
+      }
+    }
+    fLightingMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpStart).count();
+  }
+
+  void AnalyzeFrame(framedata &frame)
+  {
+    // Count the pixel writes and the triangles per tile of the frame's main view, resolving
+    // visibility the way the frame was rasterized. Runs after RasterizeFrame, so the view's depth
+    // or span buffer can be reused.
+    int nWidth = viewports[0].w, nHeight = viewports[0].h;
+    int nTilesX = (nWidth + nDensityTileSize - 1) / nDensityTileSize;
+    int nTilesY = (nHeight + nDensityTileSize - 1) / nDensityTileSize;
+    vecOverdraw.assign(nWidth * nHeight, 0);
+    vecTileTriangles.assign(nTilesX * nTilesY, 0);
+
+    float *pDepth = nullptr;
+    spanbuffer *pCoverage = nullptr;
+    if (frame.snapshot.nFeatures & nFeatureSpanBuffered)
+    {
+      SpanBuffer_Clear(spanBuffers[0], nWidth, nHeight);
+      pCoverage = &spanBuffers[0];
+    }
+    else if (frame.snapshot.nFeatures & nFeatureDepthBuffered)
+    {
+      std::fill(vecDepthBuffers[0].begin(), vecDepthBuffers[0].end(), 0.0f);
+      pDepth = vecDepthBuffers[0].data();
+    }
+
+    stats = renderstats();
+    for (auto &item : frame.views[0].vecQueue)
+    {
+      triangle &tri = frame.views[0].vecToRasterize[item.nTriangle];
+      if (DrawItem_Layer(item) == nLayerWorld)
+        Triangle_CountWrites(tri, vecOverdraw.data(), nWidth, nHeight, pDepth, pCoverage);
+      else
+        Triangle_CountWrites(tri, vecOverdraw.data(), nWidth, nHeight);
+
+      float fArea = 0.5f * fabsf((tri.p[1].x - tri.p[0].x) * (tri.p[2].y - tri.p[0].y) - (tri.p[2].x - tri.p[0].x) * (tri.p[1].y - tri.p[0].y));
+      if (fArea < 1.0f)
+        stats.nSubPixelTriangles++;
+      vec3d vCentroid = Triangle_Centroid(tri);
+      int tx = std::min(std::max((int)vCentroid.x / nDensityTileSize, 0), nTilesX - 1);
+      int ty = std::min(std::max((int)vCentroid.y / nDensityTileSize, 0), nTilesY - 1);
+      vecTileTriangles[ty * nTilesX + tx]++;
+    }
+
+    stats.nTriangles = frame.views[0].vecToRasterize.size();
+    for (uint16_t nCount : vecOverdraw)
+    {
+      stats.nWrites += nCount;
+      stats.nCoveredPixels += (nCount > 0);
+      stats.nMaxOverdraw = std::max(stats.nMaxOverdraw, (int)nCount);
+    }
+    for (int nCount : vecTileTriangles)
+    {
+      stats.nOccupiedTiles += (nCount > 0);
+      stats.nMaxTrianglesPerTile = std::max(stats.nMaxTrianglesPerTile, nCount);
+    }
+  }
+
+  void DrawDebugView()
+  {
+    // Replace the main view with the heatmap of the last analyzed frame. Both are scaled to their
+    // maximum, so the hot spots always stand out.
+    int nWidth = viewports[0].w, nHeight = viewports[0].h;
+    if (bOverdrawView)
+    {
+      olc::Sprite *pTarget = GetDrawTarget();
+      for (int y = 0; y < nHeight; y++)
+        for (int x = 0; x < nWidth; x++)
+          pTarget->SetPixel(x, y, Heatmap_Color((float)vecOverdraw[y * nWidth + x] / std::max(stats.nMaxOverdraw, 1)));
+    }
+    else if (bDensityView)
+    {
+      int nTilesX = (nWidth + nDensityTileSize - 1) / nDensityTileSize;
+      for (size_t i = 0; i < vecTileTriangles.size(); i++)
+      {
+        olc::Pixel color = Heatmap_Color((float)vecTileTriangles[i] / std::max(stats.nMaxTrianglesPerTile, 1));
+        FillRect((i % nTilesX) * nDensityTileSize, (i / nTilesX) * nDensityTileSize, nDensityTileSize, nDensityTileSize, color);
+      }
     }
-    return true;
   }
 };
 
@@ -898,6 +4255,20 @@ void testProjectionMatrix()
 }
 
 
+#if defined(OLCENGINE3D_BENCHMARK)
+int main(int argc, char *argv[])
+{
+  // Headless benchmark, e.g. for running the WebAssembly build under Node.
+  // Usage: olcEngine3D [frames] [pipelined (0 or 1)] [render stats (0 or 1)]
+  int nFrames = (argc > 1) ? atoi(argv[1]) : 300;
+  bool bPipelined = (argc > 2) && atoi(argv[2]) != 0;
+  bool bRenderStats = (argc > 3) && atoi(argv[3]) != 0;
+  olcEngine3D demo;
+  if (demo.Construct(640, 480, 1, 1) && demo.RunBenchmark(nFrames, bPipelined, bRenderStats))
+    return 0;
+  return 1;
+}
+#else
 int main()
 {
   // testProjectionMatrix();
@@ -906,3 +4277,4 @@ int main()
     demo.Start();
   return 0;
 }
+#endif
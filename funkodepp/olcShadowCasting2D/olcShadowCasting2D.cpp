@@ -1,5 +1,35 @@
 // olcShadowCasting2D: Line of Sight or Shadow Casting in 2D, tutorial by javidx9.
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+// Map files are mapped into memory with mmap, or with MapViewOfFile on Windows, where the
+// olcPixelGameEngine brings in windows.h.
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Pick a SIMD instruction set for the ray versus edge tests, which test 8 edges at a time with
+// AVX, 4 with SSE, and fall back to scalar code otherwise.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define OLCSHADOWCASTING2D_SIMD_AVX
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define OLCSHADOWCASTING2D_SIMD_SSE
+#endif
 
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
@@ -9,13 +39,66 @@ struct sEdge
 {
   float sx, sy;
   float ex, ey;
+  bool exist = true;  // False for ids on the free list.
 };
 
-struct sCell
+struct sCorner
 {
-  int edge_id[4];
-  bool edge_exist[4];
-  bool exist = false;
+  float x, y;
+};
+
+// An edge on a line of the poly map, by the first tile along the line it starts at.
+struct sLineEdge
+{
+  int start;
+  int edge_id;
+};
+
+struct sChunk
+{
+  uint64_t rows[64];      // Bit x of row y is the tile at (x, y) within the chunk.
+  bool bEdited = false;   // Differs from the map file.
+  std::list<std::pair<int, int>>::iterator itUse;
+};
+
+struct sVisibilityCacheEntry
+{
+  float x, y;
+  float radius;
+  int revision;
+  std::vector<std::tuple<float, float, float>> vecPolygon;
+};
+
+struct sLitRegion
+{
+  float left, top;
+  float right, bottom;
+};
+
+struct sLight
+{
+  float x, y;
+  float radius;
+  olc::Pixel colour;
+  float vx = 0.0f, vy = 0.0f;  // Velocity while the lights are moving.
+  bool bStatic = false;        // Baked lights stay where they are, and are kept in the lightmap.
+
+  // What the light last added to the light accumulation buffer, or the lightmap when baked, so
+  // it can be taken out again.
+  bool bApplied = false;
+  bool bInvalid = false;  // Set when the map within its lit region changed.
+  float applied_x, applied_y, applied_radius;
+  olc::Pixel applied_colour;
+  std::vector<std::tuple<float, float, float>> vecPolygon;
+  sLitRegion lit;  // Bounding box of vecPolygon.
+};
+
+struct sLightmapTile
+{
+  // A square of the lightmap, added up like the light accumulation buffer in three planes, and
+  // converted to pixels. Its buffers are only allocated once a light reaches the tile.
+  std::vector<int> vecAccum;
+  std::vector<olc::Pixel> vecPixels;
 };
 
 #define NORTH 0
@@ -23,6 +106,18 @@ struct sCell
 #define EAST 2
 #define WEST 3
 
+// Index of the lowest set bit of a non-zero word.
+inline int LowestBit(uint64_t n)
+{
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward64(&i, n);
+  return i;
+#else
+  return __builtin_ctzll(n);
+#endif
+}
+
 
 class olcShadowCasting2D : public olc::PixelGameEngine
 {
@@ -32,250 +127,932 @@ public:
     sAppName = "ShadowCasting2D";
   }
 
+  ~olcShadowCasting2D()
+  {
+    {
+      std::lock_guard<std::mutex> lock(muxWorkers);
+      bWorkersQuit = true;
+    }
+    cvWorkers.notify_all();
+    for (auto &worker : vecWorkers)
+      worker.join();
+    CloseMapFile();
+  }
+
 private:
-  sCell *world;
+  // The tile map as a bitset, row by row, where bit i of word j of a row is the tile at
+  // x = 64 * j + i. Rows are padded to whole words with empty tiles. It holds the window of the
+  // world around the camera, everything derived from it (the poly map, visibility polygons and
+  // lights) is in pixels from the window's top left corner.
+  std::vector<uint64_t> vecWorld;
+  int nWorldWords = 0;
   int nWorldWidth = 40;
   int nWorldHeight = 30;
   int fBlockWidth = 16;
 
+  // The world is a map file of nMapChunksX x nMapChunksY chunks of nChunkTiles x nChunkTiles
+  // tiles, mapped into memory. A chunk row is one word of the tile map. Chunks are decoded when
+  // the window first needs them, and at most nMaxChunks are kept. Edited chunks that are dropped
+  // keep their tiles run-length encoded in mapEditedChunks, the map file is never written to.
+  static constexpr int nChunkTiles = 64;
+  const uint8_t *pMapData = nullptr;
+  size_t nMapSize = 0;
+  int nMapChunksX = 0, nMapChunksY = 0;
+#if defined(_WIN32)
+  HANDLE hMapFile = INVALID_HANDLE_VALUE;
+  HANDLE hMapMapping = nullptr;
+#else
+  int nMapFile = -1;
+#endif
+  std::map<std::pair<int, int>, sChunk> mapChunks;
+  std::list<std::pair<int, int>> listChunkUse;  // Most recently used first.
+  size_t nMaxChunks = 64;
+  std::map<std::pair<int, int>, std::vector<uint8_t>> mapEditedChunks;
+
+  // The window is nWindowChunks x nWindowChunks chunks, starting at chunk (nWindowChunkX,
+  // nWindowChunkY), and is moved such that the screen centre stays in its middle chunk. That
+  // keeps everything within a light's radius of the screen in the window. The camera is the
+  // screen's top left corner in world pixels, and at (nViewX, nViewY) in window pixels.
+  static constexpr int nWindowChunks = 3;
+  int nWindowChunkX = 0, nWindowChunkY = 0;
+  bool bWindowLoaded = false;
+  float fCameraX = 0.0f, fCameraY = 0.0f;
+  int nViewX = 0, nViewY = 0;
+
   olc::Sprite *sprLightCast;
-  olc::Sprite *buffLightRay;
-  olc::Sprite *buffLightTex;
 
   std::vector<sEdge> vecEdges;
+  std::vector<int> vecFreeEdges;
+
+  // Counts the changes to the poly map, so results derived from it can tell they are out of date.
+  int nWorldRevision = 0;
+
+  // The edges on every line of the poly map, sorted along it. Lines are the columns for WEST and
+  // EAST edges, and the rows for NORTH and SOUTH edges.
+  std::vector<std::vector<sLineEdge>> vecLineEdges[4];
+
+  // Tiles edited this frame, whose edges are updated together at the end of the frame.
+  std::vector<int> vecEditedTiles;
+  bool bPaintValue = false;
+
+  // The poly map is bucketed in a uniform grid with cells of nGridTiles x nGridTiles tiles, so a
+  // light only looks at the geometry near it. Each cell has a run of the edges touching it, as
+  // separate arrays of start points and directions so rays can test several edges per
+  // instruction, padded to a multiple of the SIMD width with edges that are never hit. Edges
+  // touching several cells are stored in each. A cell whose run is full gets a new one twice the
+  // size at the end of the arrays, the old one is reclaimed by the next full rebuild.
+#if defined(OLCSHADOWCASTING2D_SIMD_AVX)
+  static constexpr int nEdgeLanes = 8;
+#elif defined(OLCSHADOWCASTING2D_SIMD_SSE)
+  static constexpr int nEdgeLanes = 4;
+#else
+  static constexpr int nEdgeLanes = 1;
+#endif
+  int nGridTiles = 8;
+  int nGridWidth = 0;
+  int nGridHeight = 0;
+  float fGridCellSize = 0.0f;
+  std::vector<int> vecGridEdgeStart, vecGridEdgeEnd;  // Per cell, offsets into the runs.
+  std::vector<int> vecGridEdgeIds;                    // Index into vecEdges, or -1 for padding.
+  std::vector<float> vecEdgeSX, vecEdgeSY, vecEdgeDX, vecEdgeDY;
 
   std::vector<std::tuple<float, float, float>> vecVisibilityPolygonPoints;
 
-  void ConvertTileMapToPolyMap(int sx, int sy, int w, int h, float step, int pitch)
+  // The angular sweep is exact and O(E log E) in the edges within the light's radius. The
+  // original ray casting, three rays per corner, is kept for comparison and toggled with the L key.
+  bool bLegacyRayCasting = false;
+  float fVisibilityMicroseconds = 0.0f;
+
+  // Recently calculated visibility polygons, most recently used first, looked up by the source
+  // position in cells of fVisibilityCacheEpsilon, the radius and the world revision. A source
+  // within fVisibilityCacheEpsilon of a cached one reuses its polygon.
+  std::list<sVisibilityCacheEntry> listVisibilityCache;
+  std::map<std::tuple<int, int, float, int>, std::list<sVisibilityCacheEntry>::iterator> mapVisibilityCache;
+  size_t nVisibilityCacheSize = 64;
+  float fVisibilityCacheEpsilon = 0.5f;
+  bool bVisibilityCacheHit = false;
+
+  // Placed lights, added up in vecLightAccum in 8.8 fixed point per screen pixel, in a red, a
+  // green and a blue plane, and shown through buffLightAccum. A light stays added until it moves
+  // or the map within its radius changes. Then it is subtracted with the polygon and values it
+  // was added with, which takes it out exactly, and added again.
+  std::vector<sLight> vecLights;
+  std::vector<int> vecLightAccum;
+  olc::Sprite *buffLightAccum;
+  int nLightsViewX = 0, nLightsViewY = 0;  // The view the accumulation buffer was made for.
+
+  // Baked lights are added up the same way, but in a lightmap of window pixels, which doesn't
+  // depend on the view. Scrolling only changes which part of it is copied to the screen, and the
+  // other lights are added on top. It is split into tiles of nLightmapTile x nLightmapTile pixels.
+  static constexpr int nLightmapTile = 64;
+  int nLightmapTilesX = 0, nLightmapTilesY = 0;
+  std::vector<sLightmapTile> vecLightmapTiles;
+  bool bMoveLights = false;
+  int nLightsUpdated = 0;
+  float fLightsMilliseconds = 0.0f;
+
+  // Worker threads for ParallelFor, which sleep between calls.
+  std::vector<std::thread> vecWorkers;
+  std::mutex muxWorkers;
+  std::condition_variable cvWorkers, cvWorkersDone;
+  std::function<void(int)> fnWorkerTask;
+  int nWorkerTasks = 0;
+  std::atomic<int> nNextWorkerTask{ 0 };
+  int nWorkerGeneration = 0;
+  int nWorkersBusy = 0;
+  bool bWorkersQuit = false;
+
+  bool GetTile(int x, int y)
+  {
+    return (vecWorld[y * nWorldWords + (x >> 6)] >> (x & 63)) & 1;
+  }
+
+  void SetTile(int x, int y, bool exist)
+  {
+    uint64_t &word = vecWorld[y * nWorldWords + (x >> 6)];
+    word = exist ? word | (1ull << (x & 63)) : word & ~(1ull << (x & 63));
+  }
+
+  void ConvertTileMapToPolyMap(int sx, int sy, int w, int h, float step)
   {
     // Clear the polymap.
     vecEdges.clear();
+    vecFreeEdges.clear();
+    for (int d = 0; d < 4; d++)
+    {
+      vecLineEdges[d].resize(d == NORTH || d == SOUTH ? nWorldHeight : nWorldWidth);
+      for (auto &vecLine : vecLineEdges[d])
+        vecLine.clear();
+    }
 
-    for (int x = 0; x < w; x++)
-      for (int y = 0; y < h; y++)
-        for (int j = 0; j < 4; j++)
+    // Only tiles inside the region's border get edges.
+    std::vector<uint64_t> vecColumns(nWorldWords, 0);
+    for (int x = sx + 1; x < sx + w - 1; x++)
+      vecColumns[x >> 6] |= 1ull << (x & 63);
+
+    // Go through the region a row at a time, and find the tiles that need an edge on each side
+    // for 64 tiles at once, by comparing each word with the words of the neighbouring tiles.
+    // Edges are maximal runs of such tiles. Northern and southern edges run along the row, and
+    // are the runs of set bits. Western and eastern edges run down a column, they start in a row
+    // where a bit is set that wasn't in the row above, and end where it is cleared again.
+    std::vector<uint64_t> vecMask[4], vecPrevMask[2];
+    for (int d = 0; d < 4; d++)
+      vecMask[d].assign(nWorldWords, 0);
+    vecPrevMask[0].assign(nWorldWords, 0);
+    vecPrevMask[1].assign(nWorldWords, 0);
+    std::vector<int> vecOpenEdges[2] = { std::vector<int>(nWorldWidth), std::vector<int>(nWorldWidth) };
+
+    for (int y = sy + 1; y <= sy + h - 1; y++)
+    {
+      // The last row only ends the western and eastern edges still open.
+      bool bLast = y == sy + h - 1;
+      const uint64_t *pRow = &vecWorld[y * nWorldWords];
+      const uint64_t *pNorth = pRow - nWorldWords;
+      const uint64_t *pSouth = pRow + nWorldWords;
+      for (int j = 0; j < nWorldWords; j++)
+      {
+        uint64_t n = bLast ? 0 : pRow[j] & vecColumns[j];
+        uint64_t west = (pRow[j] << 1) | (j > 0 ? pRow[j - 1] >> 63 : 0);
+        uint64_t east = (pRow[j] >> 1) | (j < nWorldWords - 1 ? pRow[j + 1] << 63 : 0);
+        vecMask[NORTH][j] = n & ~pNorth[j];
+        vecMask[SOUTH][j] = bLast ? 0 : n & ~pSouth[j];
+        vecMask[WEST][j] = n & ~west;
+        vecMask[EAST][j] = n & ~east;
+      }
+
+      for (int d : { NORTH, SOUTH })
+      {
+        const uint64_t *pMask = vecMask[d].data();
+        int x = 0;
+        while ((x = NextBit(pMask, nWorldWords, x, true)) < nWorldWords * 64)
         {
-          world[(y + sy) * pitch + (x + sx)].edge_exist[j] = false;
-          world[(y + sy) * pitch + (x + sx)].edge_id[j] = 0;
+          int x_end = NextBit(pMask, nWorldWords, x, false);
+          sEdge edge;
+          edge.sx = x * step; edge.sy = (y + (d == SOUTH)) * step;
+          edge.ex = x_end * step; edge.ey = edge.sy;
+          vecLineEdges[d][y].push_back({ x, (int)vecEdges.size() });
+          vecEdges.push_back(edge);
+          x = x_end;
         }
+      }
 
-    // Iterate through region from top left to bottom right
-    for (int x = 1; x < w - 1; x++)
-      for (int y = 1; y < h - 1; y++)
+      for (int d : { WEST, EAST })
       {
-        // Create some convenient indices
-        int i = (y + sy) * pitch + (x + sx);      // Current Cell.
-        int n = (y + sy - 1) * pitch + (x + sx);  // Northern Neighbour.
-        int s = (y + sy + 1) * pitch + (x + sx);  // Southern Neighbour.
-        int w = (y + sy) * pitch + (x + sx - 1);  // Western Neighbour.
-        int e = (y + sy) * pitch + (x + sx + 1);  // Eastern Neighbour.
-
-        // If this cell exists, check if it needs edges.
-        if (world[i].exist)
+        uint64_t *pPrev = vecPrevMask[d == EAST].data();
+        std::vector<int> &vecOpen = vecOpenEdges[d == EAST];
+        for (int j = 0; j < nWorldWords; j++)
         {
-          // If this cell has no western neighbour, it needs a western edge.
-          if (!world[w].exist)
+          uint64_t m = vecMask[d][j];
+          for (uint64_t ends = pPrev[j] & ~m; ends; ends &= ends - 1)
+            vecEdges[vecOpen[j * 64 + LowestBit(ends)]].ey = y * step;
+          for (uint64_t starts = m & ~pPrev[j]; starts; starts &= starts - 1)
           {
-            // It can either extend it from its northern neighbor if it has
-            // one, or it can start a new one.
-            if (world[n].edge_exist[WEST])
-            {
-              // Northern neighbor has a western edge, so grow it downwards.
-              vecEdges[world[n].edge_id[WEST]].ey += step;
-              world[i].edge_id[WEST] = world[n].edge_id[WEST];
-              world[i].edge_exist[WEST] = true;
-            }
-            else
-            {
-              // Northern neighbor does not have one, so create one.
-              sEdge edge;
-              edge.sx = (sx + x) * step; edge.sy = (sy + y) * step;
-              edge.ex = edge.sx; edge.ey = edge.sy + step;
-
-              // Add edge to pool.
-              int edge_id = vecEdges.size();
-              vecEdges.push_back(edge);
-
-              // Update tile information with edge information.
-              world[i].edge_id[WEST] = edge_id;
-              world[i].edge_exist[WEST] = true;
-            }
+            int x = j * 64 + LowestBit(starts);
+            sEdge edge;
+            edge.sx = (x + (d == EAST)) * step; edge.sy = y * step;
+            edge.ex = edge.sx; edge.ey = edge.sy;
+            vecOpen[x] = vecEdges.size();
+            vecLineEdges[d][x].push_back({ y, (int)vecEdges.size() });
+            vecEdges.push_back(edge);
           }
+          pPrev[j] = m;
+        }
+      }
+    }
 
-          // If this cell has no eastern neighbour, it needs an eastern edge.
-          if (!world[e].exist)
-          {
-            // It can either extend it from its northern neighbor if it has
-            // one, or it can start a new one.
-            if (world[n].edge_exist[EAST])
-            {
-              // Northern neighbor has an eastern edge, so grow it downwards.
-              vecEdges[world[n].edge_id[EAST]].ey += step;
-              world[i].edge_id[EAST] = world[n].edge_id[EAST];
-              world[i].edge_exist[EAST] = true;
-            }
-            else
-            {
-              // Northern neighbor does not have one, so create one.
-              sEdge edge;
-              edge.sx = (sx + x + 1) * step; edge.sy = (sy + y) * step;
-              edge.ex = edge.sx; edge.ey = edge.sy + step;
+    BuildEdgeGrid(step);
+    nWorldRevision++;
+  }
 
-              // Add edge to pool.
-              int edge_id = vecEdges.size();
-              vecEdges.push_back(edge);
+  int NextBit(const uint64_t *pBits, int nWords, int x, bool bSet)
+  {
+    // Returns the first position from x on whose bit is bSet, or nWords * 64 if there is none.
+    int j = x >> 6;
+    if (j >= nWords)
+      return nWords * 64;
+    uint64_t word = (bSet ? pBits[j] : ~pBits[j]) & (~0ull << (x & 63));
+    while (word == 0)
+    {
+      if (++j == nWords)
+        return nWords * 64;
+      word = bSet ? pBits[j] : ~pBits[j];
+    }
+    return j * 64 + LowestBit(word);
+  }
 
-              // Update tile information with edge information.
-              world[i].edge_id[EAST] = edge_id;
-              world[i].edge_exist[EAST] = true;
-            }
-          }
+  void UpdatePolyMap(const std::vector<int> &vecTiles, float step)
+  {
+    // Updates the poly map after the tiles in vecTiles were toggled, without converting the
+    // whole tile map again. A tile only decides its own edges and the facing edges of its four
+    // neighbours. Each of these edge slots, the edges through it and through its two neighbours
+    // along the same line (which it could merge with) are removed, and the edges over the
+    // removed range are derived again from the tile map. Edges of several tiles on the same line
+    // are derived once.
+    auto has_edge = [&](int x, int y, int d)
+    {
+      // Matches ConvertTileMapToPolyMap, which leaves the outermost tiles without edges.
+      if (x < 1 || y < 1 || x >= nWorldWidth - 1 || y >= nWorldHeight - 1 || !GetTile(x, y))
+        return false;
+      return !GetTile(x + (d == EAST) - (d == WEST), y + (d == SOUTH) - (d == NORTH));
+    };
+
+    // Lines are keyed by direction, and the column (WEST, EAST) or row (NORTH, SOUTH) they run
+    // along. Positions along a line are rows or columns respectively.
+    std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> mapRanges;
+    auto remove_around = [&](int x, int y, int d)
+    {
+      bool vertical = d == WEST || d == EAST;
+      int line = vertical ? x : y;
+      int pos = vertical ? y : x;
+      if (line < 0 || line >= (int)vecLineEdges[d].size())
+        return;
+      std::vector<sLineEdge> &vecLine = vecLineEdges[d][line];
+      int lo = pos, hi = pos;
+      for (int p = pos - 1; p <= pos + 1; p++)
+      {
+        // The last edge starting at or before p, if it reaches p.
+        auto it = upper_bound(vecLine.begin(), vecLine.end(), p, [](int p, const sLineEdge &le) { return p < le.start; });
+        if (it == vecLine.begin())
+          continue;
+        --it;
+        int id = it->edge_id;
+        sEdge &e = vecEdges[id];
+        int a = it->start;
+        int b = (int)roundf((vertical ? e.ey : e.ex) / step) - 1;
+        if (b < p)
+          continue;
+
+        vecLine.erase(it);
+        GridRemoveEdge(id);
+        e.exist = false;
+        vecFreeEdges.push_back(id);
+        lo = std::min(lo, a);
+        hi = std::max(hi, b);
+      }
+      mapRanges[{ d, line }].push_back({ lo, hi });
+    };
+    for (int i : vecTiles)
+    {
+      int x = i % nWorldWidth, y = i / nWorldWidth;
+      for (int d = 0; d < 4; d++)
+        remove_around(x, y, d);
+      remove_around(x - 1, y, EAST);
+      remove_around(x + 1, y, WEST);
+      remove_around(x, y - 1, SOUTH);
+      remove_around(x, y + 1, NORTH);
+    }
 
-          // If this cell has no northern neighbour, it needs a northern edge.
-          if (!world[n].exist)
+    for (auto &[key, vecLineRanges] : mapRanges)
+    {
+      auto [d, line] = key;
+      bool vertical = d == WEST || d == EAST;
+      std::vector<sLineEdge> &vecLine = vecLineEdges[d][line];
+      sort(vecLineRanges.begin(), vecLineRanges.end());
+
+      // Merge overlapping and touching ranges, then grow edges over each from the tile map, the
+      // same way ConvertTileMapToPolyMap does.
+      for (size_t r = 0; r < vecLineRanges.size(); )
+      {
+        int lo = vecLineRanges[r].first, hi = vecLineRanges[r].second;
+        for (r++; r < vecLineRanges.size() && vecLineRanges[r].first <= hi + 1; r++)
+          hi = std::max(hi, vecLineRanges[r].second);
+
+        int edge_id = -1;
+        for (int p = lo; p <= hi + 1; p++)
+        {
+          int tx = vertical ? line : p, ty = vertical ? p : line;
+          if (p <= hi && has_edge(tx, ty, d))
           {
-            // It can either extend it from its western neighbor if it has
-            // one, or it can start a new one.
-            if (world[w].edge_exist[NORTH])
+            if (edge_id < 0)
             {
-              // Western neighbor has a northern edge, so grow it to the right.
-              vecEdges[world[w].edge_id[NORTH]].ex += step;
-              world[i].edge_id[NORTH] = world[w].edge_id[NORTH];
-              world[i].edge_exist[NORTH] = true;
+              sEdge edge;
+              edge.sx = (tx + (d == EAST)) * step; edge.sy = (ty + (d == SOUTH)) * step;
+              edge.ex = edge.sx; edge.ey = edge.sy;
+              edge_id = AllocateEdge(edge);
+              auto it = lower_bound(vecLine.begin(), vecLine.end(), p, [](const sLineEdge &le, int p) { return le.start < p; });
+              vecLine.insert(it, { p, edge_id });
             }
+            if (vertical)
+              vecEdges[edge_id].ey += step;
             else
-            {
-              // Western neighbor does not have one, so create one.
-              sEdge edge;
-              edge.sx = (sx + x) * step; edge.sy = (sy + y) * step;
-              edge.ex = edge.sx + step; edge.ey = edge.sy;
+              vecEdges[edge_id].ex += step;
+          }
+          else if (edge_id >= 0)
+          {
+            GridInsertEdge(edge_id);
+            edge_id = -1;
+          }
+        }
+      }
+    }
+    nWorldRevision++;
+  }
 
-              // Add edge to pool.
-              int edge_id = vecEdges.size();
-              vecEdges.push_back(edge);
+  int AllocateEdge(const sEdge &edge)
+  {
+    // Reuses a freed id if there is one, so the ids of the other edges stay put.
+    if (vecFreeEdges.empty())
+    {
+      vecEdges.push_back(edge);
+      return vecEdges.size() - 1;
+    }
+    int edge_id = vecFreeEdges.back();
+    vecFreeEdges.pop_back();
+    vecEdges[edge_id] = edge;
+    return edge_id;
+  }
 
-              // Update tile information with edge information.
-              world[i].edge_id[NORTH] = edge_id;
-              world[i].edge_exist[NORTH] = true;
-            }
-          }
+  void GridCellsTouched(const sEdge &e, int &cx0, int &cy0, int &cx1, int &cy1)
+  {
+    // The cells an edge touches, including those it only touches with a side or a corner, so a
+    // ray finds the edge in whichever cell it is in where it hits it.
+    // Coordinates are never negative, so truncating rounds down.
+    float x0 = std::min(e.sx, e.ex) / fGridCellSize, y0 = std::min(e.sy, e.ey) / fGridCellSize;
+    float x1 = std::max(e.sx, e.ex) / fGridCellSize, y1 = std::max(e.sy, e.ey) / fGridCellSize;
+    cx0 = std::max((int)x0 - ((int)x0 == x0), 0);
+    cy0 = std::max((int)y0 - ((int)y0 == y0), 0);
+    cx1 = std::min((int)x1, nGridWidth - 1);
+    cy1 = std::min((int)y1, nGridHeight - 1);
+  }
 
-          // If this cell has no southern neighbour, it needs a southern edge.
-          if (!world[s].exist)
-          {
-            // It can either extend it from its western neighbor if it has
-            // one, or it can start a new one.
-            if (world[w].edge_exist[SOUTH])
-            {
-              // Western neighbor has a southern edge, so grow it to the right.
-              vecEdges[world[w].edge_id[SOUTH]].ex += step;
-              world[i].edge_id[SOUTH] = world[w].edge_id[SOUTH];
-              world[i].edge_exist[SOUTH] = true;
-            }
-            else
-            {
-              // Western neighbor does not have one, so create one.
-              sEdge edge;
-              edge.sx = (sx + x) * step; edge.sy = (sy + y + 1) * step;
-              edge.ex = edge.sx + step; edge.ey = edge.sy;
+  void GridSetSlot(int k, int edge_id)
+  {
+    vecGridEdgeIds[k] = edge_id;
+    if (edge_id < 0)
+    {
+      vecEdgeSX[k] = NAN;  // NaN fails every comparison, so padding never hits.
+      vecEdgeSY[k] = NAN;
+      vecEdgeDX[k] = 0.0f;
+      vecEdgeDY[k] = 0.0f;
+      return;
+    }
+    sEdge &e = vecEdges[edge_id];
+    vecEdgeSX[k] = e.sx;
+    vecEdgeSY[k] = e.sy;
+    vecEdgeDX[k] = e.ex - e.sx;
+    vecEdgeDY[k] = e.ey - e.sy;
+  }
 
-              // Add edge to pool.
-              int edge_id = vecEdges.size();
-              vecEdges.push_back(edge);
+  void GridResizeSlots(int nSlots)
+  {
+    vecGridEdgeIds.resize(nSlots, -1);
+    vecEdgeSX.resize(nSlots, NAN);
+    vecEdgeSY.resize(nSlots, NAN);
+    vecEdgeDX.resize(nSlots, 0.0f);
+    vecEdgeDY.resize(nSlots, 0.0f);
+  }
 
-              // Update tile information with edge information.
-              world[i].edge_id[SOUTH] = edge_id;
-              world[i].edge_exist[SOUTH] = true;
-            }
-          }
+  void GridInsertEdge(int edge_id)
+  {
+    int cx0, cy0, cx1, cy1;
+    GridCellsTouched(vecEdges[edge_id], cx0, cy0, cx1, cy1);
+    for (int cy = cy0; cy <= cy1; cy++)
+      for (int cx = cx0; cx <= cx1; cx++)
+      {
+        int c = cy * nGridWidth + cx;
+        int k = vecGridEdgeStart[c];
+        while (k < vecGridEdgeEnd[c] && vecGridEdgeIds[k] >= 0)
+          k++;
+        if (k == vecGridEdgeEnd[c])
+        {
+          // The run is full, move it to a new one twice the size.
+          int nSize = vecGridEdgeEnd[c] - vecGridEdgeStart[c];
+          int nStart = vecGridEdgeIds.size();
+          GridResizeSlots(nStart + std::max(2 * nSize, nEdgeLanes));
+          for (int j = 0; j < nSize; j++)
+            GridSetSlot(nStart + j, vecGridEdgeIds[vecGridEdgeStart[c] + j]);
+          vecGridEdgeStart[c] = nStart;
+          vecGridEdgeEnd[c] = vecGridEdgeIds.size();
+          k = nStart + nSize;
         }
+        GridSetSlot(k, edge_id);
+      }
+  }
 
+  void GridRemoveEdge(int edge_id)
+  {
+    int cx0, cy0, cx1, cy1;
+    GridCellsTouched(vecEdges[edge_id], cx0, cy0, cx1, cy1);
+    for (int cy = cy0; cy <= cy1; cy++)
+      for (int cx = cx0; cx <= cx1; cx++)
+      {
+        int c = cy * nGridWidth + cx;
+        for (int k = vecGridEdgeStart[c]; k < vecGridEdgeEnd[c]; k++)
+          if (vecGridEdgeIds[k] == edge_id)
+            GridSetSlot(k, -1);
+      }
+  }
 
+  void BuildEdgeGrid(float step)
+  {
+    fGridCellSize = nGridTiles * step;
+    nGridWidth = (nWorldWidth + nGridTiles - 1) / nGridTiles;
+    nGridHeight = (nWorldHeight + nGridTiles - 1) / nGridTiles;
+    int nCells = nGridWidth * nGridHeight;
+
+    // Count the edges per cell, and lay out the runs padded to the SIMD width.
+    vecGridEdgeStart.assign(nCells + 1, 0);
+    int cx0, cy0, cx1, cy1;
+    for (auto &e : vecEdges)
+    {
+      GridCellsTouched(e, cx0, cy0, cx1, cy1);
+      for (int cy = cy0; cy <= cy1; cy++)
+        for (int cx = cx0; cx <= cx1; cx++)
+          vecGridEdgeStart[cy * nGridWidth + cx + 1]++;
+    }
+    for (int c = 0; c < nCells; c++)
+      vecGridEdgeStart[c + 1] = vecGridEdgeStart[c] + (vecGridEdgeStart[c + 1] + nEdgeLanes - 1) / nEdgeLanes * nEdgeLanes;
+
+    vecGridEdgeIds.clear();
+    vecEdgeSX.clear();
+    vecEdgeSY.clear();
+    vecEdgeDX.clear();
+    vecEdgeDY.clear();
+
+    // Leave room for runs that edits move to the end, so that doesn't reallocate the arrays.
+    int nSlots = vecGridEdgeStart[nCells];
+    vecGridEdgeIds.reserve(nSlots + nSlots / 4);
+    vecEdgeSX.reserve(nSlots + nSlots / 4);
+    vecEdgeSY.reserve(nSlots + nSlots / 4);
+    vecEdgeDX.reserve(nSlots + nSlots / 4);
+    vecEdgeDY.reserve(nSlots + nSlots / 4);
+    GridResizeSlots(nSlots);
+    vecGridEdgeEnd.assign(vecGridEdgeStart.begin() + 1, vecGridEdgeStart.end());
+    vecGridEdgeStart.pop_back();
+    std::vector<int> vecFill = vecGridEdgeStart;
+    for (int i = 0; i < (int)vecEdges.size(); i++)
+    {
+      GridCellsTouched(vecEdges[i], cx0, cy0, cx1, cy1);
+      for (int cy = cy0; cy <= cy1; cy++)
+        for (int cx = cx0; cx <= cx1; cx++)
+          GridSetSlot(vecFill[cy * nGridWidth + cx]++, i);
+    }
+  }
+
+  void GridCellsInSquare(float ox, float oy, float radius, int &cx0, int &cy0, int &cx1, int &cy1)
+  {
+    // The cells overlapping the square of half size radius around (ox, oy), which is empty
+    // (cx0 > cx1 or cy0 > cy1) if it lies outside the grid.
+    cx0 = std::max((int)floorf((ox - radius) / fGridCellSize), 0);
+    cy0 = std::max((int)floorf((oy - radius) / fGridCellSize), 0);
+    cx1 = std::min((int)floorf((ox + radius) / fGridCellSize), nGridWidth - 1);
+    cy1 = std::min((int)floorf((oy + radius) / fGridCellSize), nGridHeight - 1);
+  }
+
+  void GatherEdgesInSquare(float ox, float oy, float radius, std::vector<sEdge> &vecOut)
+  {
+    // Collects the edges in the cells around (ox, oy), clipped to the square of half size radius
+    // around it. The edges are axis aligned, so clipping only clamps them along their length, and
+    // the ones on or outside the square's sides are dropped, as nothing inside can see them.
+    float x0 = ox - radius, y0 = oy - radius, x1 = ox + radius, y1 = oy + radius;
+    int cx0, cy0, cx1, cy1;
+    GridCellsInSquare(ox, oy, radius, cx0, cy0, cx1, cy1);
+    // Edges touching several cells are found once per cell.
+    std::vector<int> vecIds;
+    for (int cy = cy0; cy <= cy1; cy++)
+      for (int cx = cx0; cx <= cx1; cx++)
+        for (int k = vecGridEdgeStart[cy * nGridWidth + cx]; k < vecGridEdgeEnd[cy * nGridWidth + cx]; k++)
+          if (vecGridEdgeIds[k] >= 0)
+            vecIds.push_back(vecGridEdgeIds[k]);
+    sort(vecIds.begin(), vecIds.end());
+    vecIds.erase(unique(vecIds.begin(), vecIds.end()), vecIds.end());
+
+    for (int id : vecIds)
+    {
+      sEdge e = vecEdges[id];
+      if (e.sx == e.ex)
+      {
+        if (e.sx <= x0 || e.sx >= x1)
+          continue;
+        e.sy = std::clamp(e.sy, y0, y1);
+        e.ey = std::clamp(e.ey, y0, y1);
+        if (e.sy == e.ey)
+          continue;
       }
+      else
+      {
+        if (e.sy <= y0 || e.sy >= y1)
+          continue;
+        e.sx = std::clamp(e.sx, x0, x1);
+        e.ex = std::clamp(e.ex, x0, x1);
+        if (e.sx == e.ex)
+          continue;
+      }
+      vecOut.push_back(e);
+    }
   }
 
-  void CalculateVisibilityPolygon(float ox, float oy, float radius)
+  float NearestEdgeHit(int nFirst, int nLast, float ox, float oy, float rdx, float rdy)
   {
-    // Get rid of existing polygon
-    vecVisibilityPolygonPoints.clear();
+    // Returns the smallest t1 > 0 for which (ox, oy) + t1 * (rdx, rdy) lies on one of the edges
+    // nFirst to nLast of the runs, or INFINITY. With the edge as s + t2 * d, both follow from
+    // cross products: t1 = ((s - o) x d) / (r x d) and t2 = ((s - o) x r) / (r x d), where
+    // 0 <= t2 <= 1.
+    const float *pSX = vecEdgeSX.data(), *pSY = vecEdgeSY.data(), *pDX = vecEdgeDX.data(), *pDY = vecEdgeDY.data();
+    float min_t1 = INFINITY;
+#if defined(OLCSHADOWCASTING2D_SIMD_AVX)
+    __m256 vOx = _mm256_set1_ps(ox), vOy = _mm256_set1_ps(oy);
+    __m256 vRdx = _mm256_set1_ps(rdx), vRdy = _mm256_set1_ps(rdy);
+    __m256 vZero = _mm256_setzero_ps(), vOne = _mm256_set1_ps(1.0f), vInf = _mm256_set1_ps(INFINITY);
+    __m256 vMin = vInf;
+    for (int i = nFirst; i < nLast; i += 8)
+    {
+      __m256 vRelX = _mm256_sub_ps(_mm256_loadu_ps(pSX + i), vOx);
+      __m256 vRelY = _mm256_sub_ps(_mm256_loadu_ps(pSY + i), vOy);
+      __m256 vDx = _mm256_loadu_ps(pDX + i), vDy = _mm256_loadu_ps(pDY + i);
+      __m256 vInvDen = _mm256_div_ps(vOne, _mm256_sub_ps(_mm256_mul_ps(vRdx, vDy), _mm256_mul_ps(vRdy, vDx)));
+      __m256 vT1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(vRelX, vDy), _mm256_mul_ps(vRelY, vDx)), vInvDen);
+      __m256 vT2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(vRelX, vRdy), _mm256_mul_ps(vRelY, vRdx)), vInvDen);
+      __m256 vHit = _mm256_and_ps(_mm256_cmp_ps(vT1, vZero, _CMP_GT_OQ),
+                                  _mm256_and_ps(_mm256_cmp_ps(vT2, vZero, _CMP_GE_OQ), _mm256_cmp_ps(vT2, vOne, _CMP_LE_OQ)));
+      vMin = _mm256_min_ps(vMin, _mm256_blendv_ps(vInf, vT1, vHit));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vMin);
+    for (float t : lanes)
+      min_t1 = std::min(min_t1, t);
+#elif defined(OLCSHADOWCASTING2D_SIMD_SSE)
+    __m128 vOx = _mm_set1_ps(ox), vOy = _mm_set1_ps(oy);
+    __m128 vRdx = _mm_set1_ps(rdx), vRdy = _mm_set1_ps(rdy);
+    __m128 vZero = _mm_setzero_ps(), vOne = _mm_set1_ps(1.0f), vInf = _mm_set1_ps(INFINITY);
+    __m128 vMin = vInf;
+    for (int i = nFirst; i < nLast; i += 4)
+    {
+      __m128 vRelX = _mm_sub_ps(_mm_loadu_ps(pSX + i), vOx);
+      __m128 vRelY = _mm_sub_ps(_mm_loadu_ps(pSY + i), vOy);
+      __m128 vDx = _mm_loadu_ps(pDX + i), vDy = _mm_loadu_ps(pDY + i);
+      __m128 vInvDen = _mm_div_ps(vOne, _mm_sub_ps(_mm_mul_ps(vRdx, vDy), _mm_mul_ps(vRdy, vDx)));
+      __m128 vT1 = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(vRelX, vDy), _mm_mul_ps(vRelY, vDx)), vInvDen);
+      __m128 vT2 = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(vRelX, vRdy), _mm_mul_ps(vRelY, vRdx)), vInvDen);
+      __m128 vHit = _mm_and_ps(_mm_cmpgt_ps(vT1, vZero), _mm_and_ps(_mm_cmpge_ps(vT2, vZero), _mm_cmple_ps(vT2, vOne)));
+      vMin = _mm_min_ps(vMin, _mm_or_ps(_mm_and_ps(vHit, vT1), _mm_andnot_ps(vHit, vInf)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, vMin);
+    for (float t : lanes)
+      min_t1 = std::min(min_t1, t);
+#else
+    for (int i = nFirst; i < nLast; i++)
+    {
+      float relx = pSX[i] - ox, rely = pSY[i] - oy;
+      float den = rdx * pDY[i] - rdy * pDX[i];
+      if (den == 0.0f)
+        continue;
+      float t1 = (relx * pDY[i] - rely * pDX[i]) / den;
+      float t2 = (relx * rdy - rely * rdx) / den;
+      if (t1 > 0.0f && t2 >= 0.0f && t2 <= 1.0f && t1 < min_t1)
+        min_t1 = t1;
+    }
+#endif
+    return min_t1;
+  }
 
-    // For each edge in poly map.
-    for (auto &e1 : vecEdges)
+  float CastRay(float ox, float oy, float dx, float dy, float tMax)
+  {
+    // Returns the t at which (ox, oy) + t * (dx, dy) first hits an edge, or tMax if it hits none
+    // before. The ray steps through the grid one cell at a time (DDA), and stops in the first
+    // cell where it hits an edge inside that cell.
+    float tEnter = 0.0f, tExit = tMax;
+    auto clip = [&](float o, float d, float fSize)
     {
-      // Take the start point, then the end point (we could use a pool of
-      // non-duplicated points here, it would be more optimal).
-      for (int i = 0; i < 2; i++)
+      if (d == 0.0f)
+      {
+        if (o < 0.0f || o > fSize)
+          tEnter = INFINITY;
+        return;
+      }
+      float t0 = -o / d, t1 = (fSize - o) / d;
+      tEnter = std::max(tEnter, std::min(t0, t1));
+      tExit = std::min(tExit, std::max(t0, t1));
+    };
+    clip(ox, dx, nGridWidth * fGridCellSize);
+    clip(oy, dy, nGridHeight * fGridCellSize);
+    if (tEnter > tExit)
+      return tMax;
+
+    int cx = std::clamp((int)floorf((ox + dx * tEnter) / fGridCellSize), 0, nGridWidth - 1);
+    int cy = std::clamp((int)floorf((oy + dy * tEnter) / fGridCellSize), 0, nGridHeight - 1);
+    int nStepX = dx > 0.0f ? 1 : -1;
+    int nStepY = dy > 0.0f ? 1 : -1;
+    float tDeltaX = dx != 0.0f ? fGridCellSize / fabsf(dx) : INFINITY;
+    float tDeltaY = dy != 0.0f ? fGridCellSize / fabsf(dy) : INFINITY;
+    float tNextX = dx != 0.0f ? ((cx + (dx > 0.0f)) * fGridCellSize - ox) / dx : INFINITY;
+    float tNextY = dy != 0.0f ? ((cy + (dy > 0.0f)) * fGridCellSize - oy) / dy : INFINITY;
+    while (true)
+    {
+      int c = cy * nGridWidth + cx;
+      float tCellExit = std::min(tNextX, tNextY);
+      float t = NearestEdgeHit(vecGridEdgeStart[c], vecGridEdgeEnd[c], ox, oy, dx, dy);
+      if (t <= tCellExit)
+        return std::min(t, tMax);
+      if (tCellExit >= tExit)
+        return tMax;
+
+      if (tNextX < tNextY)
+      {
+        cx += nStepX;
+        tNextX += tDeltaX;
+      }
+      else
       {
-        float rdx, rdy;
-        rdx = (i == 0 ? e1.sx : e1.ex) - ox;
-        rdy = (i == 0 ? e1.sy : e1.ey) - oy;
+        cy += nStepY;
+        tNextY += tDeltaY;
+      }
+      if (cx < 0 || cx >= nGridWidth || cy < 0 || cy >= nGridHeight)
+        return tMax;
+    }
+  }
 
-        float base_ang = atan2f(rdy, rdx);
+  void CalculateVisibilityPolygon(float ox, float oy, float radius, std::vector<std::tuple<float, float, float>> &vecPoints)
+  {
+    // Only reads the poly map, so several lights can be calculated at the same time.
+    if (bLegacyRayCasting)
+      CalculateVisibilityPolygonByRayCasting(ox, oy, radius, vecPoints);
+    else
+      CalculateVisibilityPolygonBySweep(ox, oy, radius, vecPoints);
+  }
 
-        float ang = 0;
+  const std::vector<std::tuple<float, float, float>> &GetCachedVisibilityPolygon(float ox, float oy, float radius)
+  {
+    // Returns the visibility polygon from the cache, or calculates and caches it. Entries of
+    // older world revisions are never matched again, and drop out as they become the least
+    // recently used.
+    int cx = floorf(ox / fVisibilityCacheEpsilon), cy = floorf(oy / fVisibilityCacheEpsilon);
+    for (int ny = cy - 1; ny <= cy + 1; ny++)
+      for (int nx = cx - 1; nx <= cx + 1; nx++)
+      {
+        auto it = mapVisibilityCache.find({ nx, ny, radius, nWorldRevision });
+        if (it == mapVisibilityCache.end())
+          continue;
+        sVisibilityCacheEntry &entry = *it->second;
+        float dx = entry.x - ox, dy = entry.y - oy;
+        if (dx * dx + dy * dy > fVisibilityCacheEpsilon * fVisibilityCacheEpsilon)
+          continue;
+        listVisibilityCache.splice(listVisibilityCache.begin(), listVisibilityCache, it->second);
+        bVisibilityCacheHit = true;
+        return entry.vecPolygon;
+      }
 
-        // For each point, cast three rays, one directly at the point
-        // and one a little bit to either side.
-        for (int j = 0; j < 3; j++)
-        {
-          if (j == 0) ang = base_ang - 0.0001f;
-          if (j == 1) ang = base_ang;
-          if (j == 2) ang = base_ang + 0.0001f;
+    bVisibilityCacheHit = false;
+    auto key = std::make_tuple(cx, cy, radius, nWorldRevision);
+    auto it = mapVisibilityCache.find(key);
+    if (it != mapVisibilityCache.end())
+    {
+      // A source in the same cell, but too far away to share its polygon.
+      listVisibilityCache.erase(it->second);
+      mapVisibilityCache.erase(it);
+    }
+    if (listVisibilityCache.size() >= nVisibilityCacheSize)
+    {
+      sVisibilityCacheEntry &oldest = listVisibilityCache.back();
+      mapVisibilityCache.erase({ (int)floorf(oldest.x / fVisibilityCacheEpsilon), (int)floorf(oldest.y / fVisibilityCacheEpsilon), oldest.radius, oldest.revision });
+      listVisibilityCache.pop_back();
+    }
+    sVisibilityCacheEntry &entry = listVisibilityCache.emplace_front();
+    entry.x = ox;
+    entry.y = oy;
+    entry.radius = radius;
+    entry.revision = nWorldRevision;
+    CalculateVisibilityPolygon(ox, oy, radius, entry.vecPolygon);
+    mapVisibilityCache[key] = listVisibilityCache.begin();
+    return entry.vecPolygon;
+  }
 
-          // Create ray along angle for required distance.
-          rdx = radius * cosf(ang);
-          rdy = radius * sinf(ang);
+  void ClearVisibilityCache()
+  {
+    listVisibilityCache.clear();
+    mapVisibilityCache.clear();
+  }
 
-          float min_t1 = INFINITY;
-          float min_px = 0, min_py = 0, min_ang = 0;
+  void CalculateVisibilityPolygonBySweep(float ox, float oy, float radius, std::vector<std::tuple<float, float, float>> &vecPoints)
+  {
+    // Sweep a ray once around the source, through the edge endpoints in order of their angle.
+    // The edges the ray currently crosses are kept ordered by their distance along it, and
+    // wherever the nearest one changes, the visibility polygon gets a point on the old nearest
+    // edge and one on the new one. Edges don't cross, so their order along the ray only changes
+    // at endpoints.
+    vecPoints.clear();
+
+    // The square around the source stands in for the light's radius, its sides make sure the
+    // ray always crosses an edge.
+    std::vector<sEdge> vecSweepEdges;
+    GatherEdgesInSquare(ox, oy, radius, vecSweepEdges);
+    vecSweepEdges.push_back({ ox - radius, oy - radius, ox + radius, oy - radius });
+    vecSweepEdges.push_back({ ox + radius, oy - radius, ox + radius, oy + radius });
+    vecSweepEdges.push_back({ ox + radius, oy + radius, ox - radius, oy + radius });
+    vecSweepEdges.push_back({ ox - radius, oy + radius, ox - radius, oy - radius });
+
+    // Orient every edge such that the ray sweeps from its start to its end, i.e. with increasing
+    // angle. Edges in line with the source have no width and can't block anything. Neither can
+    // edges all but in line with it, whose endpoint angles are too close for atan2f to put in
+    // the right order.
+    struct sEvent
+    {
+      float ang;
+      int edge;
+      bool start;
+    };
+    std::vector<sEvent> vecEvents;
+    std::vector<int> vecInitial;
+    for (int i = 0; i < (int)vecSweepEdges.size(); i++)
+    {
+      sEdge &e = vecSweepEdges[i];
+      float cross = (e.sx - ox) * (e.ey - oy) - (e.sy - oy) * (e.ex - ox);
+      float ds = (e.sx - ox) * (e.sx - ox) + (e.sy - oy) * (e.sy - oy);
+      float de = (e.ex - ox) * (e.ex - ox) + (e.ey - oy) * (e.ey - oy);
+      if (cross * cross <= 1e-10f * ds * de)
+        continue;
+      if (cross < 0.0f)
+      {
+        std::swap(e.sx, e.ex);
+        std::swap(e.sy, e.ey);
+      }
+      float ang_s = atan2f(e.sy - oy, e.sx - ox);
+      float ang_e = atan2f(e.ey - oy, e.ex - ox);
+      vecEvents.push_back({ ang_s, i, true });
+      vecEvents.push_back({ ang_e, i, false });
+
+      // Edges that wrap around from +pi to -pi are crossed by the ray it starts with.
+      if (ang_s > ang_e)
+        vecInitial.push_back(i);
+    }
+    sort(vecEvents.begin(), vecEvents.end(), [](const sEvent &a, const sEvent &b)
+    {
+      return a.ang < b.ang || (a.ang == b.ang && !a.start && b.start);
+    });
 
-          bool bValid = false;
+    // Edge a is nearer than edge b if either lies entirely on one side of the other's line, and
+    // that side tells which is in front. This holds along every ray that crosses both.
+    auto orient = [](float ax, float ay, float bx, float by, float cx, float cy)
+    {
+      return (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+    };
+    auto nearer = [&](int a, int b)
+    {
+      if (a == b)
+        return false;
+      sEdge &ea = vecSweepEdges[a], &eb = vecSweepEdges[b];
+      float b1 = orient(ea.sx, ea.sy, ea.ex, ea.ey, eb.sx, eb.sy);
+      float b2 = orient(ea.sx, ea.sy, ea.ex, ea.ey, eb.ex, eb.ey);
+      if ((b1 >= 0.0f && b2 >= 0.0f) || (b1 <= 0.0f && b2 <= 0.0f))
+      {
+        float o = orient(ea.sx, ea.sy, ea.ex, ea.ey, ox, oy);
+        return (b1 + b2) * o < 0.0f;  // b is behind a's line as seen from the source.
+      }
+      float a1 = orient(eb.sx, eb.sy, eb.ex, eb.ey, ea.sx, ea.sy);
+      float a2 = orient(eb.sx, eb.sy, eb.ex, eb.ey, ea.ex, ea.ey);
+      float o = orient(eb.sx, eb.sy, eb.ex, eb.ey, ox, oy);
+      return (a1 + a2) * o > 0.0f;  // a is on the source's side of b's line.
+    };
+    std::set<int, decltype(nearer)> setActive(nearer);
+    std::vector<std::set<int, decltype(nearer)>::iterator> vecActive(vecSweepEdges.size(), setActive.end());
+    for (int i : vecInitial)
+      vecActive[i] = setActive.insert(i).first;
+
+    // Where the ray through (dx, dy), relative to the source, crosses an edge.
+    auto hit = [&](int i, float dx, float dy, float ang)
+    {
+      sEdge &e = vecSweepEdges[i];
+      float sdx = e.ex - e.sx, sdy = e.ey - e.sy;
+      float t = ((e.sx - ox) * sdy - (e.sy - oy) * sdx) / (dx * sdy - dy * sdx);
+      vecPoints.push_back({ ang, ox + dx * t, oy + dy * t });
+    };
+
+    int nearest = setActive.empty() ? -1 : *setActive.begin();
+    for (size_t i = 0; i < vecEvents.size(); )
+    {
+      // Handle all endpoints at this angle, ends before starts.
+      size_t j = i;
+      for (; j < vecEvents.size() && vecEvents[j].ang == vecEvents[i].ang; j++)
+      {
+        int edge = vecEvents[j].edge;
+        if (!vecEvents[j].start && vecActive[edge] != setActive.end())
+        {
+          setActive.erase(vecActive[edge]);
+          vecActive[edge] = setActive.end();
+        }
+        else if (vecEvents[j].start && vecActive[edge] == setActive.end())
+          vecActive[edge] = setActive.insert(edge).first;
+      }
 
-          // Check for ray intersection with all edges.
-          for (auto &e2 : vecEdges)
-          {
-            // Create line segment vector.
-            float sdx = e2.ex - e2.sx;
-            float sdy = e2.ey - e2.sy;
+      int new_nearest = setActive.empty() ? -1 : *setActive.begin();
+      if (new_nearest != nearest)
+      {
+        sEvent &ev = vecEvents[i];
+        sEdge &e = vecSweepEdges[ev.edge];
+        float dx = (ev.start ? e.sx : e.ex) - ox;
+        float dy = (ev.start ? e.sy : e.ey) - oy;
+        if (nearest >= 0)
+          hit(nearest, dx, dy, ev.ang);
+        if (new_nearest >= 0)
+          hit(new_nearest, dx, dy, ev.ang);
+        nearest = new_nearest;
+      }
+      i = j;
+    }
+  }
 
-            if (fabs(sdx - rdx) > 0.0f && fabs(sdy - rdy) > 0.0f)
-            {
-              // t2 is normalized distance from line segment start to interseection point.
-              float t2 = (rdx * (e2.sy - oy) + (rdy * (ox - e2.sx))) / (sdx * rdy - sdy * rdx);
-              // t1 is normalized distance from source along ray to interseection point.
-              float t1 = (e2.sx + sdx * t2 - ox) / rdx;
-
-              // If intersect point exists along ray, and along line
-              // segment, then intersection point is valid.
-              if (t1 > 0 && t2 >= 0 && t2 <= 1.0f)
-              {
-                // Check if this intersection point is closest to source. If
-                // it is, then store this point and reject others.
-                if (t1 < min_t1)
-                {
-                  min_t1 = t1;
-                  min_px = ox + rdx * t1;
-                  min_py = oy + rdy * t1;
-                  min_ang = atan2f(min_py - oy, min_px - ox);
-                  bValid = true;
-                }
-              }
-            }
-          }
+  void CalculateVisibilityPolygonByRayCasting(float ox, float oy, float radius, std::vector<std::tuple<float, float, float>> &vecPoints)
+  {
+    // Get rid of existing polygon
+    vecPoints.clear();
+
+    // For each distinct corner of the edges within the square of half size radius around the
+    // source, clipped to the square, and for the square's own corners, cast three rays, one
+    // directly at the point and one a little bit to either side. The side rays are the middle
+    // one rotated by 0.0001 radians. Rays end at the square, like the sweep's.
+    std::vector<sEdge> vecClipped;
+    GatherEdgesInSquare(ox, oy, radius, vecClipped);
+    std::vector<sCorner> vecCorners;
+    for (auto &e : vecClipped)
+    {
+      vecCorners.push_back({ e.sx, e.sy });
+      vecCorners.push_back({ e.ex, e.ey });
+    }
+    vecCorners.push_back({ ox - radius, oy - radius });
+    vecCorners.push_back({ ox + radius, oy - radius });
+    vecCorners.push_back({ ox + radius, oy + radius });
+    vecCorners.push_back({ ox - radius, oy + radius });
 
-          // Add intersection point to visibility polygon perimeter.
-          if (bValid)
-            vecVisibilityPolygonPoints.push_back({ min_ang, min_px, min_py });
+    // Most corners are shared by two edges.
+    sort(vecCorners.begin(), vecCorners.end(), [](const sCorner &a, const sCorner &b)
+    {
+      return a.y < b.y || (a.y == b.y && a.x < b.x);
+    });
+    auto it = unique(vecCorners.begin(), vecCorners.end(), [](const sCorner &a, const sCorner &b)
+    {
+      return a.x == b.x && a.y == b.y;
+    });
+    vecCorners.erase(it, vecCorners.end());
 
-        }
+    const float fCos = cosf(0.0001f), fSin = sinf(0.0001f);
+    for (auto &c : vecCorners)
+    {
+      float rdx = c.x - ox;
+      float rdy = c.y - oy;
+      if (rdx == 0.0f && rdy == 0.0f)
+        continue;
+      float ang = atan2f(rdy, rdx);
+
+      for (int j = 0; j < 3; j++)
+      {
+        float fRotSin = (j - 1) * fSin;
+        float fRotCos = (j == 1) ? 1.0f : fCos;
+        float dx = rdx * fRotCos - rdy * fRotSin;
+        float dy = rdx * fRotSin + rdy * fRotCos;
+
+        // Add the nearest intersection point to the visibility polygon perimeter. It lies on the
+        // ray, so its angle is the ray's.
+        float t1 = CastRay(ox, oy, dx, dy, radius / std::max(fabsf(dx), fabsf(dy)));
+        vecPoints.push_back({ ang + (j - 1) * 0.0001f, ox + dx * t1, oy + dy * t1 });
       }
     }
 
     // Sort perimeter points by angle from source. This will allow
     // us to draw a triangle fan.
     sort(
-         vecVisibilityPolygonPoints.begin(),
-         vecVisibilityPolygonPoints.end(),
+         vecPoints.begin(),
+         vecPoints.end(),
          [&](const std::tuple<float, float, float> &t1, const std::tuple<float, float, float> &t2)
          {
           return std::get<0>(t1) < std::get<0>(t2);
@@ -283,58 +1060,903 @@ private:
 
   }
 
-public:
-  bool OnUserCreate() override
+  void WorkerLoop()
   {
-    world = new sCell[nWorldWidth * nWorldHeight];
+    int nGeneration = 0;
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(muxWorkers);
+        cvWorkers.wait(lock, [&] { return bWorkersQuit || nWorkerGeneration != nGeneration; });
+        if (bWorkersQuit)
+          return;
+        nGeneration = nWorkerGeneration;
+      }
+      RunWorkerTasks();
+      {
+        std::lock_guard<std::mutex> lock(muxWorkers);
+        nWorkersBusy--;
+      }
+      cvWorkersDone.notify_one();
+    }
+  }
 
-    // Add a boundary to the world.
-    for (int x = 1; x < (nWorldWidth - 1); x++)
+  void RunWorkerTasks()
+  {
+    for (int i = nNextWorkerTask++; i < nWorkerTasks; i = nNextWorkerTask++)
+      fnWorkerTask(i);
+  }
+
+  void ParallelFor(int nCount, std::function<void(int)> fnBody)
+  {
+    // Calls fnBody for 0 to nCount - 1 on the workers and this thread, and returns when all are
+    // done. The calls take the next index as they finish, so uneven work balances out.
     {
-      world[1 * nWorldWidth + x].exist = true;
-      world[(nWorldHeight - 2) * nWorldWidth + x].exist = true;
+      std::lock_guard<std::mutex> lock(muxWorkers);
+      fnWorkerTask = fnBody;
+      nWorkerTasks = nCount;
+      nNextWorkerTask = 0;
+      nWorkersBusy = vecWorkers.size();
+      nWorkerGeneration++;
     }
-    for (int y = 1; y < (nWorldHeight - 1); y++)
+    cvWorkers.notify_all();
+    RunWorkerTasks();
+    std::unique_lock<std::mutex> lock(muxWorkers);
+    cvWorkersDone.wait(lock, [&] { return nWorkersBusy == 0; });
+  }
+
+  template<typename F>
+  void ScanPolygon(const std::vector<std::tuple<float, float, float>> &vecPoints, int nOriginX, int nOriginY, int nWidth,
+                   int nRowMin, int nRowMax, F fnSpan)
+  {
+    // Calls fnSpan(y, x0, x1) for the spans of target pixels from x0 to x1 inclusive whose
+    // centres lie inside the polygon, for rows nRowMin to nRowMax of a target nWidth pixels wide.
+    // The polygon is in window pixels, and the target's top left corner is window pixel
+    // (nOriginX, nOriginY), e.g. the current view for the screen. The polygon edges cross each
+    // row an even number of times, and the pixels between every other pair of crossings are
+    // inside. Pixels on a shared edge belong to one side only, so adding a polygon and then
+    // subtracting it leaves nothing behind.
+    // The crossings are bucketed by row, which keeps the sorting down to the few in each row.
+    if (nRowMin > nRowMax)
+      return;
+    std::vector<int> vecRowStart(nRowMax - nRowMin + 2, 0);
+    std::vector<float> vecCrossings;
+    size_t n = vecPoints.size();
+    for (int pass = 0; pass < 2; pass++)
+    {
+      for (size_t i = 0; i < n; i++)
+      {
+        float x0 = std::get<1>(vecPoints[i]) - nOriginX, y0 = std::get<2>(vecPoints[i]) - nOriginY;
+        float x1 = std::get<1>(vecPoints[(i + 1) % n]) - nOriginX, y1 = std::get<2>(vecPoints[(i + 1) % n]) - nOriginY;
+        if (y0 == y1)
+          continue;
+        if (y0 > y1)
+        {
+          std::swap(x0, x1);
+          std::swap(y0, y1);
+        }
+        // The rows whose centre y + 0.5 lies within [y0, y1).
+        int ya = std::max((int)ceilf(y0 - 0.5f), nRowMin);
+        int yb = std::min((int)ceilf(y1 - 0.5f) - 1, nRowMax);
+        if (pass == 0)
+        {
+          for (int y = ya; y <= yb; y++)
+            vecRowStart[y - nRowMin + 1]++;
+          continue;
+        }
+        float dxdy = (x1 - x0) / (y1 - y0);
+        for (int y = ya; y <= yb; y++)
+          vecCrossings[vecRowStart[y - nRowMin]++] = x0 + (y + 0.5f - y0) * dxdy;
+      }
+
+      // After counting, turn the counts into where each row's crossings start. Filling them in
+      // moves every start along to the next row's, so shift them back afterwards.
+      if (pass == 0)
+      {
+        for (size_t r = 1; r < vecRowStart.size(); r++)
+          vecRowStart[r] += vecRowStart[r - 1];
+        vecCrossings.resize(vecRowStart.back());
+      }
+      else
+      {
+        for (size_t r = vecRowStart.size() - 1; r > 0; r--)
+          vecRowStart[r] = vecRowStart[r - 1];
+        vecRowStart[0] = 0;
+      }
+    }
+
+    for (int y = nRowMin; y <= nRowMax; y++)
+    {
+      float *pRow = vecCrossings.data() + vecRowStart[y - nRowMin];
+      int nRow = vecRowStart[y - nRowMin + 1] - vecRowStart[y - nRowMin];
+      std::sort(pRow, pRow + nRow);
+      for (int i = 0; i + 1 < nRow; i += 2)
+      {
+        int x0 = std::max((int)ceilf(pRow[i] - 0.5f), 0);
+        int x1 = std::min((int)ceilf(pRow[i + 1] - 0.5f) - 1, nWidth - 1);
+        if (x0 <= x1)
+          fnSpan(y, x0, x1);
+      }
+    }
+  }
+
+  template<typename F>
+  void AccumulateLight(const std::vector<std::tuple<float, float, float>> &vecPolygon, float lx, float ly, float radius,
+                       olc::Pixel colour, int sign, int nOriginX, int nOriginY, int nWidth, int nRowMin, int nRowMax, F fnRun)
+  {
+    // Adds (or with sign -1, subtracts) a light within its visibility polygon to a buffer of
+    // three planes, whose top left corner is window pixel (nOriginX, nOriginY). fnRun(y, x, n,
+    // nPlane) returns where the red plane holds pixel (x, y), shortens n to the pixels from there
+    // that are stored in a row, and sets nPlane to how far the green and blue planes follow.
+    // Its intensity is 1 - d^2 / r^2 at distance d, which fades out smoothly towards the radius
+    // and needs no square root.
+    // The loops over a span are kept simple enough for the compiler to vectorise them.
+    lx -= nOriginX;
+    ly -= nOriginY;
+    float fScale = sign * 256.0f / (radius * radius);
+    std::vector<int> vecIntensity(nWidth);
+    ScanPolygon(vecPolygon, nOriginX, nOriginY, nWidth, nRowMin, nRowMax, [&](int y, int x0, int x1)
+    {
+      int n = x1 - x0 + 1;
+      int *pIntensity = vecIntensity.data();
+      float dy = y + 0.5f - ly;
+      float r2 = radius * radius - dy * dy;
+      float dx = x0 + 0.5f - lx;
+      for (int x = 0; x < n; x++)
+        pIntensity[x] = (int)(std::max(r2 - (dx + x) * (dx + x), 0.0f) * fScale);
+
+      int c[3] = { colour.r, colour.g, colour.b };
+      for (int x = x0; x <= x1; )
+      {
+        int nRun = x1 - x + 1, nPlane;
+        int *pAccum = fnRun(y, x, nRun, nPlane);
+        const int *pRunIntensity = pIntensity + (x - x0);
+        for (int k = 0; k < 3; k++, pAccum += nPlane)
+          for (int i = 0; i < nRun; i++)
+            pAccum[i] += c[k] * pRunIntensity[i];
+        x += nRun;
+      }
+    });
+  }
+
+  void ConvertLightRow(const int *pRed, int nPlane, olc::Pixel *pPixel, int n)
+  {
+    // From 8.8 fixed point to pixels, saturating.
+    const int *pGreen = pRed + nPlane, *pBlue = pGreen + nPlane;
+    for (int x = 0; x < n; x++)
+      pPixel[x] = olc::Pixel(std::min(pRed[x] >> 8, 255), std::min(pGreen[x] >> 8, 255), std::min(pBlue[x] >> 8, 255));
+  }
+
+  void UpdateLights()
+  {
+    // The accumulation buffer is in screen pixels, so once the view moves it is made again. The
+    // lightmap is in window pixels, and is left as it is.
+    if (nViewX != nLightsViewX || nViewY != nLightsViewY)
+      ResetLightAccumulation();
+
+    // Find the lights that changed since they were last added. Lights that are not added and
+    // don't reach their buffer, the screen or for baked lights the window, can wait until they do.
+    int nWindowWidth = nWorldWidth * fBlockWidth, nWindowHeight = nWorldHeight * fBlockWidth;
+    std::vector<int> vecChanged;
+    bool bChangedBaked = false;
+    for (int i = 0; i < (int)vecLights.size(); i++)
+    {
+      sLight &l = vecLights[i];
+      int nLeft = l.bStatic ? 0 : nViewX, nTop = l.bStatic ? 0 : nViewY;
+      int nRight = l.bStatic ? nWindowWidth : nViewX + ScreenWidth(), nBottom = l.bStatic ? nWindowHeight : nViewY + ScreenHeight();
+      bool bReaches = l.x + l.radius >= nLeft && l.x - l.radius <= nRight && l.y + l.radius >= nTop && l.y - l.radius <= nBottom;
+      if (!l.bApplied && !bReaches)
+        continue;
+      if (!l.bApplied || l.bInvalid || l.x != l.applied_x || l.y != l.applied_y || l.radius != l.applied_radius || l.colour != l.applied_colour)
+      {
+        vecChanged.push_back(i);
+        bChangedBaked |= l.bStatic;
+      }
+    }
+    nLightsUpdated = vecChanged.size();
+    if (vecChanged.empty())
+      return;
+
+    // Their new visibility polygons and lit regions, a light per task. Lights that are only added
+    // again, because the view moved, keep theirs.
+    std::vector<std::vector<std::tuple<float, float, float>>> vecNewPolygons(vecChanged.size());
+    std::vector<sLitRegion> vecNewRegions(vecChanged.size());
+    ParallelFor(vecChanged.size(), [&](int i)
+    {
+      sLight &l = vecLights[vecChanged[i]];
+      if (!l.bInvalid && !l.vecPolygon.empty() && l.x == l.applied_x && l.y == l.applied_y && l.radius == l.applied_radius)
+      {
+        vecNewPolygons[i] = l.vecPolygon;
+        vecNewRegions[i] = l.lit;
+        return;
+      }
+      CalculateVisibilityPolygon(l.x, l.y, l.radius, vecNewPolygons[i]);
+      vecNewRegions[i] = { l.x, l.y, l.x, l.y };
+      for (auto &p : vecNewPolygons[i])
+      {
+        vecNewRegions[i].left = std::min(vecNewRegions[i].left, std::get<1>(p));
+        vecNewRegions[i].top = std::min(vecNewRegions[i].top, std::get<2>(p));
+        vecNewRegions[i].right = std::max(vecNewRegions[i].right, std::get<1>(p));
+        vecNewRegions[i].bottom = std::max(vecNewRegions[i].bottom, std::get<2>(p));
+      }
+    });
+
+    // Take their old contributions out and add the new ones, a band of rows per task so no two
+    // tasks write the same pixels. Then refresh the rows of the sprite that were touched.
+    const int nBandRows = 16;
+    ParallelFor((ScreenHeight() + nBandRows - 1) / nBandRows, [&](int b)
+    {
+      int y0 = b * nBandRows, y1 = std::min(y0 + nBandRows, ScreenHeight()) - 1;
+      auto fnRun = [&](int y, int x, int &, int &nPlane)
+      {
+        nPlane = ScreenWidth() * ScreenHeight();
+        return &vecLightAccum[y * ScreenWidth() + x];
+      };
+      bool bTouched = false;
+      for (int i = 0; i < (int)vecChanged.size(); i++)
+      {
+        sLight &l = vecLights[vecChanged[i]];
+        if (l.bStatic)
+          continue;
+        if (l.bApplied && l.lit.bottom - nViewY >= y0 && l.lit.top - nViewY <= y1 + 1)
+        {
+          AccumulateLight(l.vecPolygon, l.applied_x, l.applied_y, l.applied_radius, l.applied_colour, -1,
+                          nViewX, nViewY, ScreenWidth(), y0, y1, fnRun);
+          bTouched = true;
+        }
+        if (vecNewRegions[i].bottom - nViewY >= y0 && vecNewRegions[i].top - nViewY <= y1 + 1)
+        {
+          AccumulateLight(vecNewPolygons[i], l.x, l.y, l.radius, l.colour, 1, nViewX, nViewY, ScreenWidth(), y0, y1, fnRun);
+          bTouched = true;
+        }
+      }
+      if (!bTouched)
+        return;
+      for (int y = y0; y <= y1; y++)
+        ConvertLightRow(&vecLightAccum[y * ScreenWidth()], ScreenWidth() * ScreenHeight(),
+                        buffLightAccum->GetData() + y * ScreenWidth(), ScreenWidth());
+    });
+
+    // Baked lights go into the lightmap the same way, a row of tiles per task. A tile gets its
+    // buffers when a light first reaches it, and only the touched tiles are converted.
+    if (bChangedBaked)
+      ParallelFor(nLightmapTilesY, [&](int ty)
+      {
+        int y0 = ty * nLightmapTile, y1 = y0 + nLightmapTile - 1;
+        sLightmapTile *pTiles = &vecLightmapTiles[ty * nLightmapTilesX];
+        std::vector<char> vecTouched(nLightmapTilesX, 0);
+        auto fnRun = [&](int y, int x, int &n, int &nPlane)
+        {
+          sLightmapTile &tile = pTiles[x / nLightmapTile];
+          if (tile.vecAccum.empty())
+          {
+            tile.vecAccum.assign(3 * nLightmapTile * nLightmapTile, 0);
+            tile.vecPixels.assign(nLightmapTile * nLightmapTile, olc::BLACK);
+          }
+          vecTouched[x / nLightmapTile] = 1;
+          n = std::min(n, nLightmapTile - x % nLightmapTile);
+          nPlane = nLightmapTile * nLightmapTile;
+          return &tile.vecAccum[(y - y0) * nLightmapTile + x % nLightmapTile];
+        };
+        for (int i = 0; i < (int)vecChanged.size(); i++)
+        {
+          sLight &l = vecLights[vecChanged[i]];
+          if (!l.bStatic)
+            continue;
+          if (l.bApplied && l.lit.bottom >= y0 && l.lit.top <= y1 + 1)
+            AccumulateLight(l.vecPolygon, l.applied_x, l.applied_y, l.applied_radius, l.applied_colour, -1,
+                            0, 0, nLightmapTilesX * nLightmapTile, y0, y1, fnRun);
+          if (vecNewRegions[i].bottom >= y0 && vecNewRegions[i].top <= y1 + 1)
+            AccumulateLight(vecNewPolygons[i], l.x, l.y, l.radius, l.colour, 1, 0, 0, nLightmapTilesX * nLightmapTile, y0, y1, fnRun);
+        }
+        for (int tx = 0; tx < nLightmapTilesX; tx++)
+          if (vecTouched[tx])
+            ConvertLightRow(pTiles[tx].vecAccum.data(), nLightmapTile * nLightmapTile, pTiles[tx].vecPixels.data(), nLightmapTile * nLightmapTile);
+      });
+
+    for (int i = 0; i < (int)vecChanged.size(); i++)
+    {
+      sLight &l = vecLights[vecChanged[i]];
+      l.vecPolygon.swap(vecNewPolygons[i]);
+      l.lit = vecNewRegions[i];
+      l.applied_x = l.x;
+      l.applied_y = l.y;
+      l.applied_radius = l.radius;
+      l.applied_colour = l.colour;
+      l.bApplied = true;
+      l.bInvalid = false;
+    }
+  }
+
+  void ResetLightAccumulation()
+  {
+    // Takes all lights but the baked ones out of the accumulation buffer at once, they are added
+    // again by the next UpdateLights.
+    std::fill(vecLightAccum.begin(), vecLightAccum.end(), 0);
+    std::fill(buffLightAccum->pColData.begin(), buffLightAccum->pColData.end(), olc::BLACK);
+    for (auto &l : vecLights)
+      if (!l.bStatic)
+        l.bApplied = false;
+    nLightsViewX = nViewX;
+    nLightsViewY = nViewY;
+  }
+
+  void ResetLightmap()
+  {
+    // Takes the baked lights out of the lightmap and frees its tiles, for when the window moves.
+    for (auto &tile : vecLightmapTiles)
+      tile = sLightmapTile();
+    for (auto &l : vecLights)
+      if (l.bStatic)
+        l.bApplied = false;
+  }
+
+  void DrawLights()
+  {
+    // Copies the part of the lightmap on the screen, then adds the other lights on top, with
+    // each channel saturating.
+    olc::Pixel *pScreen = GetDrawTarget()->GetData();
+    bool bMoving = std::any_of(vecLights.begin(), vecLights.end(), [](const sLight &l) { return !l.bStatic && l.bApplied; });
+    for (int y = 0; y < ScreenHeight(); y++)
+    {
+      olc::Pixel *pRow = pScreen + y * ScreenWidth();
+      int wy = y + nViewY;
+      for (int x = 0; x < ScreenWidth(); )
+      {
+        int wx = x + nViewX;
+        int n = std::min(ScreenWidth() - x, nLightmapTile - wx % nLightmapTile);
+        sLightmapTile *pTile = nullptr;
+        if (wx >= 0 && wy >= 0 && wx < nLightmapTilesX * nLightmapTile && wy < nLightmapTilesY * nLightmapTile)
+          pTile = &vecLightmapTiles[(wy / nLightmapTile) * nLightmapTilesX + wx / nLightmapTile];
+        else
+          n = 1;
+        if (pTile && !pTile->vecPixels.empty())
+          CopyPixels(pRow + x, &pTile->vecPixels[(wy % nLightmapTile) * nLightmapTile + wx % nLightmapTile], n);
+        else
+          std::fill(pRow + x, pRow + x + n, olc::BLACK);
+        x += n;
+      }
+      if (bMoving)
+        AddPixels(pRow, buffLightAccum->GetData() + y * ScreenWidth(), ScreenWidth());
+    }
+  }
+
+  void InvalidateLights(const std::vector<int> &vecTiles)
+  {
+    // Lights whose lit region touches an edited tile need their visibility calculated again.
+    // A tile entirely in a light's shadow can't change what it sees, and the tiles that cast the
+    // shadow touch the lit area. Lights taken out while off screen keep their polygon for when
+    // they come back, so they are tested too; lights without one are calculated anyway.
+    for (auto &l : vecLights)
+      for (int i : vecTiles)
+      {
+        float tx = (i % nWorldWidth) * fBlockWidth, ty = (i / nWorldWidth) * fBlockWidth;
+        if (!l.vecPolygon.empty() && tx <= l.lit.right && tx + fBlockWidth >= l.lit.left && ty <= l.lit.bottom && ty + fBlockWidth >= l.lit.top)
+          l.bInvalid = true;
+      }
+  }
+
+  void AddLight(float x, float y)
+  {
+    sLight l;
+    l.x = x;
+    l.y = y;
+    l.radius = 64.0f + rand() % 128;
+    l.colour = olc::Pixel(64 + rand() % 192, 64 + rand() % 192, 64 + rand() % 192);
+    l.vx = (rand() % 101 - 50) * 1.0f;
+    l.vy = (rand() % 101 - 50) * 1.0f;
+    vecLights.push_back(l);
+  }
+
+  void CopyPixels(olc::Pixel *pDst, const olc::Pixel *pSrc, int n)
+  {
+    // Copies a row of pixels, 8 at a time with AVX and 4 with SSE.
+    int i = 0;
+#if defined(OLCSHADOWCASTING2D_SIMD_AVX)
+    for (; i + 8 <= n; i += 8)
+      _mm256_storeu_ps((float *)(pDst + i), _mm256_loadu_ps((const float *)(pSrc + i)));
+#elif defined(OLCSHADOWCASTING2D_SIMD_SSE)
+    for (; i + 4 <= n; i += 4)
+      _mm_storeu_ps((float *)(pDst + i), _mm_loadu_ps((const float *)(pSrc + i)));
+#endif
+    for (; i < n; i++)
+      pDst[i] = pSrc[i];
+  }
+
+  void AddPixels(olc::Pixel *pDst, const olc::Pixel *pSrc, int n)
+  {
+    // Adds a row of pixels channel by channel, saturating. A plain loop over the bytes, which the
+    // compiler turns into saturating vector adds.
+    uint8_t *pDstBytes = (uint8_t *)pDst;
+    const uint8_t *pSrcBytes = (const uint8_t *)pSrc;
+    for (int i = 0; i < 4 * n; i++)
+      pDstBytes[i] = std::min(pDstBytes[i] + pSrcBytes[i], 255);
+  }
+
+  void DrawLightSpans(const std::vector<std::tuple<float, float, float>> &vecPolygon, float lx, float ly)
+  {
+    // Copies sprLightCast, centred on the light, into the draw target for the spans of the
+    // visibility polygon. Pixels of the polygon beyond the sprite are black.
+    olc::Sprite *pTarget = GetDrawTarget();
+    int nLeft = lx - nViewX - 255, nTop = ly - nViewY - 255;
+    ScanPolygon(vecPolygon, nViewX, nViewY, pTarget->width, 0, pTarget->height - 1, [&](int y, int x0, int x1)
+    {
+      olc::Pixel *pDst = pTarget->GetData() + y * pTarget->width;
+      int ty = y - nTop;
+      if (ty < 0 || ty >= sprLightCast->height)
+      {
+        std::fill(pDst + x0, pDst + x1 + 1, olc::BLACK);
+        return;
+      }
+      int xa = std::clamp(nLeft, x0, x1 + 1);
+      int xb = std::clamp(nLeft + sprLightCast->width, x0, x1 + 1);
+      std::fill(pDst + x0, pDst + xa, olc::BLACK);
+      CopyPixels(pDst + xa, sprLightCast->GetData() + ty * sprLightCast->width + xa - nLeft, xb - xa);
+      std::fill(pDst + xb, pDst + x1 + 1, olc::BLACK);
+    });
+  }
+
+  void WriteVarint(std::vector<uint8_t> &vecOut, uint32_t n)
+  {
+    // Seven bits per byte, lowest first, with the top bit set on all but the last byte.
+    while (n >= 0x80)
+    {
+      vecOut.push_back((n & 0x7f) | 0x80);
+      n >>= 7;
+    }
+    vecOut.push_back(n);
+  }
+
+  bool ReadVarint(const uint8_t *&p, const uint8_t *pEnd, uint32_t &n)
+  {
+    n = 0;
+    for (int shift = 0; p < pEnd && shift < 32; shift += 7)
+    {
+      uint8_t b = *p++;
+      n |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  void EncodeChunk(const uint64_t *pRows, std::vector<uint8_t> &vecOut)
+  {
+    // A chunk is stored as the lengths of the runs of empty and solid tiles, alternately and
+    // starting with empty, going through the tiles row by row.
+    const int nTiles = nChunkTiles * nChunkTiles;
+    bool bSolid = false;
+    for (int pos = 0; pos < nTiles; bSolid = !bSolid)
+    {
+      int next = NextBit(pRows, nChunkTiles, pos, !bSolid);
+      WriteVarint(vecOut, next - pos);
+      pos = next;
+    }
+  }
+
+  bool DecodeChunk(const uint8_t *p, const uint8_t *pEnd, uint64_t *pRows)
+  {
+    const int nTiles = nChunkTiles * nChunkTiles;
+    std::fill(pRows, pRows + nChunkTiles, 0);
+    bool bSolid = false;
+    for (int pos = 0; pos < nTiles; bSolid = !bSolid)
+    {
+      uint32_t n;
+      if (!ReadVarint(p, pEnd, n) || n > (uint32_t)(nTiles - pos))
+        return false;
+      if (!bSolid)
+      {
+        pos += n;
+        continue;
+      }
+      for (int end = pos + n; pos < end; )
+      {
+        int m = std::min(64 - (pos & 63), end - pos);
+        pRows[pos >> 6] |= (m == 64 ? ~0ull : (1ull << m) - 1) << (pos & 63);
+        pos += m;
+      }
+    }
+    return true;
+  }
+
+  bool WriteMapFile(const std::string &sFilename, int nChunksX, int nChunksY, std::function<void(int, int, uint64_t *)> fnChunk)
+  {
+    // A map file starts with "SC2D" and the number of chunks across, down and the tiles along a
+    // chunk's side as 32-bit integers. Then come, for chunk (x, y) at index y * nChunksX + x,
+    // the 64-bit offsets into the file where each chunk's runs start, followed by the offset of
+    // the end of the last one, and then the runs of all chunks. Numbers are little-endian.
+    // fnChunk(x, y, rows) fills in the rows of a chunk.
+    std::ofstream f(sFilename, std::ios::binary);
+    if (!f.is_open())
+      return false;
+    uint32_t header[3] = { (uint32_t)nChunksX, (uint32_t)nChunksY, (uint32_t)nChunkTiles };
+    f.write("SC2D", 4);
+    f.write((const char *)header, sizeof(header));
+
+    std::vector<uint64_t> vecOffsets(nChunksX * nChunksY + 1);
+    uint64_t nOffset = 16 + vecOffsets.size() * 8;
+    f.seekp(nOffset);
+    std::vector<uint8_t> vecRuns;
+    uint64_t rows[nChunkTiles];
+    for (int i = 0; i < nChunksX * nChunksY; i++)
+    {
+      fnChunk(i % nChunksX, i / nChunksX, rows);
+      vecRuns.clear();
+      EncodeChunk(rows, vecRuns);
+      f.write((const char *)vecRuns.data(), vecRuns.size());
+      vecOffsets[i] = nOffset;
+      nOffset += vecRuns.size();
+    }
+    vecOffsets.back() = nOffset;
+    f.seekp(16);
+    f.write((const char *)vecOffsets.data(), vecOffsets.size() * 8);
+    return f.good();
+  }
+
+  bool OpenMapFile(const std::string &sFilename)
+  {
+    // Maps the map file into memory, so only the parts of it the chunks are decoded from are
+    // ever read, and the operating system can drop them again when memory gets tight.
+    CloseMapFile();
+#if defined(_WIN32)
+    hMapFile = CreateFileA(sFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (hMapFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hMapFile, &size))
+    {
+      CloseMapFile();
+      return false;
+    }
+    nMapSize = size.QuadPart;
+    hMapMapping = CreateFileMappingA(hMapFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (hMapMapping)
+      pMapData = (const uint8_t *)MapViewOfFile(hMapMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    nMapFile = open(sFilename.c_str(), O_RDONLY);
+    struct stat st;
+    if (nMapFile < 0 || fstat(nMapFile, &st) != 0)
+    {
+      CloseMapFile();
+      return false;
+    }
+    nMapSize = st.st_size;
+    void *pData = nMapSize > 0 ? mmap(nullptr, nMapSize, PROT_READ, MAP_PRIVATE, nMapFile, 0) : MAP_FAILED;
+    if (pData != MAP_FAILED)
+      pMapData = (const uint8_t *)pData;
+#endif
+
+    uint32_t header[3];
+    if (!pMapData || nMapSize < 16 || memcmp(pMapData, "SC2D", 4) != 0)
+    {
+      CloseMapFile();
+      return false;
+    }
+    memcpy(header, pMapData + 4, sizeof(header));
+    if (header[0] == 0 || header[1] == 0 || header[2] != nChunkTiles || ((uint64_t)header[0] * header[1] + 1) * 8 > nMapSize - 16)
+    {
+      CloseMapFile();
+      return false;
+    }
+    nMapChunksX = header[0];
+    nMapChunksY = header[1];
+    return true;
+  }
+
+  void CloseMapFile()
+  {
+#if defined(_WIN32)
+    if (pMapData)
+      UnmapViewOfFile(pMapData);
+    if (hMapMapping)
+      CloseHandle(hMapMapping);
+    if (hMapFile != INVALID_HANDLE_VALUE)
+      CloseHandle(hMapFile);
+    hMapMapping = nullptr;
+    hMapFile = INVALID_HANDLE_VALUE;
+#else
+    if (pMapData)
+      munmap((void *)pMapData, nMapSize);
+    if (nMapFile >= 0)
+      close(nMapFile);
+    nMapFile = -1;
+#endif
+    pMapData = nullptr;
+    nMapSize = 0;
+  }
+
+  sChunk &GetChunk(int cx, int cy)
+  {
+    // Returns a chunk of the map, decoding it if it isn't in memory. Beyond nMaxChunks the least
+    // recently used chunk is dropped. A chunk that can't be decoded is left empty.
+    auto key = std::make_pair(cx, cy);
+    auto it = mapChunks.find(key);
+    if (it != mapChunks.end())
+    {
+      listChunkUse.splice(listChunkUse.begin(), listChunkUse, it->second.itUse);
+      return it->second;
+    }
+
+    if (mapChunks.size() >= nMaxChunks)
     {
-      world[y * nWorldWidth + 1].exist = true;
-      world[y * nWorldWidth + (nWorldWidth - 2)].exist = true;
+      auto oldest = mapChunks.find(listChunkUse.back());
+      if (oldest->second.bEdited)
+      {
+        std::vector<uint8_t> &vecRuns = mapEditedChunks[oldest->first];
+        vecRuns.clear();
+        EncodeChunk(oldest->second.rows, vecRuns);
+      }
+      mapChunks.erase(oldest);
+      listChunkUse.pop_back();
     }
 
-    // Calculate initial poly map.
-    ConvertTileMapToPolyMap(0, 0, nWorldWidth, nWorldHeight, fBlockWidth, nWorldWidth);
+    sChunk &chunk = mapChunks[key];
+    listChunkUse.push_front(key);
+    chunk.itUse = listChunkUse.begin();
+    auto edited = mapEditedChunks.find(key);
+    if (edited != mapEditedChunks.end())
+    {
+      DecodeChunk(edited->second.data(), edited->second.data() + edited->second.size(), chunk.rows);
+      chunk.bEdited = true;
+      mapEditedChunks.erase(edited);
+      return chunk;
+    }
+    uint64_t offsets[2];
+    memcpy(offsets, pMapData + 16 + 8 * ((size_t)cy * nMapChunksX + cx), sizeof(offsets));
+    if (offsets[0] > offsets[1] || offsets[1] > nMapSize || !DecodeChunk(pMapData + offsets[0], pMapData + offsets[1], chunk.rows))
+      std::fill(chunk.rows, chunk.rows + nChunkTiles, 0);
+    return chunk;
+  }
+
+  void MoveWindow(int cx, int cy)
+  {
+    // Makes the window start at chunk (cx, cy). The old window's tiles go back to their chunks,
+    // and the new window's are copied from theirs. Chunks beyond the map are solid. Then the poly
+    // map is converted again for the whole window, which joins up the edges running across chunk
+    // borders, as if the world were one tile map.
+    auto in_map = [&](int x, int y) { return x >= 0 && y >= 0 && x < nMapChunksX && y < nMapChunksY; };
+    for (int j = 0; j < nWindowChunks && bWindowLoaded; j++)
+      for (int i = 0; i < nWindowChunks; i++)
+      {
+        if (!in_map(nWindowChunkX + i, nWindowChunkY + j))
+          continue;
+        sChunk &chunk = GetChunk(nWindowChunkX + i, nWindowChunkY + j);
+        for (int y = 0; y < nChunkTiles; y++)
+        {
+          uint64_t word = vecWorld[(j * nChunkTiles + y) * nWorldWords + i];
+          if (chunk.rows[y] != word)
+          {
+            chunk.rows[y] = word;
+            chunk.bEdited = true;
+          }
+        }
+      }
+
+    for (int j = 0; j < nWindowChunks; j++)
+      for (int i = 0; i < nWindowChunks; i++)
+      {
+        const uint64_t *pRows = in_map(cx + i, cy + j) ? GetChunk(cx + i, cy + j).rows : nullptr;
+        for (int y = 0; y < nChunkTiles; y++)
+          vecWorld[(j * nChunkTiles + y) * nWorldWords + i] = pRows ? pRows[y] : ~0ull;
+      }
+
+    // Window pixels move with the window.
+    float dx = (float)(cx - nWindowChunkX) * nChunkTiles * fBlockWidth;
+    float dy = (float)(cy - nWindowChunkY) * nChunkTiles * fBlockWidth;
+    for (auto &l : vecLights)
+    {
+      l.x -= dx;
+      l.y -= dy;
+      l.bInvalid = true;
+    }
+    nWindowChunkX = cx;
+    nWindowChunkY = cy;
+    bWindowLoaded = true;
+    ConvertTileMapToPolyMap(0, 0, nWorldWidth, nWorldHeight, fBlockWidth);
+    ResetLightAccumulation();
+    ResetLightmap();
+  }
+
+  void FollowCamera()
+  {
+    // Keeps the camera on the map, and the screen centre in the window's middle chunk.
+    int nChunkPixels = nChunkTiles * fBlockWidth;
+    fCameraX = std::clamp(fCameraX, 0.0f, (float)nMapChunksX * nChunkPixels - ScreenWidth());
+    fCameraY = std::clamp(fCameraY, 0.0f, (float)nMapChunksY * nChunkPixels - ScreenHeight());
+    int cx = (int)floorf((fCameraX + ScreenWidth() / 2) / nChunkPixels) - nWindowChunks / 2;
+    int cy = (int)floorf((fCameraY + ScreenHeight() / 2) / nChunkPixels) - nWindowChunks / 2;
+    if (!bWindowLoaded || cx != nWindowChunkX || cy != nWindowChunkY)
+      MoveWindow(cx, cy);
+    nViewX = (int)floorf(fCameraX) - nWindowChunkX * nChunkPixels;
+    nViewY = (int)floorf(fCameraY) - nWindowChunkY * nChunkPixels;
+  }
+
+  bool GenerateTile(int x, int y)
+  {
+    // The demo world, rooms of 32 x 32 tiles with a door in each wall and the odd pillar.
+    auto hash = [](uint32_t a, uint32_t b)
+    {
+      uint32_t h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u) * 0x85EBCA77u;
+      h ^= h >> 15;
+      h *= 0xC2B2AE3Du;
+      return h ^ (h >> 13);
+    };
+    int rx = x / 32, ry = y / 32, lx = x % 32, ly = y % 32;
+    if (ly == 0)
+    {
+      int door = 4 + hash(rx, ry * 2) % 24;
+      return lx < door || lx >= door + 3;
+    }
+    if (lx == 0)
+    {
+      int door = 4 + hash(rx, ry * 2 + 1) % 24;
+      return ly < door || ly >= door + 3;
+    }
+    uint32_t h = hash(rx + 12345, ry);
+    int px = 6 + h % 18, py = 6 + (h >> 8) % 18;
+    return (h >> 16) % 3 == 0 && lx >= px && lx < px + 3 && ly >= py && ly < py + 3;
+  }
+
+public:
+  bool OnUserCreate() override
+  {
+    nWorldWidth = nWindowChunks * nChunkTiles;
+    nWorldHeight = nWindowChunks * nChunkTiles;
+    nWorldWords = (nWorldWidth + 63) / 64;
+    vecWorld.assign(nWorldWords * nWorldHeight, 0);
 
     // Load light source sprite and buffers.
     sprLightCast = new olc::Sprite("light_cast.png");
-    buffLightRay = new olc::Sprite(ScreenWidth(), ScreenHeight());
-    buffLightTex = new olc::Sprite(ScreenWidth(), ScreenHeight());
+    buffLightAccum = new olc::Sprite(ScreenWidth(), ScreenHeight());
+    vecLightAccum.assign(3 * ScreenWidth() * ScreenHeight(), 0);
+    nLightmapTilesX = (nWorldWidth * fBlockWidth + nLightmapTile - 1) / nLightmapTile;
+    nLightmapTilesY = (nWorldHeight * fBlockWidth + nLightmapTile - 1) / nLightmapTile;
+    vecLightmapTiles.assign(nLightmapTilesX * nLightmapTilesY, sLightmapTile());
+
+    // Open the world, making up one of 128 x 128 chunks the first time. A map file that exists
+    // but can't be opened is left alone. Start in the world's middle, which loads the window and
+    // calculates the initial poly map.
+    if (!OpenMapFile("world.map"))
+    {
+      if (std::ifstream("world.map").good())
+        return false;
+      int nTiles = 128 * nChunkTiles;
+      WriteMapFile("world.map", 128, 128, [&](int cx, int cy, uint64_t *pRows)
+      {
+        for (int y = 0; y < nChunkTiles; y++)
+        {
+          pRows[y] = 0;
+          for (int x = 0; x < nChunkTiles; x++)
+          {
+            int wx = cx * nChunkTiles + x, wy = cy * nChunkTiles + y;
+            if (wx == nTiles - 1 || wy == nTiles - 1 || GenerateTile(wx, wy))
+              pRows[y] |= 1ull << x;
+          }
+        }
+      });
+      if (!OpenMapFile("world.map"))
+        return false;
+    }
+    fCameraX = (nMapChunksX * nChunkTiles * fBlockWidth - ScreenWidth()) / 2.0f;
+    fCameraY = (nMapChunksY * nChunkTiles * fBlockWidth - ScreenHeight()) / 2.0f;
+    FollowCamera();
+
+    // This thread takes part in ParallelFor too.
+    int nThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+    for (int i = 1; i < nThreads; i++)
+      vecWorkers.push_back(std::thread(&olcShadowCasting2D::WorkerLoop, this));
 
     return true;
   }
 
   bool OnUserUpdate(float fElapsedTime) override
   {
-    float fSourceX = GetMouseX();
-    float fSourceY = GetMouseY();
+    // Scroll with the arrow keys, faster with shift held.
+    float fScrollSpeed = GetKey(olc::Key::SHIFT).bHeld ? 2000.0f : 400.0f;
+    if (GetKey(olc::Key::LEFT).bHeld)
+      fCameraX -= fScrollSpeed * fElapsedTime;
+    if (GetKey(olc::Key::RIGHT).bHeld)
+      fCameraX += fScrollSpeed * fElapsedTime;
+    if (GetKey(olc::Key::UP).bHeld)
+      fCameraY -= fScrollSpeed * fElapsedTime;
+    if (GetKey(olc::Key::DOWN).bHeld)
+      fCameraY += fScrollSpeed * fElapsedTime;
+    FollowCamera();
+
+    // The mouse in window pixels.
+    float fSourceX = GetMouseX() + nViewX;
+    float fSourceY = GetMouseY() + nViewY;
+
+    // Set tile map blocks to on or off. Clicking toggles a block, dragging paints every block
+    // passed over the same way.
+    if (GetMouse(0).bPressed || GetMouse(0).bHeld)
+    {
+      int x = (int)fSourceX / (int)fBlockWidth;
+      int y = (int)fSourceY / (int)fBlockWidth;
+      if (x >= 0 && y >= 0 && x < nWorldWidth && y < nWorldHeight)
+      {
+        if (GetMouse(0).bPressed)
+          bPaintValue = !GetTile(x, y);
+        if (GetTile(x, y) != bPaintValue)
+        {
+          SetTile(x, y, bPaintValue);
+          vecEditedTiles.push_back(y * nWorldWidth + x);  // i = y * width + x
+        }
+      }
+    }
+    if (!vecEditedTiles.empty())
+    {
+      UpdatePolyMap(vecEditedTiles, fBlockWidth);
+      InvalidateLights(vecEditedTiles);
+      vecEditedTiles.clear();
+    }
 
-    // Set tile map blocks to on or off.
-    if (GetMouse(0).bReleased)
+    if (GetKey(olc::Key::L).bPressed)
     {
-      // i = y * width + x
-      int i = ((int)fSourceY / (int)fBlockWidth) * nWorldWidth + ((int)fSourceX / (int)fBlockWidth);
-      world[i].exist = !world[i].exist;
-      ConvertTileMapToPolyMap(0, 0, nWorldWidth, nWorldHeight, fBlockWidth, nWorldWidth);
+      bLegacyRayCasting = !bLegacyRayCasting;
+      ClearVisibilityCache();
     }
 
-    // Update visibility polygon perimeter if right mouse button held.
+    // Place lights: A adds one at the mouse, R adds a hundred around the map, C removes them all
+    // and M sets them moving or stops them. B bakes the lights placed so far, which then stay
+    // where they are in a lightmap of their own, and are only calculated again when a tile within
+    // their lit region changes or the window moves.
+    if (GetKey(olc::Key::A).bPressed)
+      AddLight(fSourceX, fSourceY);
+    if (GetKey(olc::Key::R).bPressed)
+      for (int i = 0; i < 100; i++)
+        AddLight(nViewX + rand() % ScreenWidth(), nViewY + rand() % ScreenHeight());
+    if (GetKey(olc::Key::C).bPressed)
+    {
+      vecLights.clear();
+      ResetLightAccumulation();
+      ResetLightmap();
+    }
+    if (GetKey(olc::Key::B).bPressed)
+    {
+      // The lights move from the accumulation buffer into the lightmap.
+      ResetLightAccumulation();
+      for (auto &l : vecLights)
+        l.bStatic = true;
+    }
+    if (GetKey(olc::Key::M).bPressed)
+      bMoveLights = !bMoveLights;
+    if (bMoveLights)
+      for (auto &l : vecLights)
+      {
+        if (l.bStatic)
+          continue;
+
+        // Bounce off the edges of the screen.
+        l.x += l.vx * fElapsedTime;
+        l.y += l.vy * fElapsedTime;
+        if (l.x < nViewX || l.x >= nViewX + ScreenWidth())
+          l.vx = -l.vx;
+        if (l.y < nViewY || l.y >= nViewY + ScreenHeight())
+          l.vy = -l.vy;
+        l.x = std::clamp(l.x, (float)nViewX, nViewX + ScreenWidth() - 1.0f);
+        l.y = std::clamp(l.y, (float)nViewY, nViewY + ScreenHeight() - 1.0f);
+      }
+
+    auto tpLights = std::chrono::steady_clock::now();
+    UpdateLights();
+    fLightsMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpLights).count();
+
+    // Update visibility polygon perimeter if right mouse button held. The radius is that of the
+    // light sprite, nothing beyond it is lit.
     if (GetMouse(1).bHeld)
     {
-      CalculateVisibilityPolygon(fSourceX, fSourceY, 1000.0f);
+      auto tpStart = std::chrono::steady_clock::now();
+      vecVisibilityPolygonPoints = GetCachedVisibilityPolygon(fSourceX, fSourceY, 256.0f);
+      fVisibilityMicroseconds = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - tpStart).count();
     }
 
     // Drawing.
     SetDrawTarget(nullptr);
     Clear(olc::BLACK);
 
+    // The placed lights, copied straight over the cleared screen.
+    if (!vecLights.empty())
+      DrawLights();
+
     int nRaysCast = vecVisibilityPolygonPoints.size();
 
     auto it = unique(
@@ -348,71 +1970,43 @@ public:
 
     int nRaysCast2 = vecVisibilityPolygonPoints.size();
     DrawString(4, 4, "Rays Cast: " + std::to_string(nRaysCast) + ", Rays Drawn: " + std::to_string(nRaysCast2));
+    DrawString(4, 14, std::string(bLegacyRayCasting ? "Ray casting" : "Angular sweep") + ": " + std::to_string((int)fVisibilityMicroseconds) + " us" + (bVisibilityCacheHit ? ", cached" : "") + " (L to switch)");
+    int nBaked = std::count_if(vecLights.begin(), vecLights.end(), [](const sLight &l) { return l.bStatic; });
+    DrawString(4, 24, "Lights: " + std::to_string(vecLights.size()) + " (" + std::to_string(nBaked) + " baked), updated " + std::to_string(nLightsUpdated) + " in " + std::to_string(fLightsMilliseconds) + " ms (A, R, C, M, B)");
+    DrawString(4, 34, "Camera: " + std::to_string((int)fCameraX) + ", " + std::to_string((int)fCameraY) + ", chunks in memory: " + std::to_string(mapChunks.size()) + ", edited: " + std::to_string(mapEditedChunks.size()) + " (arrow keys to scroll)");
 
-    // If drawing rays, set an offscreen texture as our target buffer.
+    // If drawing rays, light up the area the source sees.
     if (GetMouse(1).bHeld && vecVisibilityPolygonPoints.size() > 1)
     {
-      // Clear offscreen buffer for sprite.
-      SetDrawTarget(buffLightTex);
-      Clear(olc::BLACK);
-
-      // Draw "Radial Light" sprite to offscreen buffer, centered around
-      // source location (the mouse coordinates, buffer is 512x512).
-      DrawSprite(fSourceX - 255, fSourceY - 255, sprLightCast);
-
-      // Clear offscreen buffer for rays.
-      SetDrawTarget(buffLightRay);
-      Clear(olc::BLANK);
-
-      // Draw each triangle in fan.
-      for (int i = 0; i < vecVisibilityPolygonPoints.size() - 1; i++)
-      {
-        FillTriangle(
-          fSourceX,
-          fSourceY,
-
-          std::get<1>(vecVisibilityPolygonPoints[i]),
-          std::get<2>(vecVisibilityPolygonPoints[i]),
-
-          std::get<1>(vecVisibilityPolygonPoints[i + 1]),
-          std::get<2>(vecVisibilityPolygonPoints[i + 1])
-        );
-      }
-
-      FillTriangle(
-        fSourceX,
-        fSourceY,
-
-        std::get<1>(vecVisibilityPolygonPoints[vecVisibilityPolygonPoints.size() - 1]),
-        std::get<2>(vecVisibilityPolygonPoints[vecVisibilityPolygonPoints.size() - 1]),
-
-        std::get<1>(vecVisibilityPolygonPoints[0]),
-        std::get<2>(vecVisibilityPolygonPoints[0])
-      );
-
-      // Wherever rays exist in ray sprite, copy over radial light sprite.
-      SetDrawTarget(nullptr);
-      for (int x = 0; x < ScreenWidth(); x++)
-        for (int y = 0; y < ScreenHeight(); y++)
-          if (buffLightRay->GetPixel(x, y).r > 0)
-            Draw(x, y, buffLightTex->GetPixel(x, y));
+      // Copy the "Radial Light" sprite, centered around the source location (the mouse
+      // coordinates, the sprite is 512x512), wherever the visibility polygon covers it.
+      DrawLightSpans(vecVisibilityPolygonPoints, fSourceX, fSourceY);
     }
 
-    // Draw blocks from tile map.
-    for (int x = 0; x < nWorldWidth; x++)
-      for (int y = 0; y < nWorldHeight; y++)
+    // Draw blocks from tile map, those on the screen.
+    int nTileX0 = nViewX / fBlockWidth, nTileX1 = std::min((nViewX + ScreenWidth()) / fBlockWidth, nWorldWidth - 1);
+    int nTileY0 = nViewY / fBlockWidth, nTileY1 = std::min((nViewY + ScreenHeight()) / fBlockWidth, nWorldHeight - 1);
+    for (int x = nTileX0; x <= nTileX1; x++)
+      for (int y = nTileY0; y <= nTileY1; y++)
       {
-        if (world[y * nWorldWidth + x].exist)
-          FillRect(x * fBlockWidth, y * fBlockWidth, fBlockWidth, fBlockWidth, olc::BLUE);
+        if (GetTile(x, y))
+          FillRect(x * fBlockWidth - nViewX, y * fBlockWidth - nViewY, fBlockWidth, fBlockWidth, olc::BLUE);
       }
 
-    // Draw edges from poly map.
+    // Draw edges from poly map, those on the screen.
     for (auto &e : vecEdges)
     {
-      DrawLine(e.sx, e.sy, e.ex, e.ey);
-      FillCircle(e.sx, e.sy, 3, olc::RED);
-      FillCircle(e.ex, e.ey, 3, olc::RED);
+      if (!e.exist || std::max(e.sx, e.ex) < nViewX || std::min(e.sx, e.ex) > nViewX + ScreenWidth() ||
+          std::max(e.sy, e.ey) < nViewY || std::min(e.sy, e.ey) > nViewY + ScreenHeight())
+        continue;
+      DrawLine(e.sx - nViewX, e.sy - nViewY, e.ex - nViewX, e.ey - nViewY);
+      FillCircle(e.sx - nViewX, e.sy - nViewY, 3, olc::RED);
+      FillCircle(e.ex - nViewX, e.ey - nViewY, 3, olc::RED);
     }
+
+    // Mark the placed lights.
+    for (auto &l : vecLights)
+      FillCircle(l.x - nViewX, l.y - nViewY, 2, l.colour);
     return true;
   }
 };